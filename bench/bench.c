@@ -0,0 +1,688 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <regex.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include "potato_regex.h"
+
+/* Benchmark of the engines over generated corpora.
+ *
+ *   make bench
+ *   obj/bench [-s corpus bytes] [-t min seconds] [-n a?^n a^n size] [-e engine] [-m mode] [filter]
+ *
+ * Every pattern of the catalogue is compiled with every engine and matched against all
+ * lines of its corpus, in every mode of the API:
+ *   find      all matches of a line with re_match(), from the end of the previous match
+ *   is-match  lines with a match, one re_is_match() per line
+ *   batch     lines with a match, all lines at once with re_match_batch()
+ *   line      lines with a match, the corpus as one buffer of lines with re_find_line()
+ * POSIX <regex.h> runs the same loops as a baseline, regexec() on every line for the modes
+ * that only test. The matches of the engines are checked against it. A row that would
+ * run the same engine as the row before it is left out.
+ *
+ * Memory of an engine is the peak of what it took from a counting allocator, the compiled
+ * buffer and what is made on first use while matching: the lazy DFA cache, the shuffle
+ * table, the visited bits and stack of the backtracker. For POSIX it is the heap taken by
+ * regcomp(), as far as the libc can tell, regexec() is not counted. */
+
+#define BENCH_MAX_EXPR 256
+
+enum Corpus {
+    CORPUS_LOG,
+    CORPUS_CSV,
+    CORPUS_TEXT,
+    CORPUS_ADVERSARIAL,
+    NCORPUS,
+};
+
+static const char *corpus_names[] = { "log", "csv", "text", "adversarial" };
+
+enum Mode {
+    MODE_FIND,
+    MODE_IS_MATCH,
+    MODE_BATCH,
+    MODE_LINE,
+    NMODE,
+};
+
+static const char *mode_names[] = { "find", "is-match", "batch", "line" };
+
+struct CorpusData {
+    char *buf;          // lines separated by '\0'
+    size_t size;
+    char **lines;
+    int nlines;
+    char *text;         // lines separated by '\n', for re_find_line()
+    char *col;          // lines without separators and where they start, for re_match_batch()
+    unsigned int *offsets;
+    unsigned char *bitmap;
+};
+
+/* posix is NULL when the expression can't be written in ERE */
+struct Pattern {
+    const char *name;
+    const char *expr;
+    const char *posix;
+    enum Corpus corpus;
+};
+
+static const struct Pattern patterns[] = {
+    // literals
+    { "literal",        "Mozilla",                      "Mozilla",                          CORPUS_LOG },
+    { "literal-miss",   "Opera/12",                     "Opera/12",                         CORPUS_LOG },
+    { "literal-text",   "the quick",                    "the quick",                        CORPUS_TEXT },
+
+    // classes
+    { "ipv4",           "\\d+\\.\\d+\\.\\d+\\.\\d+",    "[0-9]+\\.[0-9]+\\.[0-9]+\\.[0-9]+", CORPUS_LOG },
+    { "word-ing",       "[a-z]+ing",                    "[a-z]+ing",                        CORPUS_TEXT },
+    { "csv-field",      "[^,]*,[^,]*,",                 "[^,]*,[^,]*,",                     CORPUS_CSV },
+    { "email",          "\\w+@\\w+\\.com",              "[a-zA-Z0-9]+@[a-zA-Z0-9]+\\.com",  CORPUS_CSV },
+
+    // alternations
+    { "methods",        "GET|POST|PUT|DELETE",          "GET|POST|PUT|DELETE",              CORPUS_LOG },
+    { "status",         "\" (404|500|503) ",            "\" (404|500|503) ",                CORPUS_LOG },
+    { "fruits",         "apple|banana|cherry|orange|grape|lemon|mango|peach", "apple|banana|cherry|orange|grape|lemon|mango|peach", CORPUS_TEXT },
+    { "alt-classes",    "(\\d+|[a-z]+)@",               "([0-9]+|[a-z]+)@",                 CORPUS_CSV },
+
+    // quantifiers
+    { "hex-count",      "[0-9a-f]{8}",                  "[0-9a-f]{8}",                      CORPUS_CSV },
+    { "date",           "\\d{2}/\\w{3}/\\d{4}",         "[0-9]{2}/[a-zA-Z0-9]{3}/[0-9]{4}", CORPUS_LOG },
+    { "nested",         "(a|b)*c",                      "(a|b)*c",                          CORPUS_TEXT },
+    { "anchored-end",   "\\d+\\)$",                     "[0-9]+\\)$",                       CORPUS_LOG },
+
+    // pathological for backtracking engines
+    { "nested-plus",    "(x+x+)+y",                     "(x+x+)+y",                         CORPUS_ADVERSARIAL },
+    { "star-star",      "(a*)*b",                       "(a*)*b",                           CORPUS_ADVERSARIAL },
+    { "a?^n a^n",       NULL,                           NULL,                               CORPUS_ADVERSARIAL },
+};
+
+#define NPATTERNS (sizeof(patterns) / sizeof(*patterns))
+
+static FILE *out;
+
+
+///// CORPUS /////////////////////////////////////////////////////
+/* Corpora are generated from a fixed seed, every run matches the same input */
+
+static unsigned int rng = 0x2545f491;
+
+static unsigned int bench_rand(void)
+{
+    /* xorshift32 */
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+#define PICK(A) (A)[bench_rand() % (sizeof(A) / sizeof(*(A)))]
+
+static const char *words[] = {
+    "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "running", "apple",
+    "banana", "regex", "matching", "string", "potato", "cherry", "is", "a", "of", "and",
+    "singing", "grape", "to", "in", "computer", "tiny", "buffer", "bytes", "abc", "cab",
+};
+
+static const char *paths[] = {
+    "index.html", "api/v1/users", "static/app.js", "img/logo.png", "login", "search?q=abc",
+    "download/file.tar.gz", "favicon.ico",
+};
+
+static const char *methods[] = { "GET", "GET", "GET", "POST", "PUT", "DELETE", "HEAD" };
+static const int statuses[] = { 200, 200, 200, 200, 301, 304, 404, 500, 503 };
+
+static const char *agents[] = {
+    "Mozilla/5.0 (X11; Linux x86_64)",
+    "curl/7.88.1",
+    "Mozilla/5.0 (Windows NT 10.0; Win64; x64)",
+    "Wget/1.21 (linux-gnu)",
+};
+
+static int corpus_line(enum Corpus c, char *buf, size_t size)
+{
+    /* Write one line of corpus c to buf, returns its length */
+    int len = 0;
+
+    switch (c) {
+        case CORPUS_LOG:
+            len = snprintf(buf, size, "%u.%u.%u.%u - - [%02u/Oct/2024:13:%02u:%02u +0000] \"%s /%s HTTP/1.1\" %d %u \"-\" \"%s\" (%u)",
+                           bench_rand() % 256, bench_rand() % 256, bench_rand() % 256, bench_rand() % 256,
+                           bench_rand() % 28 + 1, bench_rand() % 60, bench_rand() % 60,
+                           PICK(methods), PICK(paths), PICK(statuses), bench_rand() % 100000,
+                           PICK(agents), bench_rand() % 1000);
+            break;
+        case CORPUS_CSV:
+            len = snprintf(buf, size, "%u,%s,%s@%s.com,%u.%02u,%08x,%s",
+                           bench_rand() % 100000, PICK(words), PICK(words), PICK(words),
+                           bench_rand() % 1000, bench_rand() % 100, bench_rand(), PICK(words));
+            break;
+        case CORPUS_TEXT:
+            while (len < 72 && (size_t)len < size) {
+                len += snprintf(buf+len, size-len, "%s%s", len ? " " : "", PICK(words));
+                if (bench_rand() % 8 == 0)
+                    len += snprintf(buf+len, size-len, "%c", ".,;!?"[bench_rand() % 5]);
+            }
+            break;
+        case CORPUS_ADVERSARIAL:
+            // runs of a and x that almost match, without the b or y that ends a match
+            len = 16 + bench_rand() % 32;
+            memset(buf, (bench_rand() % 2) ? 'a' : 'x', len);
+            buf[len] = '\0';
+            break;
+        default:
+            break;
+    }
+    return len;
+}
+
+static int corpus_init(struct CorpusData *cd, enum Corpus c, size_t size)
+{
+    /* Generate size bytes of lines. Lines are '\0' terminated so they can be matched
+     * without a copy */
+    char line[1024];
+
+    if ((cd->buf = malloc(size + sizeof(line))) == NULL)
+        return -1;
+    cd->size = 0;
+    cd->nlines = 0;
+
+    while (cd->size < size) {
+        int len = corpus_line(c, line, sizeof(line));
+        memcpy(cd->buf + cd->size, line, len + 1);
+        cd->size += len + 1;
+        cd->nlines++;
+    }
+
+    cd->lines = malloc(sizeof(char*) * cd->nlines);
+    cd->text = malloc(cd->size);
+    cd->col = malloc(cd->size);
+    cd->offsets = malloc(sizeof(unsigned int) * (cd->nlines + 1));
+    cd->bitmap = malloc((cd->nlines + 7) / 8);
+    if (cd->lines == NULL || cd->text == NULL || cd->col == NULL || cd->offsets == NULL || cd->bitmap == NULL)
+        return -1;
+
+    char *p = cd->buf;
+    unsigned int off = 0;
+    for (int i=0 ; i<cd->nlines ; i++) {
+        size_t len = strlen(p);
+        cd->lines[i] = p;
+        cd->offsets[i] = off;
+        memcpy(cd->col + off, p, len);
+        off += len;
+        p += len + 1;
+    }
+    cd->offsets[cd->nlines] = off;
+
+    // the same lines at the same places
+    for (size_t i=0 ; i<cd->size ; i++)
+        cd->text[i] = (cd->buf[i] == '\0') ? '\n' : cd->buf[i];
+    return 0;
+}
+
+static void corpus_free(struct CorpusData *cd)
+{
+    free(cd->buf);
+    free(cd->lines);
+    free(cd->text);
+    free(cd->col);
+    free(cd->offsets);
+    free(cd->bitmap);
+}
+
+
+///// ENGINES ////////////////////////////////////////////////////
+/* Result of a pass over a corpus. The checksum covers the bounds of all matches so
+ * engines that find different matches are caught. Modes that only test a line sum the
+ * offsets of the lines with a match */
+struct Pass {
+    long nmatch;
+    unsigned long sum;
+};
+
+#define SUM(P, LINE, START, END) ((P)->sum = (P)->sum * 31 + (LINE) * 7919 + (START) * 131 + (END))
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void pass_find(struct Regex *re, struct CorpusData *cd, struct Pass *p)
+{
+    memset(p, 0, sizeof(struct Pass));
+    for (int i=0 ; i<cd->nlines ; i++) {
+        const char *line = cd->lines[i];
+        const char *s = line;
+        for (;;) {
+            struct ReMatch m = re_match(re, s, NULL, 0);
+            if (m.state < 0)
+                break;
+            p->nmatch++;
+            SUM(p, i, (s - line) + m.istart, (s - line) + m.iend);
+
+            // an empty match moves one char ahead
+            if (m.iend == m.istart) {
+                if (s[m.iend] == '\0')
+                    break;
+                s += m.iend + 1;
+            }
+            else {
+                s += m.iend;
+            }
+        }
+    }
+}
+
+static void pass_is_match(struct Regex *re, struct CorpusData *cd, struct Pass *p)
+{
+    memset(p, 0, sizeof(struct Pass));
+    for (int i=0 ; i<cd->nlines ; i++) {
+        if (re_is_match(re, cd->lines[i])) {
+            p->nmatch++;
+            SUM(p, cd->lines[i] - cd->buf, 0, 0);
+        }
+    }
+}
+
+static void pass_batch(struct Regex *re, struct CorpusData *cd, struct Pass *p)
+{
+    memset(p, 0, sizeof(struct Pass));
+    if (re_match_batch(re, cd->offsets, cd->col, cd->nlines, cd->bitmap) <= 0)
+        return;
+    for (int i=0 ; i<cd->nlines ; i++) {
+        if (cd->bitmap[i / 8] & (1 << (i % 8))) {
+            p->nmatch++;
+            SUM(p, cd->lines[i] - cd->buf, 0, 0);
+        }
+    }
+}
+
+static void pass_line(struct Regex *re, struct CorpusData *cd, struct Pass *p)
+{
+    const char *s = cd->text;
+    const char *end = cd->text + cd->size;
+    const char *bol, *eol;
+
+    memset(p, 0, sizeof(struct Pass));
+    while (s < end && (bol = re_find_line(re, s, end, &eol)) != NULL) {
+        p->nmatch++;
+        SUM(p, bol - cd->text, 0, 0);
+        s = eol + 1;
+    }
+}
+
+static void pass_potato(struct Regex *re, struct CorpusData *cd, enum Mode mode, struct Pass *p)
+{
+    switch (mode) {
+        case MODE_FIND:     pass_find(re, cd, p); break;
+        case MODE_IS_MATCH: pass_is_match(re, cd, p); break;
+        case MODE_BATCH:    pass_batch(re, cd, p); break;
+        default:            pass_line(re, cd, p); break;
+    }
+}
+
+static void pass_posix_test(regex_t *preg, struct CorpusData *cd, struct Pass *p)
+{
+    /* Lines with a match, the baseline of the modes that only test */
+    memset(p, 0, sizeof(struct Pass));
+    for (int i=0 ; i<cd->nlines ; i++) {
+        if (regexec(preg, cd->lines[i], 0, NULL, 0) == 0) {
+            p->nmatch++;
+            SUM(p, cd->lines[i] - cd->buf, 0, 0);
+        }
+    }
+}
+
+static void pass_posix(regex_t *preg, struct CorpusData *cd, struct Pass *p)
+{
+    /* Same loop as pass_find(), the rest of a line is matched as if it is the full input */
+    regmatch_t m;
+
+    memset(p, 0, sizeof(struct Pass));
+    for (int i=0 ; i<cd->nlines ; i++) {
+        const char *line = cd->lines[i];
+        const char *s = line;
+        for (;;) {
+            if (regexec(preg, s, 1, &m, 0) != 0)
+                break;
+            p->nmatch++;
+            SUM(p, i, (s - line) + m.rm_so, (s - line) + m.rm_eo);
+
+            if (m.rm_eo == m.rm_so) {
+                if (s[m.rm_eo] == '\0')
+                    break;
+                s += m.rm_eo + 1;
+            }
+            else {
+                s += m.rm_eo;
+            }
+        }
+    }
+}
+
+static long heap_used(void)
+{
+    /* Bytes in use on the heap, -1 when the libc doesn't tell */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    return mallinfo2().uordblks;
+#else
+    return -1;
+#endif
+}
+
+/* Allocator that keeps count of the bytes in use, a block starts with its size */
+struct Counter {
+    long used;
+    long peak;
+};
+
+#define COUNTER_HEADER 16
+
+static void* counter_alloc(size_t size, void *ctx)
+{
+    struct Counter *c = ctx;
+    char *p = malloc(COUNTER_HEADER + size);
+    if (p == NULL)
+        return NULL;
+    *(size_t*)p = size;
+    c->used += size;
+    if (c->used > c->peak)
+        c->peak = c->used;
+    return p + COUNTER_HEADER;
+}
+
+static void counter_free(void *ptr, void *ctx)
+{
+    struct Counter *c = ctx;
+    if (ptr == NULL)
+        return;
+    char *p = (char*)ptr - COUNTER_HEADER;
+    c->used -= *(size_t*)p;
+    free(p);
+}
+
+static const char* engine_name(struct Regex *re, enum Mode mode)
+{
+    /* Engine that runs mode, a test engine is only known once it was used */
+    if (mode == MODE_FIND) {
+        // lines that fit the backtracker are matched with it, the others with the find engine
+        if (re->plan.find_short == RE_ENGINE_BACKTRACK)
+            return (re->plan.find == RE_ENGINE_DFA) ? "dfa+backtrack" : "nfa+backtrack";
+        return re_engine_name(re->plan.find);
+    }
+    // the shuffle DFA can't start over at a line, lines are walked with the lazy DFA
+    if (mode == MODE_LINE && re->plan.test == RE_ENGINE_SHUFFLE)
+        return re_engine_name(RE_ENGINE_DFA);
+    return re_engine_name(re->plan.test);
+}
+
+
+///// REPORT /////////////////////////////////////////////////////
+
+static void report(const char *pattern, enum Corpus c, enum Mode mode, const char *engine, double tcompile, double tpass,
+                   int npass, struct CorpusData *cd, struct Pass *p, long mem, const char *check)
+{
+    double mb = (double)cd->size * npass / (1024.0 * 1024.0);
+    char memstr[32];
+
+    if (mem >= 0)
+        snprintf(memstr, sizeof(memstr), "%ld", mem);
+    else
+        snprintf(memstr, sizeof(memstr), "-");
+
+    fprintf(out, "%-14s %-12s %-9s %-13s %11.2f %10.2f %12.0f %10s %9ld  %s\n",
+            pattern, corpus_names[c], mode_names[mode], engine, tcompile * 1e6, mb / tpass, p->nmatch * npass / tpass,
+            memstr, p->nmatch, check);
+    fflush(out);
+}
+
+static void bench_potato(const struct Pattern *pt, const char *expr, struct CorpusData *cd, int flags,
+                         enum ReEngine engine, enum Mode mode, double tmin, struct Pass *posix, char *prev)
+{
+    /* Compile and match expression with one engine, the planner picks it when engine
+     * is RE_ENGINE_AUTO. prev is the engine of the row before, the row is left out when
+     * it is the same and set to this one otherwise */
+    struct Counter cnt = { 0, 0 };
+    struct ReAllocator alloc = { counter_alloc, counter_free, &cnt };
+    struct Regex re;
+    struct Pass p;
+    int ncompile = 0;
+    int npass = 0;
+    double t0, tcompile, tpass;
+
+    // compile until it takes long enough to measure, the last one is kept
+    t0 = now();
+    for (;;) {
+        if (re_init_alloc(&re, expr, flags, &alloc) == NULL) {
+            fprintf(out, "%-14s %-12s %-9s failed to compile\n", pt->name, corpus_names[pt->corpus], mode_names[mode]);
+            return;
+        }
+        if (++ncompile >= 1000 || now() - t0 >= tmin / 10)
+            break;
+        re_free(&re);
+    }
+    tcompile = (now() - t0) / ncompile;
+    // the scratch of the compiler is given back, only the compiled buffer is counted
+    cnt.peak = cnt.used;
+
+    if (re_set_engine(&re, engine) < 0) {
+        fprintf(out, "%-14s %-12s %-9s %-13s not available\n", pt->name, corpus_names[pt->corpus], mode_names[mode],
+                re_engine_name(engine));
+        re_free(&re);
+        return;
+    }
+
+    // the DFAs are made by the first test
+    if (mode != MODE_FIND)
+        re_is_match(&re, cd->lines[0]);
+    const char *name = engine_name(&re, mode);
+    if (strcmp(name, prev) == 0) {
+        re_free(&re);
+        return;
+    }
+    strcpy(prev, name);
+
+    t0 = now();
+    do {
+        pass_potato(&re, cd, mode, &p);
+        npass++;
+    } while (now() - t0 < tmin);
+    tpass = now() - t0;
+
+    long mem = cnt.peak;
+
+    const char *check = "-";
+    if (posix != NULL)
+        check = (posix->nmatch == p.nmatch && posix->sum == p.sum) ? "ok" : "DIFF";
+
+    report(pt->name, pt->corpus, mode, name, tcompile, tpass, npass, cd, &p, mem, check);
+    re_free(&re);
+}
+
+static int bench_posix(const struct Pattern *pt, const char *expr, struct CorpusData *cd, enum Mode mode,
+                       double tmin, struct Pass *p)
+{
+    /* Baseline of mode, the modes that only test are all the same loop.
+     * Returns -1 when the expression doesn't compile */
+    regex_t preg;
+    int ncompile = 0;
+    int npass = 0;
+    double t0, tcompile, tpass;
+
+    t0 = now();
+    for (;;) {
+        if (regcomp(&preg, expr, REG_EXTENDED) != 0) {
+            fprintf(out, "%-14s %-12s %-9s posix failed to compile\n", pt->name, corpus_names[pt->corpus], mode_names[mode]);
+            return -1;
+        }
+        if (++ncompile >= 1000 || now() - t0 >= tmin / 10)
+            break;
+        regfree(&preg);
+    }
+    tcompile = (now() - t0) / ncompile;
+
+    // heap that is given back when the last one is freed
+    long mem = heap_used();
+    regfree(&preg);
+    if (mem >= 0)
+        mem -= heap_used();
+    regcomp(&preg, expr, REG_EXTENDED);
+
+    t0 = now();
+    do {
+        if (mode == MODE_FIND)
+            pass_posix(&preg, cd, p);
+        else
+            pass_posix_test(&preg, cd, p);
+        npass++;
+    } while (now() - t0 < tmin);
+    tpass = now() - t0;
+
+    report(pt->name, pt->corpus, mode, "posix", tcompile, tpass, npass, cd, p, mem, "");
+    regfree(&preg);
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s corpus bytes] [-t min seconds] [-n a?^n a^n size] [-e engine] [-m mode] [filter]\n", name);
+}
+
+static int engine_from_name(const char *name)
+{
+    /* Returns the engine, or -1 when there is none of that name */
+    for (int e=RE_ENGINE_AUTO ; e<=RE_ENGINE_LITERAL ; e++) {
+        if (strcmp(re_engine_name(e), name) == 0)
+            return e;
+    }
+    return -1;
+}
+
+static int mode_from_name(const char *name)
+{
+    /* Returns the mode, or -1 when there is none of that name */
+    for (int m=0 ; m<NMODE ; m++) {
+        if (strcmp(mode_names[m], name) == 0)
+            return m;
+    }
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    size_t size = 64 * 1024;
+    double tmin = 0.2;
+    int n = 16;
+    const char *filter = NULL;
+    int engine = RE_ENGINE_AUTO;
+    int mode = -1;          // all of them
+    struct CorpusData corpora[NCORPUS];
+    char blowup[BENCH_MAX_EXPR];
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:t:n:e:m:h")) != -1) {
+        switch (opt) {
+            case 's':
+                size = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                tmin = atof(optarg);
+                break;
+            case 'n':
+                n = atoi(optarg);
+                break;
+            case 'e':
+                if ((engine = engine_from_name(optarg)) < 0) {
+                    fprintf(stderr, "Unknown engine: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'm':
+                if ((mode = mode_from_name(optarg)) < 0) {
+                    fprintf(stderr, "Unknown mode: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc)
+        filter = argv[optind];
+    if (n < 1 || 3*n >= BENCH_MAX_EXPR) {
+        fprintf(stderr, "n must be 1 to %d\n", (BENCH_MAX_EXPR - 1) / 3);
+        return 1;
+    }
+
+    // a?a?...a?aa...a, matches a^n in 2^n ways
+    for (int i=0 ; i<n ; i++)
+        memcpy(blowup + 2*i, "a?", 2);
+    memset(blowup + 2*n, 'a', n);
+    blowup[3*n] = '\0';
+
+    // the report goes to the real stdout, the chatter of the library doesn't
+    if ((out = fdopen(dup(STDOUT_FILENO), "w")) == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("stdout");
+        return 1;
+    }
+
+    for (int c=0 ; c<NCORPUS ; c++) {
+        if (corpus_init(&corpora[c], c, size) < 0) {
+            fprintf(stderr, "Failed to generate corpus\n");
+            return 1;
+        }
+    }
+
+    fprintf(out, "corpus: %zu bytes each, min %.2fs per run\n\n", size, tmin);
+    fprintf(out, "%-14s %-12s %-9s %-13s %11s %10s %12s %10s %9s  %s\n",
+            "pattern", "corpus", "mode", "engine", "compile(us)", "MB/s", "matches/s", "memory", "matches", "vs posix");
+
+    for (unsigned int i=0 ; i<NPATTERNS ; i++) {
+        const struct Pattern *pt = &patterns[i];
+        const char *expr = pt->expr ? pt->expr : blowup;
+        const char *posix = pt->expr ? pt->posix : blowup;
+        struct CorpusData *cd = &corpora[pt->corpus];
+        struct Pass pp[2], *ppp[2] = { NULL, NULL };   // baselines of find and of the tests
+        int has_posix[2] = { 0, 0 };
+
+        if (filter != NULL && strstr(pt->name, filter) == NULL)
+            continue;
+
+        for (int m=0 ; m<NMODE ; m++) {
+            char prev[64] = "posix";
+
+            if (mode >= 0 && m != mode)
+                continue;
+
+            // the modes that only test are one loop for POSIX, it runs with the first of them
+            int b = (m != MODE_FIND);
+            if (posix != NULL && !has_posix[b]) {
+                has_posix[b] = 1;
+                if (bench_posix(pt, posix, cd, m, tmin, &pp[b]) == 0)
+                    ppp[b] = &pp[b];
+            }
+
+            // a forced engine runs alone, the position automaton needs its own flag
+            if (engine == RE_ENGINE_AUTO) {
+                bench_potato(pt, expr, cd, RE_FLAG_NONE, engine, m, tmin, ppp[b], prev);
+                bench_potato(pt, expr, cd, RE_GLUSHKOV, engine, m, tmin, ppp[b], prev);
+            }
+            else {
+                bench_potato(pt, expr, cd, (engine == RE_ENGINE_GLUSHKOV) ? RE_GLUSHKOV : RE_FLAG_NONE, engine, m, tmin, ppp[b], prev);
+            }
+        }
+        fprintf(out, "\n");
+    }
+
+    for (int c=0 ; c<NCORPUS ; c++)
+        corpus_free(&corpora[c]);
+    fclose(out);
+    return 0;
+}
@@ -5,9 +5,169 @@
 
 #include "potato_regex.h"
 
+/* Options of line mode */
+enum GrepFlag {
+    GREP_LINES  = 1 << 0,   // inputs are files, print the lines with a match
+    GREP_COUNT  = 1 << 1,   // print the amount of lines instead
+    GREP_LIST   = 1 << 2,   // print the name of files that have a line
+    GREP_INVERT = 1 << 3,   // select lines without a match
+    GREP_EXPLAIN = 1 << 4,  // print the engines picked for the expression to stderr
+};
+
+static int parse_opts(const char *arg)
+{
+    /* Parse options like "-cv".
+     * Returns flags, or -1 on an unknown option */
+    int opts = GREP_LINES;
+
+    for (arg++ ; *arg ; arg++) {
+        switch (*arg) {
+            case 'f': break;
+            case 'c': opts |= GREP_COUNT; break;
+            case 'l': opts |= GREP_LIST; break;
+            case 'v': opts |= GREP_INVERT; break;
+            case 'x': opts |= GREP_EXPLAIN; break;
+            default:
+                ERROR("Unknown option: -%c\n", *arg);
+                return -1;
+        }
+    }
+    return opts;
+}
+
+static char* read_file(FILE *f, size_t *n)
+{
+    /* Read all of file into a buffer, free it with free().
+     * Returns NULL on error */
+    size_t size = 64 * 1024;
+    char *buf = malloc(size);
+    char *bak;
+
+    *n = 0;
+    while (buf != NULL) {
+        *n += fread(buf + *n, 1, size - *n, f);
+        if (*n < size)
+            break;
+        size *= 2;
+        bak = buf;
+        if ((buf = realloc(buf, size)) == NULL)
+            free(bak);
+    }
+
+    if (buf == NULL || ferror(f)) {
+        ERROR("Failed to read input\n");
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+static long grep(struct Regex *re, const char *name, const char *data, size_t n, int opts)
+{
+    /* Select the lines of data. Lines are only looked at when they are printed,
+     * -c and -l don't need them. With -v the lines between two lines with a match
+     * are split with memchr().
+     * Returns amount of lines selected, -l stops at the first one */
+    const char *p = data;
+    const char *end = data + n;
+    const char *eol;
+    long count = 0;
+    int is_done = 0;
+
+    while (!is_done && p < end) {
+        const char *bol = re_find_line(re, p, end, &eol);
+
+        if (opts & GREP_INVERT) {
+            const char *stop = (bol != NULL) ? bol : end;
+            while (!is_done && p < stop) {
+                const char *nl = memchr(p, '\n', stop - p);
+                const char *le = (nl != NULL) ? nl : stop;
+                count++;
+                is_done = (opts & GREP_LIST) != 0;
+                if (!(opts & (GREP_COUNT | GREP_LIST)))
+                    printf("%s%s%.*s\n", name ? name : "", name ? ":" : "", (int)(le - p), p);
+                p = le + 1;
+            }
+        }
+        else if (bol != NULL) {
+            count++;
+            is_done = (opts & GREP_LIST) != 0;
+            if (!(opts & (GREP_COUNT | GREP_LIST)))
+                printf("%s%s%.*s\n", name ? name : "", name ? ":" : "", (int)(eol - bol), bol);
+        }
+
+        if (bol == NULL)
+            break;
+        p = eol + 1;
+    }
+
+    if (opts & GREP_LIST) {
+        if (count > 0)
+            printf("%s\n", name ? name : "(standard input)");
+    }
+    else if (opts & GREP_COUNT) {
+        printf("%s%s%ld\n", name ? name : "", name ? ":" : "", count);
+    }
+    return count;
+}
+
+static int grep_files(const char *expr, int opts, char **files, int nfiles)
+{
+    /* Line mode, stdin is read when there are no files.
+     * Returns exit code, 0 when a line was selected */
+    struct Regex re;
+    long total = 0;
+    int ret = 1;
+
+    if (re_init_flags(&re, expr, RE_LINES) == NULL) {
+        ERROR("Failed init\n");
+        return 2;
+    }
+    if (opts & GREP_EXPLAIN)
+        re_explain(&re, stderr);
+
+    for (int i=0 ; i<nfiles || (i == 0 && nfiles == 0) ; i++) {
+        FILE *f = (nfiles > 0) ? fopen(files[i], "rb") : stdin;
+        size_t n;
+        char *data;
+
+        if (f == NULL) {
+            ERROR("Failed to open: %s\n", files[i]);
+            ret = 2;
+            continue;
+        }
+        data = read_file(f, &n);
+        if (f != stdin)
+            fclose(f);
+        if (data == NULL) {
+            ret = 2;
+            continue;
+        }
+
+        // files are named when there is more than one, -l always names them
+        const char *name = (nfiles > 1 || ((opts & GREP_LIST) && nfiles > 0)) ? files[i] : NULL;
+        total += grep(&re, name, data, n, opts);
+        free(data);
+    }
+
+    re_free(&re);
+    return (total > 0) ? 0 : ret;
+}
+
 
 int main(int argc, char **argv)
 {
+    if (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0') {
+        int opts = parse_opts(argv[1]);
+        if (opts < 0)
+            return 2;
+        if (argc < 3) {
+            ERROR("Missing expression\n");
+            return 2;
+        }
+        return grep_files(argv[2], opts, argv + 3, argc - 3);
+    }
+
     if (argc < 2) {
         ERROR("Missing expression\n");
         return 1;
@@ -33,6 +193,8 @@ int main(int argc, char **argv)
     struct ReMatch m = re_match(&re, input, result, RE_MAX_STR_RESULT);
     if (m.state >= 0) {
         re_match_debug(&m);
+        printf("%s\n", m.result);
     }
-    return 1;
+    re_free(&re);
+    return m.state >= 0 ? 0 : 1;
 }
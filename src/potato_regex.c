@@ -1,6 +1,14 @@
 #include "potato_regex.h"
 
-static struct ReState* re_state_init(struct Regex *re, struct ReToken *t, enum ReStateType type, struct ReState *s_out, struct ReState *s_out1);
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <tmmintrin.h>
+#endif
+
+static struct ReState* re_state_init(struct Regex *re, enum ReStateType type, struct ReState *s_out, struct ReState *s_out1);
+static char* re_state_to_str(struct ReState *s);
 static struct OutList* ol_init(struct OutList *l, struct ReState **s);
 static struct Group group_init(struct ReState *s_start, struct OutList *out);
 
@@ -8,21 +16,72 @@ static void   group_patch_outlist(struct Group *g, struct ReState **s);
 static struct OutList* outlist_join(struct OutList *l0, struct OutList *l1);
 
 //static struct ReToken re_str_to_token(const char **s);
-static struct ReToken* re_token_from_str(struct ReToken *tok, const char **s);
+static struct ReToken* re_token_from_str(struct ReToken *tok, const char **s, int in_cclass, int flags);
 static char* re_token_to_str(struct  ReToken *t);
+#ifdef DO_DEBUG
 static const char* re_token_type_to_str(enum ReTokenType type);
-static int re_match_list_has_token(struct MatchList *clist, struct MatchList *nlist, char c);
+#endif
+static int re_match_list_has_token(struct Regex *re, struct MatchList *clist, struct MatchList *nlist, char c);
+static void re_match_list_append(struct Regex *re, struct MatchList *l, struct ReState *s, unsigned int start);
+static void re_stats_add(struct Regex *re, unsigned long nbytes, unsigned long nstates, unsigned long peak);
+static void re_plan(struct Regex *re);
 
 static struct ReToken* re_tokenlist_token_init(struct TokenList *tl, enum ReTokenType type);
-static int re_token_match_class(struct ReToken *t, char c);
 static int re_is_in_range(char c, char lc, char rc);
-static int re_token_match_chr(struct ReToken *t, char c);
 
-static struct ReState* re_compile(struct Regex *re, struct TokenList *tl);
-
-struct TokenList infix;
-//struct ReToken tpool[RE_MAX_TOKEN_POOL];
-//int tpool_n = 0;
+static struct ReState* re_compile(struct Regex *re, struct ReArena *a, struct ReAst **nodes, int nnodes);
+static struct ReGlushkov* re_glushkov_compile(struct ReGlushkov *gl, struct ReArena *a, struct ReAst **nodes, int nnodes, int maxpos);
+static void re_glushkov_match(struct Regex *re, const char *str, unsigned int from, unsigned int len, struct ReMatch *m);
+static int re_dfa_match(struct Regex *re, const char *str, unsigned int from, unsigned int len, struct ReMatch *m);
+
+/* Pool capacities for an expression. Derived from a dry run of the tokenizer
+ * so a Regex only takes the memory the expression actually needs. */
+struct ReSizes {
+    int ntokens;        // token pool, all tokens for strings or the items of classes
+    int nlist;          // token pointer list, only for an alternation of strings
+    int nstates;        // NFA states, one per char, class, quantifier and '|' + the match state
+    int npos;           // Glushkov positions, one per char or class
+    int nwords;         // words in a Glushkov position set
+    int nast;           // syntax tree nodes, the tokens + the nodes added by the rewrites
+    int nclass;         // char classes, one per class token + one per merged alternation
+    int nstr;           // chars in merged strings
+    int nacnodes;       // Aho-Corasick trie nodes, one per char + the root. 0 if not used
+    int naccls;         // Aho-Corasick byte classes, one per distinct char + the rest
+    int ncounters;      // counting states
+    int nrings;         // entries in the ring buffers of all counters
+                        // states and counters are doubled when the expression ends with $
+                        // or groups are captured
+    int nthreads;       // entries of a match list, a state once. With RE_CAPTURE a counting
+                        // state once for every count
+    int ncaps;          // capture slots of a thread, 2 per group. 0 without RE_CAPTURE
+    int nlit;           // bytes of the string when the expression is one. 0 if not used
+};
+
+#define RE_ALIGN(N) (((N) + RE_ARENA_ALIGN - 1) & ~(RE_ARENA_ALIGN - 1))
+
+static size_t re_sizes_resident(struct ReSizes *sz);
+static size_t re_sizes_scratch(struct ReSizes *sz);
+static struct Regex* re_init_pools(struct Regex *re, struct ReArena *a, struct ReArena *t, const char *expr, int flags, struct ReSizes *sz);
+
+// Start of a thread when there is no thread
+#define RE_NO_START ((unsigned int)-1)
+
+// Length of an input that ends at '\0'
+#define RE_NO_LEN ((unsigned int)-1)
+
+// Count a state that is taken, only in a debug build for re_dot()
+#ifdef DO_DEBUG
+    #define RE_HIT(S) ((S)->hits++)
+#else
+    #define RE_HIT(S) do {} while (0)
+#endif
+
+#define RE_SET_TEST(S, I) ((S)[(I) / RE_SET_BITS] & (1u << ((I) % RE_SET_BITS)))
+#define RE_SET_ADD(S, I)  ((S)[(I) / RE_SET_BITS] |= (1u << ((I) % RE_SET_BITS)))
+
+#define RE_CLASS_TEST(C, X) RE_SET_TEST((C)->bits, (unsigned char)(X))
+#define RE_CLASS_ADD(C, X)  RE_SET_ADD((C)->bits, (unsigned char)(X))
+#define RE_CLASS_DEL(C, X)  ((C)->bits[(unsigned char)(X) / RE_SET_BITS] &= ~(1u << ((unsigned char)(X) % RE_SET_BITS)))
 
 static int re_is_digit(char c)
 {
@@ -39,6 +98,12 @@ static int re_is_lower(char c)
     return c >= 'a' && c <= 'z';
 }
 
+static char re_other_case(char c)
+{
+    /* Letter in the other case, other chars are returned as is */
+    return re_is_alpha(c) ? (c ^ 0x20) : c;
+}
+
 static int re_is_whitespace(char c)
 {
     for (unsigned int i=0 ; i<strlen(RE_RE_SPACE_CHARS) ; i++) {
@@ -72,62 +137,153 @@ static int re_is_in_range(char c, char lc, char rc)
 }
 
 
+/* ///// ARENA ///////////////////////////////////////
+ * Bump allocator that holds all memory for a compiled expression.
+ */
+void re_arena_init(struct ReArena *a, void *buf, size_t size)
+{
+    a->buf = buf;
+    a->size = size;
+    a->used = 0;
+}
+
+void* re_arena_alloc(struct ReArena *a, size_t size)
+{
+    /* Get aligned chunk of zeroed memory from arena */
+    size_t start = RE_ALIGN((size_t)(a->buf + a->used)) - (size_t)a->buf;
+    if (start + size > a->size) {
+        ERROR("Arena full: %ld/%ld, requested=%ld\n", a->used, a->size, size);
+        return NULL;
+    }
+    a->used = start + size;
+    memset(a->buf + start, 0, size);
+    return a->buf + start;
+}
+
+static void* re_arena_cb_alloc(size_t size, void *ctx)
+{
+    return re_arena_alloc(ctx, size);
+}
+
+static void re_arena_cb_free(void *ptr, void *ctx)
+{
+    /* Arena memory is released in bulk by the owner of the arena */
+    (void)ptr;
+    (void)ctx;
+}
+
+struct ReAllocator re_arena_allocator(struct ReArena *a)
+{
+    /* Allocator that serves from an arena, eg: a per request pool in a server */
+    struct ReAllocator alloc = { re_arena_cb_alloc, re_arena_cb_free, a };
+    return alloc;
+}
+
+
+/* ///// ALLOCATOR ///////////////////////////////////
+ * Default allocator used by re_init()
+ */
+static void* re_std_alloc(size_t size, void *ctx)
+{
+    (void)ctx;
+    return malloc(size);
+}
+
+static void re_std_free(void *ptr, void *ctx)
+{
+    (void)ctx;
+    free(ptr);
+}
+
+static const struct ReAllocator re_std_allocator = { re_std_alloc, re_std_free, NULL };
+
+
 /* ///// STATE ///////////////////////////////////////
  * States are chained to form a tree like structure that we can use to match characters to.
  */
-static struct ReState* re_state_init(struct Regex *re, struct ReToken *t, enum ReStateType type, struct ReState *s_out, struct ReState *s_out1)
+static struct ReState* re_state_init(struct Regex *re, enum ReStateType type, struct ReState *s_out, struct ReState *s_out1)
 {
-    /* Find unused state in pool */
-    struct ReState *s = re->spool;
-    for (int i=0 ; i<RE_MAX_STATE_POOL ; i++, s++) {
-        if (!s->is_alloc) {
-            s->is_alloc = 1;
-            s->t = t;
-            s->out = s_out;
-            s->out1 = s_out1;
-            s->type = type;
-            return s;
-        }
+    /* Get next unused state from pool */
+    if (re->spooln >= re->spoolmax) {
+        ERROR("Max states reached: %d\n", re->spoolmax);
+        return NULL;
     }
-    ERROR("Max states reached: %d\n", RE_MAX_STATE_POOL);
-    return NULL;
+    struct ReState *s = re->spool + re->spooln++;
+    s->c = '\0';
+    s->span = 0;
+    s->cls = NULL;
+    s->out = s_out;
+    s->out1 = s_out1;
+    s->type = type;
+    s->cnt = NULL;
+    s->slot = 0;
+    s->lastlist = 0;
+    s->laststart = 0;
+    s->lastidx = 0;
+#ifdef DO_DEBUG
+    s->hits = 0;
+#endif
+    return s;
+}
+
+static void re_state_set_ast(struct ReState *s, struct ReAst *n)
+{
+    /* Take char, class or anchor from syntax tree leaf */
+    switch (n->type) {
+        case RE_AST_BOL:
+            s->type = STATE_TYPE_BOL;
+            break;
+        case RE_AST_EOL:
+            s->type = STATE_TYPE_EOL;
+            break;
+        default:
+            s->type = STATE_TYPE_NONE;
+            break;
+    }
+    s->c = n->c;
+    s->span = n->span;
+    s->cls = n->cls;
+}
+
+static int re_state_match_chr(struct ReState *s, char c)
+{
+    /* A char is a range with a span of 0, the compare is the same for both */
+    if (s->cls != NULL)
+        return RE_CLASS_TEST(s->cls, c) != 0;
+    return (unsigned char)(c - s->c) <= s->span;
 }
 
-void re_state_debug(struct ReState *s, int level)
+void re_state_debug(struct Regex *re, struct ReState *s, int level)
 {
+    /* Print states reachable from s. Caller should bump re->listid first,
+     * states that are already printed are marked so loops are only followed once. */
     const int spaces = 2;
 
-    if (s == NULL) {
-        //printf("-> NULL\n");
+    if (s == NULL)
         return;
-    }
+
     for (int i=0 ; i<level*spaces ; i++)
         printf(" ");
 
+    if (s->lastlist == re->listid) {
+        printf("LOOP: %s\n", re_state_to_str(s));
+        return;
+    }
+    s->lastlist = re->listid;
+
     switch (s->type) {
         case STATE_TYPE_MATCH:
             printf("MATCH!\n");
             return;
         case STATE_TYPE_SPLIT:
-            printf("SPLIT: %s %s\n", re_token_type_to_str(s->t->type), re_token_to_str(s->t));
-
-            // don't follow start and plus because that would create endless loop
-            if (s->t->type == RE_TOK_TYPE_PLUS || s->t->type == RE_TOK_TYPE_STAR) {
-                for (int i=0 ; i<level*spaces ; i++)
-                    printf(" ");
-                printf("  RECURSIVE: %s %s\n", re_token_type_to_str(s->out->t->type), re_token_to_str(s->out->t));
-                re_state_debug(s->out1, level+1);
-                return;
-            }
+            printf("SPLIT\n");
             break;
         default:
-            printf("State: ");
-            printf("%s %s\n", re_token_type_to_str(s->t->type), re_token_to_str(s->t));
+            printf("State: %s\n", re_state_to_str(s));
             break;
-
     }
-    re_state_debug(s->out, level+1);
-    re_state_debug(s->out1, level+1);
+    re_state_debug(re, s->out, level+1);
+    re_state_debug(re, s->out1, level+1);
 }
 
 /* ///// OUTLIST /////////////////////////////////////////////////
@@ -190,124 +346,441 @@ static void group_patch_outlist(struct Group *g, struct ReState **s)
 }
 
 
-/* ///// MATCH LIST ////////////////////////////////
- * Is used while matching the input string against the NFA state machine.
- * They hold the states that need to be checked against a character
+/* ///// COUNTER ///////////////////////////////////////
+ * A counting state repeats its char or class min to max times with one state,
+ * the repetitions of the threads in it are kept in a ReCounter.
  */
-static struct MatchList re_match_list_init()
+#define RE_COUNT_AT(C, I) ((C)->ring + ((C)->head + (I)) % (C)->cap)
+
+static struct ReCounter* re_counter_init(struct Regex *re, int min, int max)
 {
-    struct MatchList l;
-    memset(&l, 0, sizeof(struct MatchList));
-    l.n = 0;
-    return l;
+    /* Get next unused counter from pool.
+     * With a max, entries that are alive have done 0..max-1 repetitions and one more
+     * can enter. Without a max, 0..min-1, one merged entry past min and the new one. */
+    int cap = (max >= 0 ? max : min + 1) + 1;
+
+    if (re->ncounters >= re->maxcounters || re->nrings + cap > re->maxrings) {
+        ERROR("Max counters reached: %d, entries: %d\n", re->maxcounters, re->maxrings);
+        return NULL;
+    }
+    struct ReCounter *cnt = re->counters + re->ncounters++;
+    cnt->min = min;
+    cnt->max = max;
+    cnt->ring = re->rings + re->nrings;
+    cnt->cap = cap;
+    cnt->head = 0;
+    cnt->n = 0;
+    re->nrings += cap;
+    return cnt;
 }
 
-static void re_match_list_append(struct MatchList *l, struct ReState *s)
+static int re_counter_enter(struct ReCounter *cnt, unsigned int pos, unsigned int start)
 {
-    if (s == NULL)
-        return;
-
-    //DEBUG("MATCHLIST APPEND: %s %s\n", re_token_type_to_str(s->t->type), re_token_to_str(s->t));
+    /* Add thread that enters the counting state before the char at pos.
+     * Returns 0 when a thread that started further left already entered at pos */
+    struct ReCount *e;
+
+    if (cnt->n > 0) {
+        e = RE_COUNT_AT(cnt, cnt->n - 1);
+        if (e->pos == pos) {
+            if (start >= e->start)
+                return 0;
+            e->start = start;
+            return 1;
+        }
+    }
+    assert(cnt->n < cnt->cap);
+    e = RE_COUNT_AT(cnt, cnt->n++);
+    e->pos = pos;
+    e->start = start;
+    return 1;
+}
 
-    if (s->type == STATE_TYPE_SPLIT) {
-        re_match_list_append(l, s->out);
-        re_match_list_append(l, s->out1);
+static int re_counter_step(struct ReCounter *cnt, unsigned int pos, int is_match, unsigned int *exit, unsigned int *left)
+{
+    /* Move the entries that entered before pos over the char at pos, they all die
+     * when it is not matched. exit is set to the leftmost start of the entries that
+     * repeated enough to leave the state, left to the leftmost start of the entries
+     * that can repeat more. Entries that enter at pos+1 are not touched.
+     * Returns amount of entries that can repeat more */
+    struct ReCount *e;
+    unsigned int reps;
+    int nold = 0;
+    int ndrop = 0;
+
+    *exit = RE_NO_START;
+    *left = RE_NO_START;
+
+    while (nold < cnt->n && RE_COUNT_AT(cnt, nold)->pos <= pos)
+        nold++;
+
+    if (!is_match) {
+        ndrop = nold;
     }
     else {
-        l->states[l->n] = s;
-        l->n++;
+        for (int i=0 ; i<nold ; i++) {
+            e = RE_COUNT_AT(cnt, i);
+            reps = pos + 1 - e->pos;
+            if (reps >= (unsigned int)cnt->min && (cnt->max < 0 || reps <= (unsigned int)cnt->max) && e->start < *exit)
+                *exit = e->start;
+        }
+
+        // oldest entries are in front, drop the ones at max or merge the ones past min
+        if (cnt->max >= 0) {
+            while (ndrop < nold && pos + 1 - RE_COUNT_AT(cnt, ndrop)->pos >= (unsigned int)cnt->max)
+                ndrop++;
+        }
+        else {
+            while (ndrop + 1 < nold && pos + 1 - RE_COUNT_AT(cnt, ndrop+1)->pos >= (unsigned int)cnt->min) {
+                e = RE_COUNT_AT(cnt, ndrop+1);
+                if (RE_COUNT_AT(cnt, ndrop)->start < e->start)
+                    e->start = RE_COUNT_AT(cnt, ndrop)->start;
+                ndrop++;
+            }
+        }
     }
+    cnt->head = (cnt->head + ndrop) % cnt->cap;
+    cnt->n -= ndrop;
+    nold -= ndrop;
+
+    for (int i=0 ; i<nold ; i++) {
+        e = RE_COUNT_AT(cnt, i);
+        if (e->start < *left)
+            *left = e->start;
+    }
+    return nold;
 }
 
-static int re_match_list_has_token(struct MatchList *clist, struct MatchList *nlist, char c)
+static void re_counter_drop_after(struct ReCounter *cnt, unsigned int start)
 {
-    /* Look for state->t that match given char. Add matches to nlist.
-     * Returns amount of matches. */
-    struct ReState **s = clist->states;
-
-    for (int i=0 ; i<clist->n ; i++, s++) {
-        //DEBUG("   [%d] TRYING FROM MATCHLIST: %s %s\n", i, re_token_type_to_str((*s)->t->type), re_token_to_str((*s)->t));
-        if (re_token_match_chr((*s)->t, c)) {
-            DEBUG("  ACCEPTED: %s %s\n", re_token_type_to_str((*s)->t->type), re_token_to_str((*s)->t));
-            re_match_list_append(nlist, (*s)->out);
-            re_match_list_append(nlist, (*s)->out1);
-        }
+    /* Drop entries of threads that started after start */
+    int n = 0;
+    for (int i=0 ; i<cnt->n ; i++) {
+        struct ReCount *e = RE_COUNT_AT(cnt, i);
+        if (e->start <= start)
+            *RE_COUNT_AT(cnt, n++) = *e;
     }
-    return nlist->n;
+    cnt->n = n;
 }
 
-static struct ReState* re_match_list_has_match(struct MatchList *l)
+static void re_counters_reset(struct Regex *re)
 {
-    struct ReState **s = l->states;
-    for (int i=0 ; i<l->n ; i++, s++) {
-        if ((*s)->type == STATE_TYPE_MATCH)
-            return *s;
+    /* Empty all counters, they are left over from the last match */
+    for (int j=0 ; j<re->ncounters ; j++) {
+        re->counters[j].n = 0;
+        re->counters[j].last = 0;
     }
-    return NULL;
 }
 
+/* A UTF-8 counting state takes no byte itself, the byte sequences of its char follow it
+ * and end in a UTF8_NEXT state that counts the char for the entries it belongs to.
+ * Threads only start on the first byte of a char, so a char can only start where the
+ * last counted one ended or where a thread entered after that. Only the newest of
+ * those places can still be in a char, a char that started before it can't go on past
+ * a place where another one ended. */
+static unsigned int re_counter_utf8_at(struct ReCounter *cnt, unsigned int pos)
+{
+    /* Where the char that is going on at pos started */
+    unsigned int at = cnt->last;
+    for (int i=0 ; i<cnt->n ; i++) {
+        struct ReCount *e = RE_COUNT_AT(cnt, i);
+        if (e->pos > at && e->pos < pos)
+            at = e->pos;
+    }
+    return at;
+}
 
-/* ///// TOKENLIST ///////////////////////////////
-   Is an array of enums that represent the parsed regex string
-*/
-struct TokenList re_tokenlist_init()
+static int re_counter_enter_utf8(struct ReCounter *cnt, unsigned int pos, unsigned int start)
 {
-    struct TokenList tl;
-    for (int i=0 ; i<RE_MAX_REGEX ; i++) {
-        tl.tokens[i] = NULL;
+    /* Add thread that enters the UTF-8 counting state before the byte at pos. Entries
+     * that aren't in the char going on at pos are dropped, its char can still end at pos.
+     * Returns 0 when a thread that started further left already entered at pos */
+    unsigned int at = re_counter_utf8_at(cnt, pos);
+    struct ReCount *e;
+    int n = 0;
+
+    for (int i=0 ; i<cnt->n ; i++) {
+        e = RE_COUNT_AT(cnt, i);
+        if (e->pos == at || e->pos >= pos)
+            *RE_COUNT_AT(cnt, n++) = *e;
     }
-    tl.n = 0;
-    return tl;
+    cnt->n = n;
+
+    if (cnt->n > 0) {
+        e = RE_COUNT_AT(cnt, cnt->n - 1);
+        if (e->pos == pos && e->reps == 0) {
+            if (start >= e->start)
+                return 0;
+            e->start = start;
+            return 1;
+        }
+    }
+    assert(cnt->n < cnt->cap);
+    e = RE_COUNT_AT(cnt, cnt->n++);
+    e->pos = pos;
+    e->start = start;
+    e->reps = 0;
+    return 1;
 }
 
-int re_tokenlist_append(struct TokenList *tl, struct ReToken *t)
+static int re_counter_next_utf8(struct ReCounter *cnt, unsigned int pos, unsigned int *exit, unsigned int *left)
 {
-    if (tl->n >= RE_MAX_REGEX) {
-        ERROR("List full, max=%d\n", RE_MAX_REGEX);
-        return -1;
+    /* A char ended before pos, count it for the entries that were in it and drop the
+     * ones that weren't. Entries that enter at pos are not touched. exit and left are
+     * set like re_counter_step() does.
+     * Returns amount of entries that can repeat more */
+    unsigned int at = re_counter_utf8_at(cnt, pos);
+    struct ReCount *e;
+    int n = 0;
+    int nold = 0;
+    int ndrop = 0;
+
+    *exit = RE_NO_START;
+    *left = RE_NO_START;
+
+    // entries that counted the char are in front, the ones that wait for their first behind
+    for (int i=0 ; i<cnt->n ; i++) {
+        e = RE_COUNT_AT(cnt, i);
+        if (e->pos < pos && e->pos != at)
+            continue;
+        if (e->pos < pos) {
+            e->pos = pos;
+            e->reps++;
+            if (e->reps >= (unsigned int)cnt->min && (cnt->max < 0 || e->reps <= (unsigned int)cnt->max) && e->start < *exit)
+                *exit = e->start;
+            nold++;
+        }
+        *RE_COUNT_AT(cnt, n++) = *e;
     }
+    cnt->n = n;
+    cnt->last = pos;
 
-    tl->tokens[tl->n++] = t;
-    return 1;
+    // oldest entries are in front, drop the ones at max or merge the ones past min
+    if (cnt->max >= 0) {
+        while (ndrop < nold && RE_COUNT_AT(cnt, ndrop)->reps >= (unsigned int)cnt->max)
+            ndrop++;
+    }
+    else {
+        while (ndrop + 1 < nold && RE_COUNT_AT(cnt, ndrop+1)->reps >= (unsigned int)cnt->min) {
+            e = RE_COUNT_AT(cnt, ndrop+1);
+            if (RE_COUNT_AT(cnt, ndrop)->start < e->start)
+                e->start = RE_COUNT_AT(cnt, ndrop)->start;
+            ndrop++;
+        }
+    }
+    cnt->head = (cnt->head + ndrop) % cnt->cap;
+    cnt->n -= ndrop;
+    nold -= ndrop;
+
+    for (int i=0 ; i<nold ; i++) {
+        e = RE_COUNT_AT(cnt, i);
+        if (e->start < *left)
+            *left = e->start;
+    }
+    return nold;
+}
+
+
+/* ///// MATCH LIST ////////////////////////////////
+ * Is used while matching the input string against the NFA state machine.
+ * They hold the states that need to be checked against a character
+ */
+static void re_match_list_init(struct Regex *re, struct MatchList *l, unsigned int pos)
+{
+    /* Empty list, bumping the list id invalidates the lastlist marks of all states */
+    l->n = 0;
+    l->pos = pos;
+    re->listid++;
 }
 
-static int re_tokenlist_delete_at_index(struct TokenList *tl, int index)
+static void re_match_list_store(struct Regex *re, struct MatchList *l, struct ReState *s, unsigned int start)
 {
-    if (index > tl->n-1) {
-        ERROR("Failed to delete token, index out of bounds: %d>%d\n", index, tl->n-1);
-        return -1;
+    /* Put state in list, or hand it to the thread when it started further left */
+    if (s->lastlist != re->listid) {
+        s->lastlist = re->listid;
+        s->laststart = start;
+        s->lastidx = l->n;
+        l->states[l->n] = s;
+        l->starts[l->n] = start;
+        l->n++;
     }
-    DEBUG("DELETE @ %d -> %s %s\n", index, re_token_type_to_str((*(tl->tokens+index))->type), re_token_to_str(*(tl->tokens+index)));
+    else if (start < s->laststart) {
+        s->laststart = start;
+        l->starts[s->lastidx] = start;
+    }
+}
 
-    for (int i=index ; i<tl->n ; i++) {
-        if (i < tl->n-1)
-            *(tl->tokens+i) = *(tl->tokens+i+1);
-        else
+static void re_match_list_append(struct Regex *re, struct MatchList *l, struct ReState *s, unsigned int start)
+{
+    /* Add state, or the states it splits into, for a thread that started at start.
+     * When a state is already in the list the thread that started leftmost keeps it,
+     * the states that follow a split are taken over as well */
+    unsigned int exit, left;
+
+    if (s == NULL)
+        return;
+
+    switch (s->type) {
+        case STATE_TYPE_SPLIT:
+            if (s->lastlist == re->listid && start >= s->laststart)
+                return;
+            s->lastlist = re->listid;
+            s->laststart = start;
+            RE_HIT(s);
+            re_match_list_append(re, l, s->out, start);
+            re_match_list_append(re, l, s->out1, start);
+            break;
+        case STATE_TYPE_BOL:
+            // holds before the first char only, there is no char to wait for
+            if (l->pos == 0) {
+                RE_HIT(s);
+                re_match_list_append(re, l, s->out, start);
+            }
+            break;
+        case STATE_TYPE_SAVE:
+            // only the capture engine keeps positions
+            RE_HIT(s);
+            re_match_list_append(re, l, s->out, start);
+            break;
+        case STATE_TYPE_COUNT:
+            // counter keeps the start of every entry, the list the leftmost one
+            if (!re_counter_enter(s->cnt, l->pos, start))
+                return;
+            re_match_list_store(re, l, s, start);
+            if (s->cnt->min == 0)
+                re_match_list_append(re, l, s->out, start);
+            break;
+        case STATE_TYPE_UTF8_COUNT:
+            // the thread goes on in the byte sequences, the counter keeps its start
+            if (!re_counter_enter_utf8(s->cnt, l->pos, start))
+                return;
+            RE_HIT(s);
+            re_match_list_append(re, l, s->out1, start);
+            if (s->cnt->min == 0)
+                re_match_list_append(re, l, s->out, start);
+            break;
+        case STATE_TYPE_UTF8_NEXT:
+            // one char ends at this position, it is counted once
+            if (s->lastlist == re->listid)
+                return;
+            s->lastlist = re->listid;
+            RE_HIT(s);
+            if (re_counter_next_utf8(s->out1->cnt, l->pos, &exit, &left) > 0)
+                re_match_list_append(re, l, s->out1->out1, left);
+            if (exit != RE_NO_START)
+                re_match_list_append(re, l, s->out1->out, exit);
+            break;
+        default:
+            re_match_list_store(re, l, s, start);
             break;
     }
-    tl->n--;
-    return 1;
 }
 
-static int re_tokenlist_insert_at_index(struct TokenList *tl, int index, struct ReToken *t, int max)
+static int re_match_list_has_token(struct Regex *re, struct MatchList *clist, struct MatchList *nlist, char c)
 {
-    if (tl->n+1 > max) {
-        ERROR("Failed to insert token, buffer too small: %d\n", max);
-        return -1;
+    /* Look for states that match given char. Add matches to nlist.
+     * Returns amount of matches. */
+    struct ReState **s = clist->states;
+    unsigned int exit, left;
+
+    for (int i=0 ; i<clist->n ; i++, s++) {
+        if ((*s)->type == STATE_TYPE_COUNT) {
+            int is_match = re_state_match_chr(*s, c);
+            if (is_match)
+                RE_HIT(*s);
+            if (re_counter_step((*s)->cnt, clist->pos, is_match, &exit, &left) > 0)
+                re_match_list_store(re, nlist, *s, left);
+            if (exit != RE_NO_START)
+                re_match_list_append(re, nlist, (*s)->out, exit);
+            continue;
+        }
+
+        // match state and anchors don't consume chars
+        if ((*s)->type != STATE_TYPE_NONE)
+            continue;
+
+        if (re_state_match_chr(*s, c)) {
+            DEBUG("  ACCEPTED: %s\n", re_state_to_str(*s));
+            RE_HIT(*s);
+            re_match_list_append(re, nlist, (*s)->out, clist->starts[i]);
+            re_match_list_append(re, nlist, (*s)->out1, clist->starts[i]);
+        }
     }
-    if (index != 0 && index > tl->n-1) {
-        ERROR("Failed to insert token, index out of bounds: %d>%d\n", index, tl->n-1);
-        return -1;
+    return nlist->n;
+}
+
+static void re_match_list_at_end(struct Regex *re, struct MatchList *l)
+{
+    /* At the end of the input $ holds, add the states that follow it to the list.
+     * They are added to the end of the list, so they are checked by this loop as well */
+    for (int j=0 ; j<l->n ; j++) {
+        if (l->states[j]->type == STATE_TYPE_EOL) {
+            RE_HIT(l->states[j]);
+            re_match_list_append(re, l, l->states[j]->out, l->starts[j]);
+        }
     }
+}
+
+static int re_match_list_has_match(struct Regex *re, struct MatchList *l, unsigned int i, struct ReMatch *m)
+{
+    /* Check for a match that ends at index i. Threads that started after the match
+     * are dropped because they can only lead to matches that are further to the right,
+     * so are their entries in the counters. */
+    int j, k;
+
+    for (j=0 ; j<l->n && l->states[j]->type != STATE_TYPE_MATCH ; j++)
+        ;
+    if (j == l->n)
+        return 0;
+
+    unsigned int start = l->starts[j];
+    if (m->state < 0 || start < m->istart || (start == m->istart && i > m->iend)) {
+        m->istart = start;
+        m->iend = i;
+        m->state = 1;
+    }
+
+    for (j=0 ; j<re->ncounters ; j++)
+        re_counter_drop_after(&re->counters[j], start);
+
+    for (j=0, k=0 ; j<l->n ; j++) {
+        if (l->starts[j] > start)
+            continue;
+        l->states[k] = l->states[j];
+        l->starts[k] = l->starts[j];
+        k++;
+    }
+    l->n = k;
+    return 1;
+}
+
 
-    DEBUG("INSERT @ %d -> %s %s\n", index, re_token_type_to_str(t->type), re_token_to_str(t));
+/* ///// TOKENLIST ///////////////////////////////
+   Is an array of enums that represent the parsed regex string.
+   Only alternations of strings are compiled from it, the parser reads tokens one at a
+   time and only takes the items of character classes from the pool
+*/
+struct TokenList* re_tokenlist_init(struct TokenList *tl, struct ReArena *a, int max, int poolmax)
+{
+    /* Get token list and token pool from arena */
+    memset(tl, 0, sizeof(struct TokenList));
+    tl->tokens = re_arena_alloc(a, sizeof(struct ReToken*) * max);
+    tl->pool = re_arena_alloc(a, sizeof(struct ReToken) * poolmax);
+    if (tl->tokens == NULL || tl->pool == NULL)
+        return NULL;
+    tl->max = max;
+    tl->poolmax = poolmax;
+    return tl;
+}
 
-    // shift everything at index to the right starting at the end
-    for (int i=tl->n-1 ; i>=index ; i--)
-        *(tl->tokens+i+1) = *(tl->tokens+i);
+int re_tokenlist_append(struct TokenList *tl, struct ReToken *t)
+{
+    if (tl->n >= tl->max) {
+        ERROR("List full, max=%d\n", tl->max);
+        return -1;
+    }
 
-    *(tl->tokens + index) = t;
-    tl->n++;
+    tl->tokens[tl->n++] = t;
     return 1;
 }
 
@@ -325,17 +798,24 @@ void re_tokenlist_debug(struct TokenList *tl)
     printf("\n");
 }
 
-struct TokenList* re_tokenlist_from_str(const char *expr, struct TokenList *tl)
+struct TokenList* re_tokenlist_from_str(const char *expr, struct TokenList *tl, int flags)
 {
     /* Convert string to tokens */
     const char **p_in = &expr;
+    int in_cclass = 0;
 
-    while (strlen(*p_in)) {
+    while (**p_in != '\0') {
         struct ReToken *t = re_tokenlist_token_init(tl, RE_TOK_TYPE_UNDEFINED);
         if (t == NULL)
             return NULL;
 
-        re_token_from_str(t, p_in);
+        if (re_token_from_str(t, p_in, in_cclass, flags) == NULL)
+            return NULL;
+
+        if (t->type == RE_TOK_TYPE_CCLASS_START)
+            in_cclass = 1;
+        else if (t->type == RE_TOK_TYPE_CCLASS_END)
+            in_cclass = 0;
 
         assert(t->type != RE_TOK_TYPE_UNDEFINED);
         if (re_tokenlist_append(tl, t) < 0)
@@ -344,452 +824,245 @@ struct TokenList* re_tokenlist_from_str(const char *expr, struct TokenList *tl)
     return tl;
 }
 
-struct TokenList* re_tokenlist_parse_cclass(struct TokenList *tl)
+static struct ReToken* re_tokenlist_token_init(struct TokenList *tl, enum ReTokenType type)
 {
-    /* Parse tokens in character class.
-     * Create a token of the RE_TOK_TYPE_CCLASS and move all tokens from within the character class
-     * into a linked list.
-     * If ^ is at start, set RE_TOK_TYPE_CCLASS_NEGATED
-     */
+    /* Get new token from pool */
 
-    // Keep track of cclass
-    struct Cclass {
-        struct ReToken *t;
-        unsigned char in_cclass;
-        int size;
-    } cclass;
+    if (tl->pooln +1 > tl->poolmax) {
+        ERROR("No more tokens in pool: %d\n", tl->poolmax);
+        return NULL;
+    }
+    struct ReToken *t = tl->pool + tl->pooln++;
+    memset(t, 0, sizeof(struct ReToken));
+    t->type = type;
+    return t;
+}
 
-    #define RESET_CCLASS() memset(&cclass, 0, sizeof(struct Cclass))
-    RESET_CCLASS();
 
-    for (int i=0 ; i<tl->n ; i++) {
-        struct ReToken *t = *(tl->tokens+i);
+///// UTF-8 //////////////////////////////////////////////////////////
+/* With RE_UTF8 the expression is read as UTF-8 and tokens hold code points. Matching
+ * still happens byte by byte: a token that matches non-ASCII chars is compiled into
+ * the byte sequences of its code point ranges, see re_utf8_split() */
 
-        if (t->type == RE_TOK_TYPE_CCLASS_START) {
-            cclass.in_cclass = 1;
-            if (!re_tokenlist_delete_at_index(tl, i))
-                return NULL;
-            cclass.t = re_tokenlist_token_init(tl, RE_TOK_TYPE_CCLASS);
-            cclass.t->c0 = 'x';
-            if (!re_tokenlist_insert_at_index(tl, i, cclass.t, RE_MAX_REGEX))
-                return NULL;
-        }
-        else if (t->type == RE_TOK_TYPE_CCLASS_END) {
-            if (!cclass.in_cclass) {
-                ERROR("Malformed character class, unexpected ']'\n");
-                return NULL;
-            }
+#define RE_UTF8_MAX 0x10ffff
+#define RE_UTF8_IS_CONT(C) (((unsigned char)(C) & 0xc0) == 0x80)
 
-            if (!re_tokenlist_delete_at_index(tl, i--))
-                return NULL;
-            RESET_CCLASS();
+static int re_utf8_decode(const char **s)
+{
+    /* Read one UTF-8 encoded char and return its code point.
+     * A byte that doesn't start a valid sequence is read as a code point of its own */
+    const unsigned char *p = (const unsigned char*)*s;
+    int n, cp;
+
+    if (p[0] >= 0xc2 && p[0] <= 0xdf) {
+        n = 1;
+        cp = p[0] & 0x1f;
+    }
+    else if (p[0] >= 0xe0 && p[0] <= 0xef) {
+        n = 2;
+        cp = p[0] & 0x0f;
+    }
+    else if (p[0] >= 0xf0 && p[0] <= 0xf4) {
+        n = 3;
+        cp = p[0] & 0x07;
+    }
+    else {
+        (*s)++;
+        return p[0];
+    }
 
+    for (int i=1 ; i<=n ; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            (*s)++;
+            return p[0];
         }
-        else if (cclass.in_cclass && cclass.size == 0 && t->type == RE_TOK_TYPE_CARET) {
-            cclass.t->type = RE_TOK_TYPE_CCLASS_NEGATED;
-            if (!re_tokenlist_delete_at_index(tl, i--))
-                return NULL;
-        }
-        else if (cclass.in_cclass) {
-            // Add token to linked list and remove from tokenlist
-            cclass.t->next = t;
-            cclass.t = cclass.t->next;
-            if (!re_tokenlist_delete_at_index(tl, i))
-                return NULL;
-            cclass.size++;
-            i--;
-        }
-    }
-    if (cclass.in_cclass) {
-        ERROR("Failed to find end of character class\n");
-        return NULL;
+        cp = (cp << 6) | (p[i] & 0x3f);
     }
-    return tl;
+    *s += n+1;
+    return cp;
 }
 
-struct TokenList* re_tokenlist_to_postfix_bak(struct TokenList *tl)
+static int re_utf8_encode(int cp, unsigned char *buf)
 {
-    struct ReToken *tcat = (re_tokenlist_token_init(tl, RE_TOK_TYPE_CONCAT));
-    struct ReToken *tpipe = (re_tokenlist_token_init(tl, RE_TOK_TYPE_PIPE));
-    if (!tcat || !tpipe)
-        return NULL;
-    tcat->c0 = RE_CONCAT_SYM;
-    tpipe->c0 = '|';
-
-	int npipe, natom;
-
-    // track pipes and cats in group: (...|...)
-	struct {
-		int npipe;
-		int natom;
-	} group[100], *p;
-	
-	p = group;
-	npipe = 0;
-	natom = 0;
-
-	for (int i=0; i<tl->n; i++) {
-        //DEBUG("npipe,natom: %d %d: ", npipe, natom);
-        //re_tokenlist_debug(tl);
-        struct ReToken *t = *(tl->tokens + i);
-		switch(t->type) {
-
-            case RE_TOK_TYPE_GROUP_START:
-                DEBUG("GROUP START: %d\n", i);
-                if (!re_tokenlist_delete_at_index(tl, i--))
-                    return NULL;
-
-                if (natom > 1){
-                    --natom;
-                    if (!re_tokenlist_insert_at_index(tl, ++i, tcat, RE_MAX_REGEX))
-                        return NULL;
-                }
-                if (p >= group+100) {
-                    ERROR("Failed to get group, pool empty!\n");
-                    return NULL;
-                }
-                p->npipe = npipe;
-                p->natom = natom;
-                p++;
-                npipe = 0;
-                natom = 0;
-                break;
-            case RE_TOK_TYPE_PIPE:
-                // Remove pipe from tokenlist and either place it at group end or at end of expression
-                if (natom == 0) {
-                    ERROR("FAIL!\n");
-                    return NULL;
-                }
-                if (!re_tokenlist_delete_at_index(tl, i--))
-                    return NULL;
-
-                while (--natom > 0) {
-                    if (!re_tokenlist_insert_at_index(tl, ++i, tcat, RE_MAX_REGEX))
-                        return NULL;
-                }
-                npipe++;
-                break;
-            case RE_TOK_TYPE_GROUP_END:
-                if (p == group) {
-                    ERROR("Unexpected ')' found!\n");
-                    return NULL;
-                }
-                if (natom == 0)
-                    return NULL;
-                if (!re_tokenlist_delete_at_index(tl, i--))
-                    return NULL;
-                // NOTE if deleted, we should not increment i!!!!!!!!!!!
-
-                // put all pipes and cats at end of group
-                while (--natom > 0) {
-                    if (!re_tokenlist_insert_at_index(tl, ++i, tcat, RE_MAX_REGEX))
-                        return NULL;
-                }
-                for (; npipe > 0; npipe--) {
-                    if (!re_tokenlist_insert_at_index(tl, ++i, tpipe, RE_MAX_REGEX))
-                        return NULL;
-                }
-                --p;
-                npipe = p->npipe;
-                natom = p->natom;
-                natom++;
-                break;
-            case RE_TOK_TYPE_STAR:
-            case RE_TOK_TYPE_PLUS:
-            case RE_TOK_TYPE_QUESTION:
-                if (natom == 0)
-                    return NULL;
-                break;
-            default:
-                if (natom > 1){
-                    --natom;
-                    if (!re_tokenlist_insert_at_index(tl, i++, tcat, RE_MAX_REGEX))
-                        return NULL;
-                }
-                natom++;
-                break;
-            }
-	}
-    // all groups should be processed so p should be the first and only group
-	if (p != group) {
-        ERROR("Group not closed!\n");
-		return NULL;
-    }
-	while (--natom > 0) {
-		if (!re_tokenlist_append(tl, tcat))
-            return NULL;
+    /* Write UTF-8 encoding of code point to buf, returns the amount of bytes */
+    if (cp < 0x80) {
+        buf[0] = cp;
+        return 1;
     }
-	for (; npipe > 0; npipe--) {
-		if (!re_tokenlist_append(tl, tpipe))
-            return NULL;
+    if (cp < 0x800) {
+        buf[0] = 0xc0 | (cp >> 6);
+        buf[1] = 0x80 | (cp & 0x3f);
+        return 2;
     }
-	return tl;
+    if (cp < 0x10000) {
+        buf[0] = 0xe0 | (cp >> 12);
+        buf[1] = 0x80 | ((cp >> 6) & 0x3f);
+        buf[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    buf[0] = 0xf0 | (cp >> 18);
+    buf[1] = 0x80 | ((cp >> 12) & 0x3f);
+    buf[2] = 0x80 | ((cp >> 6) & 0x3f);
+    buf[3] = 0x80 | (cp & 0x3f);
+    return 4;
 }
 
-struct TokenList* re_tokenlist_to_postfix(struct TokenList *tl_in, struct TokenList *tl_out)
+static int re_char_from_str(const char **s, int flags)
 {
-    struct ReToken *tcat = re_tokenlist_token_init(tl_in, RE_TOK_TYPE_CONCAT);
-    struct ReToken *tpipe = re_tokenlist_token_init(tl_in, RE_TOK_TYPE_PIPE);
-    if (!tcat || !tpipe)
-        return NULL;
-
-    tcat->c0 = RE_CONCAT_SYM;
-    tpipe->c0 = '|';
-
-	int nalt, natom;
-
-	struct {
-		int nalt;
-		int natom;
-	} paren[100], *p;
-	
-	p = paren;
-	nalt = 0;
-	natom = 0;
-
-    struct ReToken **t = tl_in->tokens;
-	for (int i=0; i<tl_in->n; i++,t++) {
-        assert((*t)->type != RE_TOK_TYPE_UNDEFINED);
-		switch((*t)->type) {
-
-            case RE_TOK_TYPE_GROUP_START:
-                if (natom > 1){
-                    --natom;
-                    if (!re_tokenlist_append(tl_out, tcat))
-                        return NULL;
-                }
-                if (p >= paren+100)
-                    return NULL;
-                p->nalt = nalt;
-                p->natom = natom;
-                p++;
-                nalt = 0;
-                natom = 0;
-                break;
-            case RE_TOK_TYPE_PIPE:
-                if (natom == 0)
-                    return NULL;
-                while (--natom > 0) {
-                    if (!re_tokenlist_append(tl_out, tcat))
-                        return NULL;
-                }
-                nalt++;
-                break;
-            case RE_TOK_TYPE_GROUP_END:
-                if (p == paren)
-                    return NULL;
-                if (natom == 0)
-                    return NULL;
-                while (--natom > 0) {
-                    if (!re_tokenlist_append(tl_out, tcat))
-                        return NULL;
-                }
-                for (; nalt > 0; nalt--) {
-                    if (!re_tokenlist_append(tl_out, tpipe))
-                        return NULL;
-                }
-                --p;
-                nalt = p->nalt;
-                natom = p->natom;
-                natom++;
-                break;
-            case RE_TOK_TYPE_STAR:
-            case RE_TOK_TYPE_PLUS:
-            case RE_TOK_TYPE_QUESTION:
-                if (natom == 0)
-                    return NULL;
-                if (!re_tokenlist_append(tl_out, *t))
-                    return NULL;
-                break;
-            default:
-                if (natom > 1){
-                    --natom;
-                    if (!re_tokenlist_append(tl_out, tcat))
-                        return NULL;
-                }
-                if (!re_tokenlist_append(tl_out, *t))
-                    return NULL;
-                natom++;
-                break;
-            }
-	}
-	if (p != paren)
-		return NULL;
-	while (--natom > 0) {
-		if (!re_tokenlist_append(tl_out, tcat))
-            return NULL;
-    }
-	for (; nalt > 0; nalt--) {
-		if (!re_tokenlist_append(tl_out, tpipe))
-            return NULL;
-    }
-
-	return tl_out;
+    /* Read one char of the expression, with RE_UTF8 a full UTF-8 sequence */
+    if (flags & RE_UTF8)
+        return re_utf8_decode(s);
+    return (unsigned char)*(*s)++;
 }
 
-static struct ReToken* re_tokenlist_token_init(struct TokenList *tl, enum ReTokenType type)
+static int re_utf8_set_add(struct ReUtf8Set *set, struct ReToken *t)
 {
-    /* Get new token from pool */
+    /* Add code points >= 0x80 that are accepted by a token in a character class */
+    int lo, hi;
 
-    if (tl->pooln +1 > RE_MAX_TOKEN_POOL) {
-        ERROR("No more tokens in pool: %d\n", RE_MAX_TOKEN_POOL);
-        return NULL;
+    switch (t->type) {
+        case RE_TOK_TYPE_CHAR:
+            lo = hi = t->cp0;
+            break;
+        case RE_TOK_TYPE_RANGE:
+            lo = t->cp0;
+            hi = t->cp1;
+            break;
+        case RE_TOK_TYPE_NON_DIGIT:
+        case RE_TOK_TYPE_NON_ALPHA_NUM:
+        case RE_TOK_TYPE_NON_SPACE:
+            lo = 0x80;
+            hi = RE_UTF8_MAX;
+            break;
+        default:
+            return 0;
     }
-    struct ReToken *t = tl->pool + tl->pooln++;
-    memset(t, 0, sizeof(struct ReToken));
-    t->type = type;
-    return t;
-}
+    if (hi < 0x80)
+        return 0;
 
+    if (set->n >= RE_MAX_CCLASS) {
+        ERROR("Too many non-ASCII chars in class, max=%d\n", RE_MAX_CCLASS);
+        return -1;
+    }
+    set->lo[set->n] = lo < 0x80 ? 0x80 : lo;
+    set->hi[set->n] = hi;
+    set->n++;
+    return 0;
+}
 
-/*
-int re_tokenlist_to_postfix_old(struct ReToken *tokens, struct ReToken *buf, size_t size)
+static void re_utf8_set_finish(struct ReUtf8Set *set, int is_negated)
 {
-    // USING:
-    //   intermediate operator stack
-    //   output queue
-    //   input array
-    //
-    // OP precedence: (|&?*+^
-    //
-    // Read TOKEN
-    //   if LETTER => add to queue
-    //   if OP
-    //     while OP on top of stack with grater precedence
-    //       pop OP from stack into output queue
-    //     push OP onto stack
-    //   if LBRACKET => push onto stack
-    //   if RBRACKET
-    //     while not LBRACKET on top of stack
-    //       pop OP from stack into output queue
-    //      pop LBRACKET from stack and throw away
-    //
-    // when done
-    //   while stack not empty
-    //     pop OP from stack to queue
-    //
-
-    struct ReToken opstack[RE_MAX_REGEX];    // intermediate storage stack for operators
-    memset(opstack, 0, sizeof(struct ReToken) * RE_MAX_REGEX);
-    memset(buf, 0, sizeof(struct ReToken) * size);
-
-    struct ReToken *outqp = buf;
-    struct ReToken *stackp = opstack;
-    struct ReToken op;
-    struct ReToken *t = tokens;
-
-    // track how many pipes we've seen and if they're in () or not
-    int op_pipe = 0;
-
-    #define PUSH(S) *stackp++ = S
-    #define POP()   *--stackp
-    #define PUSH_OUT(S) *outqp++ = S
-
-    while (t->type != RE_TOK_TYPE_UNDEFINED) {
-        switch (t->type) {
-            case RE_TOK_TYPE_GROUP_START:
-                PUSH(*t);
-                break;
-            case RE_TOK_TYPE_GROUP_END:
-                while ((op = POP()).type != RE_TOK_TYPE_GROUP_START)
-                    PUSH_OUT(op);
-                for (int i=0 ; i<op_pipe ; i++) {
-                    struct ReToken *t_pipe = (re_token_init(RE_TOK_TYPE_PIPE));
-                    PUSH_OUT(*t_pipe);
-                }
-                op_pipe = 0;
-                break;
-            case RE_TOK_TYPE_PIPE:
-                op_pipe++;
-                break;
-            case RE_TOK_TYPE_CONCAT:
-                PUSH(*t);
-                break;
-            case RE_TOK_TYPE_STAR:
-            case RE_TOK_TYPE_PLUS:
-            case RE_TOK_TYPE_QUESTION:
-                while (stackp != opstack) {
-                    op = POP();
-
-                    // check precedence (operators are ordered in enum)
-                    if (op.c0 >= t->c0) {
-                        PUSH(op);
-                        break;
-                    }
-                    PUSH_OUT(op);
-                }
-                PUSH_OUT(*t);
-                break;
-            default:
-                PUSH_OUT(*t);
-                break;
+    /* Sort and merge ranges, a negated set is replaced by the ranges in between */
+    int n = 0;
+
+    for (int i=1 ; i<set->n ; i++) {
+        int lo = set->lo[i];
+        int hi = set->hi[i];
+        int j = i;
+        for (; j>0 && set->lo[j-1] > lo ; j--) {
+            set->lo[j] = set->lo[j-1];
+            set->hi[j] = set->hi[j-1];
         }
-        t++;
+        set->lo[j] = lo;
+        set->hi[j] = hi;
     }
 
-    // empty stack into out queue
-    while (stackp != opstack)
-        PUSH_OUT(POP());
-
-    // put pipes
-    for (int i=0 ; i<op_pipe ; i++) {
-        struct ReToken *t_pipe = (re_token_init(RE_TOK_TYPE_PIPE));
-        PUSH_OUT(*t_pipe);
+    for (int i=0 ; i<set->n ; i++) {
+        if (n > 0 && set->lo[i] <= set->hi[n-1] + 1) {
+            if (set->hi[i] > set->hi[n-1])
+                set->hi[n-1] = set->hi[i];
+            continue;
+        }
+        set->lo[n] = set->lo[i];
+        set->hi[n] = set->hi[i];
+        n++;
     }
+    set->n = n;
 
-    return 0;
+    if (!is_negated)
+        return;
 
-    #undef PUSH
-    #undef POP
-    #undef PUSH_OUT
+    // gaps between the ranges
+    struct ReUtf8Set in = *set;
+    int lo = 0x80;
+    set->n = 0;
+    for (int i=0 ; i<=in.n ; i++) {
+        int hi = (i < in.n) ? in.lo[i] - 1 : RE_UTF8_MAX;
+        if (lo <= hi) {
+            set->lo[set->n] = lo;
+            set->hi[set->n] = hi;
+            set->n++;
+        }
+        if (i < in.n)
+            lo = in.hi[i] + 1;
+    }
 }
-*/
 
-struct ReToken* re_tokenlist_to_explicit_cat_old(struct ReToken *tokens, size_t size)
+static int re_utf8_set_from_token(struct ReUtf8Set *set, struct ReToken *t)
 {
-    /* Put in explicit cat tokens */
-    struct ReToken out_buf[size];
-    struct ReToken *outp = out_buf;
-    struct ReToken *t0 = tokens;
-
-    // return NULL in case of a buffer overflow
-    #define PUSH_OR_RETURN(S) if ((long unsigned int)(outp-out_buf) >= size) { ERROR("Failed to add concat symbols, buffer is full: %ld\n", size); return NULL; } else { *outp++ = S; }
+    /* Code points >= 0x80 accepted by a token outside of a character class.
+     * Returns the amount of ranges, -1 when there are too many */
+    set->n = 0;
 
-    memset(&out_buf, 0, sizeof(struct ReToken) * size);
-
-    for (; t0->type != RE_TOK_TYPE_UNDEFINED ; t0++) {
-
-        PUSH_OR_RETURN(*t0);
-        struct ReToken *t1 = t0+1;
-
-        if (t1->type != RE_TOK_TYPE_UNDEFINED) {
-
-            if (t0->type != RE_TOK_TYPE_GROUP_START &&
-                t1->type != RE_TOK_TYPE_GROUP_END &&
-                t1->type != RE_TOK_TYPE_PIPE &&
-                t1->type != RE_TOK_TYPE_QUESTION &&
-                t1->type != RE_TOK_TYPE_PLUS &&
-                t1->type != RE_TOK_TYPE_STAR &&
-                t1->type != RE_TOK_TYPE_CARET &&
-                t0->type != RE_TOK_TYPE_CARET &&
-                t0->type != RE_TOK_TYPE_PIPE) {
-                    if ((long unsigned int)(outp-out_buf) >= size) {
-                        ERROR("Failed to add concat symbols, buffer is full: %ld\n", size);
-                        return NULL;
-                    }
-                    else {
-                        *outp++ = (struct ReToken){.type=RE_TOK_TYPE_CONCAT};
-                    }
+    switch (t->type) {
+        case RE_TOK_TYPE_CCLASS:
+        case RE_TOK_TYPE_CCLASS_NEGATED:
+            for (struct ReToken *tc=t->next ; tc!=NULL ; tc=tc->next) {
+                if (re_utf8_set_add(set, tc) < 0)
+                    return -1;
             }
-        }
+            break;
+        case RE_TOK_TYPE_DOT:
+            set->lo[0] = 0x80;
+            set->hi[0] = RE_UTF8_MAX;
+            set->n = 1;
+            break;
+        default:
+            if (re_utf8_set_add(set, t) < 0)
+                return -1;
+            break;
     }
-    memcpy(tokens, out_buf, size*sizeof(struct ReToken));
-    return tokens;
-
-    #undef PUSH_OR_RETURN
+    re_utf8_set_finish(set, t->type == RE_TOK_TYPE_CCLASS_NEGATED);
+    return set->n;
 }
 
+
 ///// TOKEN //////////////////////////////////////////////////////////
+#ifdef DO_DEBUG
+// String representations for types. Only used for debugging messages
+static const char *token_type_table[] = {
+    "RE_TOK_TYPE_UNDEFINED",
+    "RE_TOK_TYPE_PLUS",       //  +   GREEDY     match preceding 1 or more times
+    "RE_TOK_TYPE_STAR",       //  *   GREEDY     match preceding 0 or more times
+    "RE_TOK_TYPE_QUESTION",   //  ?   NON GREEDY match preceding 1 time            when combined with another quantifier it makes it non greedy
+    "RE_TOK_TYPE_CONCAT",          // explicit concat symbol
+    "RE_TOK_TYPE_PIPE",       //  |   OR
+    "RE_TOK_TYPE_CCLASS",
+    "RE_TOK_TYPE_CCLASS_NEGATED",
+    "RE_TOK_TYPE_RANGE_START",  // {n}  NON GREEDY match preceding n times
+    "RE_TOK_TYPE_RANGE_END",    // {n}  NON GREEDY match preceding n times
+    "RE_TOK_TYPE_GROUP_START",  // (
+    "RE_TOK_TYPE_GROUP_END",    // )
+    "RE_TOK_TYPE_CCLASS_START", // [
+    "RE_TOK_TYPE_CCLASS_END",   // ]
+    "RE_TOK_TYPE_CARET",        // ^  can be NEGATE|BEGIN
+    "RE_TOK_TYPE_NEGATE",       // ^
+    "RE_TOK_TYPE_BEGIN",        // ^
+    "RE_TOK_TYPE_END",          // $
+    "RE_TOK_TYPE_BACKSLASH",    // \ backreference, not going to implement
+    "RE_TOK_TYPE_DOT",          // .    any char except ' '
+    "RE_TOK_TYPE_CHAR",             // literal char
+    "RE_TOK_TYPE_DIGIT",            // \d   [0-9]
+    "RE_TOK_TYPE_NON_DIGIT",        // \D   [^0-9]
+    "RE_TOK_TYPE_ALPHA_NUM",        // \w   [a-bA-B0-9]
+    "RE_TOK_TYPE_NON_ALPHA_NUM",    // \W   [^a-bA-B0-9]
+    "RE_TOK_TYPE_SPACE",            // \s   ' ', \n, \t, \r
+    "RE_TOK_TYPE_NON_SPACE",        // \S   ^' '
+    "RE_TOK_TYPE_HYPHEN",           // -   (divides a range: [a-z]
+    "RE_TOK_TYPE_RANGE",             // not a meta char, but represents a range
+    "RE_TOK_TYPE_REPEAT"             // {n} {n,} {n,m} counted repetition of preceding
+};
+
 static const char* re_token_type_to_str(enum ReTokenType type)
 {
     static char buf[RE_MAX_TOKEN_TYPE_STR_REPR] = "";
@@ -797,6 +1070,7 @@ static const char* re_token_type_to_str(enum ReTokenType type)
     snprintf(buf, sizeof(buf)-1, "%s%s%s", PRBLUE, token_type_table[type], PRRESET);
     return buf;
 }
+#endif
 
 static char* re_token_to_str(struct  ReToken *t)
 {
@@ -840,6 +1114,9 @@ static char* re_token_to_str(struct  ReToken *t)
         case RE_TOK_TYPE_QUESTION:
             snprintf(buf, sizeof(buf), "%s%c%s", PRRED, '?', PRRESET);
             break;
+        case RE_TOK_TYPE_REPEAT:
+            snprintf(buf, sizeof(buf), "%s{%d,%d}%s", PRRED, t->min, t->max, PRRESET);
+            break;
         case RE_TOK_TYPE_PIPE:
             snprintf(buf, sizeof(buf), "%s%c%s", PRRED, '|', PRRESET);
             break;
@@ -862,84 +1139,95 @@ static char* re_token_to_str(struct  ReToken *t)
     return buf;
 }
 
-static int re_token_match_chr(struct ReToken *t, char c)
+static int re_token_repeat_from_str(struct ReToken *tok, const char **s)
 {
-    /* Check if token matches char */
-    switch (t->type) {
-        case RE_TOK_TYPE_RANGE:
-            return re_is_in_range(c, t->c0, t->c1);
-        case RE_TOK_TYPE_DOT:
-            return !re_is_linebreak(c);
-        case RE_TOK_TYPE_SPACE:
-            return re_is_whitespace(c);
-        case RE_TOK_TYPE_NON_SPACE:
-            return !re_is_whitespace(c);
-        case RE_TOK_TYPE_ALPHA_NUM:
-            return re_is_alpha(c);
-        case RE_TOK_TYPE_NON_ALPHA_NUM:
-            return !re_is_alpha(c);
-        case RE_TOK_TYPE_DIGIT:
-            return re_is_digit(c);
-        case RE_TOK_TYPE_NON_DIGIT:
-            return !re_is_digit(c);
-        case RE_TOK_TYPE_CCLASS_NEGATED:
-        case RE_TOK_TYPE_CCLASS:
-            return re_token_match_class(t, c);
-        case RE_TOK_TYPE_CHAR:
-            return t->c0 == c;
-        default:
-            ERROR("UNHANDLED: TYPE: %s, %s\n", re_token_type_to_str(t->type), re_token_to_str(t));
-            return 0;
+    /* Read bounds of a counted repetition that follow a '{': n} n,} or n,m}
+     * Returns 0 when it isn't one, the '{' is a literal char then. -1 on bad bounds */
+    const char *p = *s;
+    int min = 0;
+    int max;
+
+    if (!re_is_digit(*p))
+        return 0;
+    for (; re_is_digit(*p) ; p++) {
+        if (min <= RE_MAX_REPEAT)
+            min = min*10 + (*p - '0');
     }
-}
-
-static int re_token_match_class(struct ReToken *token, char c)
-{
-    /* Check char against full character class.
-     * Depending on type, it checks for negated or non negated */
-    struct ReToken *t = token->next;
-    int has_match = 0;
-    while (t != NULL) {
-        if (re_token_match_chr(t, c)) {
-            if (token->type == RE_TOK_TYPE_CCLASS)
-                return 1;
-            else
-                has_match = 1;
+    max = min;
+
+    if (*p == ',') {
+        p++;
+        max = -1;
+        if (re_is_digit(*p)) {
+            for (max=0 ; re_is_digit(*p) ; p++) {
+                if (max <= RE_MAX_REPEAT)
+                    max = max*10 + (*p - '0');
+            }
         }
-        t = t->next;
     }
-    if (token->type == RE_TOK_TYPE_CCLASS_NEGATED)
-        return !has_match;
+    if (*p != '}')
+        return 0;
 
-    return 0;
+    if (min > RE_MAX_REPEAT || max > RE_MAX_REPEAT) {
+        ERROR("Repetition is larger than %d\n", RE_MAX_REPEAT);
+        return -1;
+    }
+    if (max == 0 || (max > 0 && min > max)) {
+        ERROR("Bad repetition {%d,%d}\n", min, max);
+        return -1;
+    }
+    tok->min = min;
+    tok->max = max;
+    *s = p + 1;
+    return 1;
 }
 
-static struct ReToken* re_token_from_str(struct ReToken *tok, const char **s)
+static struct ReToken* re_token_from_str(struct ReToken *tok, const char **s, int in_cclass, int flags)
 {
     /* Reads first meta char from string and convert to Token struct.
      * If one char meta or char, increment pointer +1
-     * If two char meta, increment pointer +2 */
-    assert(strlen(*s) > 0);
+     * If two char meta, increment pointer +2
+     * A repetition is read as a whole, except in a character class.
+     * With RE_UTF8 a char is a full UTF-8 sequence, a range keeps its ASCII part in c0-c1 */
+    int is_repeat;
+    assert(**s != '\0');
     assert(tok != NULL);
 
     //struct ReToken *tok = re_token_init(tl, RE_TOK_TYPE_UNDEFINED);
 
     char c = **s;
+    const char *p = *s;
+    int cp = re_char_from_str(&p, flags);
 
-    if (strlen(*s) > 2 && *(*s+1) == '-') {
+    // a '-' at the end of a class is a char: [a-]
+    if (in_cclass && *p == '-' && *(p+1) != '\0' && *(p+1) != ']') {
         tok->type = RE_TOK_TYPE_RANGE;
-        tok->c0 = c;
-        (*s)+=2;
-        tok->c1 = **s;
-        (*s)++;
-        if (!re_is_in_range(tok->c0, tok->c0, tok->c1))
+        p++;
+        tok->cp0 = cp;
+        tok->cp1 = re_char_from_str(&p, flags);
+        *s = p;
+        if (tok->cp1 < 0x80 || !(flags & RE_UTF8)) {
+            tok->c0 = tok->cp0;
+            tok->c1 = tok->cp1;
+            if (re_is_in_range(tok->c0, tok->c0, tok->c1) <= 0)
+                return NULL;
+        }
+        else if (tok->cp0 > tok->cp1) {
+            ERROR("Bad range: U+%04X-U+%04X\n", tok->cp0, tok->cp1);
             return NULL;
+        }
+        else {
+            // empty when the range has no ASCII part
+            tok->c0 = (tok->cp0 < 0x80) ? tok->cp0 : 1;
+            tok->c1 = (tok->cp0 < 0x80) ? 0x7f : 0;
+        }
     }
 
-    else if (strlen(*s) > 1 && **s == '\\') {
+    else if (**s == '\\' && (*s)[1] != '\0') {
         c = *((*s)+1);
-        (*s)+=2;
+        (*s)++;
         tok->c0 = c;
+        tok->cp0 = re_char_from_str(s, flags);
         switch (c) {
             case 'd':
                 tok->type = RE_TOK_TYPE_DIGIT;
@@ -951,7 +1239,7 @@ static struct ReToken* re_token_from_str(struct ReToken *tok, const char **s)
                 tok->type = RE_TOK_TYPE_ALPHA_NUM;
                 break;
             case 'W':
-                tok->type = RE_TOK_TYPE_ALPHA_NUM;
+                tok->type = RE_TOK_TYPE_NON_ALPHA_NUM;
                 break;
             case 's':
                 tok->type = RE_TOK_TYPE_SPACE;
@@ -967,7 +1255,8 @@ static struct ReToken* re_token_from_str(struct ReToken *tok, const char **s)
 
     else {
         tok->c0 = c;
-        (*s)++;
+        tok->cp0 = cp;
+        *s = p;
         switch (c) {
             case '*':
                 tok->type = RE_TOK_TYPE_STAR;
@@ -979,7 +1268,10 @@ static struct ReToken* re_token_from_str(struct ReToken *tok, const char **s)
                 tok->type = RE_TOK_TYPE_QUESTION;
                 break;
             case '{':
-                tok->type = RE_TOK_TYPE_RANGE_START;
+                is_repeat = in_cclass ? 0 : re_token_repeat_from_str(tok, s);
+                if (is_repeat < 0)
+                    return NULL;
+                tok->type = is_repeat ? RE_TOK_TYPE_REPEAT : RE_TOK_TYPE_RANGE_START;
                 break;
             case '}':
                 tok->type = RE_TOK_TYPE_RANGE_END;
@@ -1015,9 +1307,6 @@ static struct ReToken* re_token_from_str(struct ReToken *tok, const char **s)
             case '.':
                 tok->type = RE_TOK_TYPE_DOT;
                 break;
-            case RE_CONCAT_SYM:
-                tok->type = RE_TOK_TYPE_CONCAT;
-                break;
             default:
                 tok->type = RE_TOK_TYPE_CHAR;
                 break;
@@ -1027,250 +1316,5716 @@ static struct ReToken* re_token_from_str(struct ReToken *tok, const char **s)
 }
 
 
-///// REGEX MAIN STRUCT //////////////////////////////////////////
-struct Regex* re_init(struct Regex *re, const char *expr)
+static void re_set_or(unsigned int *dst, const unsigned int *src, int nwords)
 {
-    /* Initialize main struct.
-     * Tokenize expression.
-     * Parse tokens in cclass
-     * Convert tokens to postfix
-     * Compile tokens into NFA
-     * ...
-     * PROFIT! */
+    for (int i=0 ; i<nwords ; i++)
+        dst[i] |= src[i];
+}
 
-    memset(re, 0, sizeof(struct Regex));
+static unsigned int re_set_count(const unsigned int *set, int nwords)
+{
+    unsigned int n = 0;
+    for (int i=0 ; i<nwords ; i++) {
+        for (unsigned int w=set[i] ; w ; w &= w-1)
+            n++;
+    }
+    return n;
+}
 
-    infix = re_tokenlist_init();
-    re->tokens = re_tokenlist_init();
 
-    if (re_tokenlist_from_str(expr, &re->tokens) == NULL)
-        return NULL;
+///// CLASS //////////////////////////////////////////////////////////
+/* All tokens that match more than one char, from '.' to negated character classes,
+ * are turned into a bitmap with a bit for every byte value. Matching a char against
+ * a class is a single bit test. */
+
+static int re_token_is_class(struct ReToken *t)
+{
+    /* Check if token outside of a character class matches a set of chars */
+    switch (t->type) {
+        case RE_TOK_TYPE_RANGE:
+        case RE_TOK_TYPE_DOT:
+        case RE_TOK_TYPE_SPACE:
+        case RE_TOK_TYPE_NON_SPACE:
+        case RE_TOK_TYPE_ALPHA_NUM:
+        case RE_TOK_TYPE_NON_ALPHA_NUM:
+        case RE_TOK_TYPE_DIGIT:
+        case RE_TOK_TYPE_NON_DIGIT:
+        case RE_TOK_TYPE_CCLASS_NEGATED:
+        case RE_TOK_TYPE_CCLASS:
+            return 1;
+        default:
+            return 0;
+    }
+}
 
-    DEBUG("TOKENIZED: ");
-    re_tokenlist_debug(&re->tokens);
+static void re_class_add_token(struct ReClass *cls, struct ReToken *t)
+{
+    /* Add chars accepted by token to class.
+     * Inside a character class, meta chars like '.' and '-' are literal chars */
+    for (int i=0 ; i<256 ; i++) {
+        char c = (char)i;
+        int is_match;
 
-    if (re_tokenlist_parse_cclass(&re->tokens) == NULL)
-        return NULL;
+        switch (t->type) {
+            case RE_TOK_TYPE_RANGE:
+                is_match = c >= t->c0 && c <= t->c1;
+                break;
+            case RE_TOK_TYPE_SPACE:
+                is_match = re_is_whitespace(c);
+                break;
+            case RE_TOK_TYPE_NON_SPACE:
+                is_match = !re_is_whitespace(c);
+                break;
+            case RE_TOK_TYPE_ALPHA_NUM:
+                is_match = re_is_alpha(c) || re_is_digit(c);
+                break;
+            case RE_TOK_TYPE_NON_ALPHA_NUM:
+                is_match = !(re_is_alpha(c) || re_is_digit(c));
+                break;
+            case RE_TOK_TYPE_DIGIT:
+                is_match = re_is_digit(c);
+                break;
+            case RE_TOK_TYPE_NON_DIGIT:
+                is_match = !re_is_digit(c);
+                break;
+            default:
+                is_match = c == t->c0;
+                break;
+        }
+        if (is_match)
+            RE_CLASS_ADD(cls, c);
+    }
+}
 
+static void re_class_fold_case(struct ReClass *cls)
+{
+    /* Add the other case of every letter in class */
+    for (int c='a' ; c<='z' ; c++) {
+        if (RE_CLASS_TEST(cls, c) || RE_CLASS_TEST(cls, c ^ 0x20)) {
+            RE_CLASS_ADD(cls, c);
+            RE_CLASS_ADD(cls, c ^ 0x20);
+        }
+    }
+}
 
-    DEBUG("INFIX: ");
-    re_tokenlist_debug(&re->tokens);
+static void re_class_from_token(struct ReClass *cls, struct ReToken *t, int flags)
+{
+    /* Fill class with the chars accepted by a token outside of a character class.
+     * With RE_ICASE, case is folded before a class is negated: [^a] doesn't match 'A'.
+     * With RE_LINES no class has '\n', [^a] and \s stay on the line */
+    memset(cls, 0, sizeof(struct ReClass));
 
-    if (re_tokenlist_to_postfix_bak(&re->tokens) == NULL)
-        return NULL;
+    switch (t->type) {
+        case RE_TOK_TYPE_DOT:
+            for (int c=0 ; c<256 ; c++) {
+                if (!re_is_linebreak((char)c))
+                    RE_CLASS_ADD(cls, c);
+            }
+            break;
+        case RE_TOK_TYPE_CCLASS:
+        case RE_TOK_TYPE_CCLASS_NEGATED:
+            for (struct ReToken *tc=t->next ; tc!=NULL ; tc=tc->next)
+                re_class_add_token(cls, tc);
 
-    DEBUG("POSTFIX: ");
-    re_tokenlist_debug(&re->tokens);
+            if (flags & RE_ICASE)
+                re_class_fold_case(cls);
 
-    if (re_compile(re, &re->tokens) == NULL)
-        return NULL;
+            if (t->type == RE_TOK_TYPE_CCLASS_NEGATED) {
+                for (unsigned int i=0 ; i<sizeof(cls->bits)/sizeof(*cls->bits) ; i++)
+                    cls->bits[i] = ~cls->bits[i];
+            }
+            break;
+        default:
+            re_class_add_token(cls, t);
+            if (flags & RE_ICASE)
+                re_class_fold_case(cls);
+            break;
+    }
 
-    DEBUG("NFA:\n");
-    re_state_debug(re->start, 0);
-    return re;
+    if (flags & RE_LINES)
+        RE_CLASS_DEL(cls, '\n');
 }
 
-static struct ReState* re_compile(struct Regex *re, struct TokenList *tl)
+static int re_class_count(struct ReClass *cls, char *c)
 {
-    /* Create NFA from pattern */
+    /* Amount of chars in class, c is set to the last char found */
+    int n = 0;
+    for (int i=0 ; i<256 ; i++) {
+        if (RE_CLASS_TEST(cls, i)) {
+            *c = (char)i;
+            n++;
+        }
+    }
+    return n;
+}
 
-    // Groups are chained states
-    // The group can be treated as a black box with one start point
-    // and many out points.
-    // This is how we can split states.
-    // The out points need to be connected to a start point
-    // of the next group
-    // This will create a tree structure
-    //
-    // Groups are pushed onto the stack. We wait for a meta char
-    // and then decide how the group should be treated
-    // When done, the group is pushed back to the stack
+static char* re_class_to_str(struct ReClass *cls, char *buf, size_t size)
+{
+    /* String representation of class, consecutive chars are shown as a range */
+    size_t len = 0;
+    buf[0] = '\0';
+    len += snprintf(buf+len, size-len, "[");
 
-    // A normal char pushes a group onto the stack
-    // A meta char pops one or two groups from the stack
-    struct Group stack[RE_MAX_GROUP_STACK];
-    struct OutList lpool[RE_MAX_OUT_LIST_POOL];
-    struct Group *stackp = stack;
-    struct Group g, g0, g1; // the paths groups take from stack
+    for (int i=0 ; i<256 && len<size ; i++) {
+        if (!RE_CLASS_TEST(cls, i))
+            continue;
 
-    struct ReState *s;
-    struct OutList *outlistp = lpool;
-    struct OutList *l;
+        int end = i;
+        while (end < 255 && RE_CLASS_TEST(cls, end+1))
+            end++;
 
-    #define PUSH(S) *stackp++ = S
-    #define POP()   *--stackp
-    #define GET_OL() outlistp++
+        if (i > ' ' && i < 127)
+            len += snprintf(buf+len, size-len, "%c", i);
+        else
+            len += snprintf(buf+len, size-len, "\\x%02x", i);
 
-    //DEBUG("Compiling pattern: '%s'\n", pattern);
+        if (end > i && len < size) {
+            if (end > ' ' && end < 127)
+                len += snprintf(buf+len, size-len, "-%c", end);
+            else
+                len += snprintf(buf+len, size-len, "-\\x%02x", end);
+        }
+        i = end;
+    }
+    if (len < size)
+        snprintf(buf+len, size-len, "]");
+    return buf;
+}
 
-    struct ReToken **t = tl->tokens;
-    for (int i=0 ; i<tl->n ; i++, t++) {
+static char* re_state_to_str(struct ReState *s)
+{
+    /* Get string representation of state */
+    static char buf[RE_MAX_TOKEN_STR_REPR] = "";
+    char tmp[RE_MAX_TOKEN_STR_REPR];
+
+    switch (s->type) {
+        case STATE_TYPE_MATCH:
+            snprintf(buf, sizeof(buf), "%sMATCH%s", PRGREEN, PRRESET);
+            break;
+        case STATE_TYPE_SPLIT:
+            snprintf(buf, sizeof(buf), "%sSPLIT%s", PRBLUE, PRRESET);
+            break;
+        case STATE_TYPE_BOL:
+            snprintf(buf, sizeof(buf), "%s^%s", PRRED, PRRESET);
+            break;
+        case STATE_TYPE_EOL:
+            snprintf(buf, sizeof(buf), "%s$%s", PRRED, PRRESET);
+            break;
+        case STATE_TYPE_SAVE:
+            snprintf(buf, sizeof(buf), "%sSAVE %d%s", PRBLUE, s->slot, PRRESET);
+            break;
+        case STATE_TYPE_UTF8_COUNT:
+            snprintf(buf, sizeof(buf), "%sUTF8{%d,%d}%s", PRBLUE, s->cnt->min, s->cnt->max, PRRESET);
+            break;
+        case STATE_TYPE_UTF8_NEXT:
+            snprintf(buf, sizeof(buf), "%sNEXT%s", PRBLUE, PRRESET);
+            break;
+        case STATE_TYPE_COUNT:
+            if (s->cls != NULL)
+                re_class_to_str(s->cls, tmp, sizeof(tmp));
+            else
+                snprintf(tmp, sizeof(tmp), "%c", s->c);
+            snprintf(buf, sizeof(buf), "%s%.40s{%d,%d}%s", PRRED, tmp, s->cnt->min, s->cnt->max, PRRESET);
+            break;
+        default:
+            if (s->cls != NULL)
+                snprintf(buf, sizeof(buf), "%s%s%s", PRRED, re_class_to_str(s->cls, tmp, sizeof(tmp)), PRRESET);
+            else if (s->span > 0)
+                snprintf(buf, sizeof(buf), "%s\\x%02x-\\x%02x%s", PRRED, (unsigned char)s->c, (unsigned char)s->c + s->span, PRRESET);
+            else
+                snprintf(buf, sizeof(buf), "%s%c%s", PRRED, s->c, PRRESET);
+            break;
+    }
+    return buf;
+}
+
+
+///// AST ////////////////////////////////////////////////////////////
+/* Syntax tree built by re_parse(). The tree is rewritten into an equivalent
+ * but smaller tree before it is compiled. Every node that is removed here is a state
+ * or position less to walk while matching:
+ *   x**             -> x*
+ *   (a|b|c)         -> [abc]
+ *   foo|foobar|fox  -> fo(o(bar)?|x)
+ *   abc             -> "abc"
+ * Rewrites that need memory are skipped when a pool runs out, the tree stays valid. */
+
+static const char *ast_type_table[] = {
+    "CHAR",
+    "CLASS",
+    "RANGE",
+    "STRING",
+    "BOL",
+    "EOL",
+    "CAT",
+    "ALT",
+    "STAR",
+    "PLUS",
+    "QUESTION",
+    "REPEAT",
+    "GROUP",
+};
+
+static struct ReAst* re_ast_init(struct ReAstPool *p, enum ReAstType type)
+{
+    /* Get next unused node from pool */
+    if (p->n >= p->max) {
+        ERROR("Max AST nodes reached: %d\n", p->max);
+        return NULL;
+    }
+    struct ReAst *n = p->nodes + p->n++;
+    memset(n, 0, sizeof(struct ReAst));
+    n->type = type;
+    return n;
+}
+
+static struct ReClass* re_ast_class_init(struct ReAstPool *p)
+{
+    if (p->ncls >= p->maxcls) {
+        ERROR("Max classes reached: %d\n", p->maxcls);
+        return NULL;
+    }
+    struct ReClass *cls = p->classes + p->ncls++;
+    memset(cls, 0, sizeof(struct ReClass));
+    return cls;
+}
+
+static void re_ast_append(struct ReAst *parent, struct ReAst *child)
+{
+    child->next = NULL;
+    if (parent->last != NULL)
+        parent->last->next = child;
+    else
+        parent->child = child;
+    parent->last = child;
+}
+
+static void re_ast_append_children(struct ReAst *parent, struct ReAst *from)
+{
+    /* Move all children of from to the end of parent */
+    struct ReAst *c = from->child;
+    struct ReAst *next;
+    for (; c != NULL ; c = next) {
+        next = c->next;
+        re_ast_append(parent, c);
+    }
+}
+
+static void re_ast_fix_last(struct ReAst *n)
+{
+    /* Find last child again after children are unlinked */
+    n->last = n->child;
+    while (n->last != NULL && n->last->next != NULL)
+        n->last = n->last->next;
+}
+
+static int re_ast_is_leaf(struct ReAst *n)
+{
+    return n->type == RE_AST_CHAR || n->type == RE_AST_CLASS || n->type == RE_AST_RANGE ||
+           n->type == RE_AST_STRING || n->type == RE_AST_BOL || n->type == RE_AST_EOL;
+}
+
+static int re_ast_is_quantifier(struct ReAst *n)
+{
+    return n->type == RE_AST_STAR || n->type == RE_AST_PLUS || n->type == RE_AST_QUESTION;
+}
+
+static int re_ast_is_utf8_repeat(struct ReAst *n)
+{
+    /* Repetition that counts UTF-8 chars, its child are their byte sequences */
+    return n->type == RE_AST_REPEAT && n->child->type != RE_AST_CHAR && n->child->type != RE_AST_CLASS;
+}
+
+void re_ast_debug(struct ReAst *n, int level)
+{
+    const int spaces = 2;
+    char tmp[RE_MAX_TOKEN_STR_REPR];
+
+    for (int i=0 ; i<level*spaces ; i++)
+        printf(" ");
+
+    switch (n->type) {
+        case RE_AST_CHAR:
+            printf("%s%s %c%s\n", PRRED, ast_type_table[n->type], n->c, PRRESET);
+            break;
+        case RE_AST_CLASS:
+            printf("%s%s %s%s\n", PRRED, ast_type_table[n->type], re_class_to_str(n->cls, tmp, sizeof(tmp)), PRRESET);
+            break;
+        case RE_AST_RANGE:
+            printf("%s%s \\x%02x-\\x%02x%s\n", PRRED, ast_type_table[n->type], (unsigned char)n->c, (unsigned char)n->c + n->span, PRRESET);
+            break;
+        case RE_AST_STRING:
+            printf("%s%s \"%.*s\"%s\n", PRRED, ast_type_table[n->type], n->len, n->str, PRRESET);
+            break;
+        case RE_AST_REPEAT:
+            printf("%s%s {%d,%d}%s\n", PRBLUE, ast_type_table[n->type], n->min, n->max, PRRESET);
+            break;
+        case RE_AST_GROUP:
+            printf("%s%s %d%s\n", PRBLUE, ast_type_table[n->type], n->group, PRRESET);
+            break;
+        default:
+            printf("%s%s%s\n", PRBLUE, ast_type_table[n->type], PRRESET);
+            break;
+    }
+    for (struct ReAst *c=n->child ; c!=NULL ; c=c->next)
+        re_ast_debug(c, level+1);
+}
+
+static int re_utf8_split(struct ReUtf8Seq *seq, int n, int lo, int hi)
+{
+    /* Add the byte sequences that encode code points lo to hi to seq, n are in it.
+     * The range is split until every byte of a sequence is a range of its own, the
+     * same way as utf8-ranges of the Rust regex crate:
+     *   U+0080-U+07FF  -> [\xc2-\xdf][\x80-\xbf]
+     *   U+0800-U+0FFF  -> \xe0[\xa0-\xbf][\x80-\xbf]
+     * Surrogates are left out. Returns the amount of sequences, -1 when seq is full */
+    static const int maxcp[] = { 0x7f, 0x7ff, 0xffff };
+    unsigned char b0[4], b1[4];
+
+    #define SPLIT(LO0, HI0, LO1, HI1) \
+        if ((n = re_utf8_split(seq, n, LO0, HI0)) < 0) \
+            return -1; \
+        return re_utf8_split(seq, n, LO1, HI1)
+
+    if (lo < 0xd800 && hi > 0xdfff) {
+        SPLIT(lo, 0xd7ff, 0xe000, hi);
+    }
+    if (lo >= 0xd800 && lo <= 0xdfff)
+        lo = 0xe000;
+    if (hi >= 0xd800 && hi <= 0xdfff)
+        hi = 0xd7ff;
+    if (lo > hi)
+        return n;
+
+    // both ends take the same amount of bytes
+    for (int i=0 ; i<3 ; i++) {
+        if (lo <= maxcp[i] && hi > maxcp[i]) {
+            SPLIT(lo, maxcp[i], maxcp[i]+1, hi);
+        }
+    }
+
+    // continuation bytes after the first one that differs must cover 0x80-0xbf
+    for (int i=1 ; i<4 ; i++) {
+        int m = (1 << (6*i)) - 1;
+        if ((lo & ~m) == (hi & ~m))
+            continue;
+        if ((lo & m) != 0) {
+            SPLIT(lo, lo | m, (lo | m) + 1, hi);
+        }
+        if ((hi & m) != m) {
+            SPLIT(lo, (hi & ~m) - 1, hi & ~m, hi);
+        }
+    }
+    #undef SPLIT
+
+    if (n >= RE_MAX_UTF8_SEQ) {
+        ERROR("Too many UTF-8 sequences in class, max=%d\n", RE_MAX_UTF8_SEQ);
+        return -1;
+    }
+    seq[n].len = re_utf8_encode(lo, b0);
+    re_utf8_encode(hi, b1);
+    memcpy(seq[n].lo, b0, 4);
+    memcpy(seq[n].hi, b1, 4);
+    return n + 1;
+}
+
+static int re_ast_utf8_tree(struct ReAstPool *p, struct ReUtf8Seq *seq, int n, int depth, struct ReAst **tree)
+{
+    /* Alternation of the byte sequences in seq without their last depth bytes. Sequences
+     * that end in the same byte range share the node of that range, so the continuation
+     * bytes of . take a few states instead of one for every sequence:
+     *   [\xc2-\xdf][\x80-\xbf] | \xe0[\xa0-\xbf][\x80-\xbf]  ->  ([\xc2-\xdf] | \xe0[\xa0-\xbf])[\x80-\xbf]
+     * seq is reordered. Returns the amount of nodes and splits the tree takes, with p NULL
+     * they are only counted. -1 when the pool is full */
+    struct ReAst *alt = NULL, *cat, *leaf, *sub = NULL;
+    int nnodes = 0;
+    int nalt = 0;
+    int nsub, k;
+
+    *tree = NULL;
+    for (int i=0 ; i<n ; i=k) {
+        struct ReUtf8Seq *s = seq + i;
+        int at = s->len - 1 - depth;
+
+        // sequences that end the same way follow the first of them
+        k = i + 1;
+        for (int j=i+1 ; j<n ; j++) {
+            int bt = seq[j].len - 1 - depth;
+            if ((bt > 0) == (at > 0) && seq[j].lo[bt] == s->lo[at] && seq[j].hi[bt] == s->hi[at]) {
+                struct ReUtf8Seq tmp = seq[k];
+                seq[k++] = seq[j];
+                seq[j] = tmp;
+            }
+        }
+
+        nnodes++;
+        if (at > 0) {
+            if ((nsub = re_ast_utf8_tree(p, s, k - i, depth + 1, &sub)) < 0)
+                return -1;
+            nnodes += nsub + 1;
+        }
+        nalt++;
+        if (p == NULL)
+            continue;
+
+        if ((leaf = re_ast_init(p, s->lo[at] == s->hi[at] ? RE_AST_CHAR : RE_AST_RANGE)) == NULL)
+            return -1;
+        leaf->c = s->lo[at];
+        leaf->span = s->hi[at] - s->lo[at];
+        if (at > 0) {
+            if ((cat = re_ast_init(p, RE_AST_CAT)) == NULL)
+                return -1;
+            re_ast_append(cat, sub);
+            re_ast_append(cat, leaf);
+            leaf = cat;
+        }
+
+        // alternation is made once there is a second alternative
+        if (nalt == 2) {
+            if ((alt = re_ast_init(p, RE_AST_ALT)) == NULL)
+                return -1;
+            re_ast_append(alt, *tree);
+            *tree = alt;
+        }
+        if (alt != NULL)
+            re_ast_append(alt, leaf);
+        else
+            *tree = leaf;
+    }
+    // an alternation of k is a node and k-1 splits
+    return (nalt > 1) ? nnodes + nalt : nnodes;
+}
+
+static int re_ast_utf8_seqs(struct ReUtf8Set *set, struct ReUtf8Seq *seq)
+{
+    /* Byte sequences of the code points in set. Returns their amount, -1 on error */
+    int n = 0;
+    for (int i=0 ; i<set->n && n>=0 ; i++)
+        n = re_utf8_split(seq, n, set->lo[i], set->hi[i]);
+    return n;
+}
+
+static int re_ast_utf8_count(struct ReUtf8Set *set)
+{
+    /* Amount of nodes the byte sequences of set take, -1 on error */
+    struct ReUtf8Seq seq[RE_MAX_UTF8_SEQ];
+    struct ReAst *tree;
+    int n = re_ast_utf8_seqs(set, seq);
+    if (n < 0)
+        return -1;
+    return re_ast_utf8_tree(NULL, seq, n, 0, &tree);
+}
+
+static struct ReAst* re_ast_utf8_from_token(struct ReAstPool *p, struct ReToken *t, struct ReUtf8Set *set, int flags, int *nseq)
+{
+    /* Token that matches non-ASCII chars is an alternation of its ASCII class and the
+     * byte sequences of its code points: . -> [^\n\r\x80-\xff]|([\xc2-\xdf]|...)[\x80-\xbf]
+     * nseq is set to the amount of nodes of the sequences */
+    struct ReUtf8Seq seq[RE_MAX_UTF8_SEQ];
+    struct ReAst *alt, *n, *tree;
+    char c;
+    int nset;
+
+    if ((alt = re_ast_init(p, RE_AST_ALT)) == NULL)
+        return NULL;
+
+    if (re_token_is_class(t)) {
+        if ((n = re_ast_init(p, RE_AST_CLASS)) == NULL)
+            return NULL;
+        if ((n->cls = re_ast_class_init(p)) == NULL)
+            return NULL;
+        re_class_from_token(n->cls, t, flags);
+        memset(n->cls->bits + 128 / RE_SET_BITS, 0, 128 / 8);
+        if (re_class_count(n->cls, &c) > 0)
+            re_ast_append(alt, n);
+    }
+
+    if ((nset = re_ast_utf8_seqs(set, seq)) < 0 || (*nseq = re_ast_utf8_tree(p, seq, nset, 0, &tree)) < 0)
+        return NULL;
+    re_ast_append(alt, tree);
+
+    if (alt->child == alt->last)
+        return alt->child;
+    return alt;
+}
+
+static struct ReAst* re_ast_leaf_from_token(struct ReAstPool *p, struct ReToken *t, int flags, int *nseq)
+{
+    /* With RE_ICASE a letter is a class of both cases: a -> [Aa]
+     * With RE_UTF8 tokens that match non-ASCII chars become byte sequences, nseq is
+     * set to the amount of nodes they take and to 0 for other tokens */
+    struct ReAst *n;
+    struct ReUtf8Set set;
+
+    *nseq = 0;
+    if (flags & RE_UTF8) {
+        int nset = re_utf8_set_from_token(&set, t);
+        if (nset < 0)
+            return NULL;
+        if (nset > 0)
+            return re_ast_utf8_from_token(p, t, &set, flags, nseq);
+    }
+
+    if (re_token_is_class(t) || ((flags & RE_ICASE) && re_is_alpha(t->c0) && t->type == RE_TOK_TYPE_CHAR)) {
+        if ((n = re_ast_init(p, RE_AST_CLASS)) == NULL)
+            return NULL;
+        if ((n->cls = re_ast_class_init(p)) == NULL)
+            return NULL;
+        re_class_from_token(n->cls, t, flags);
+        return n;
+    }
+
+    switch (t->type) {
+        case RE_TOK_TYPE_CARET:
+            return re_ast_init(p, RE_AST_BOL);
+        case RE_TOK_TYPE_END:
+            return re_ast_init(p, RE_AST_EOL);
+        default:
+            // literal char, stray meta chars like '-' and '}' match themselves
+            if ((n = re_ast_init(p, RE_AST_CHAR)) == NULL)
+                return NULL;
+            n->c = t->c0;
+            return n;
+    }
+}
+
+static struct ReAst* re_ast_copy(struct ReAstPool *p, struct ReAst *n)
+{
+    /* Copy of subtree, classes are shared */
+    struct ReAst *copy, *c;
+
+    if ((copy = re_ast_init(p, n->type)) == NULL)
+        return NULL;
+    copy->c = n->c;
+    copy->span = n->span;
+    copy->cls = n->cls;
+    copy->min = n->min;
+    copy->max = n->max;
+    copy->group = n->group;
+
+    for (struct ReAst *child=n->child ; child!=NULL ; child=child->next) {
+        if ((c = re_ast_copy(p, child)) == NULL)
+            return NULL;
+        re_ast_append(copy, c);
+    }
+    return copy;
+}
+
+static int re_repeat_is_counted(int nstates, int min, int max)
+{
+    /* Check if a repetition of nstates states is counted, small ones are unrolled */
+    long ncopy = (max < 0) ? (min > 0 ? min : 1) : max;
+    return ncopy * nstates > RE_MAX_UNROLL;
+}
+
+static struct ReAst* re_ast_unroll(struct ReAstPool *p, struct ReAst *n, int min, int max)
+{
+    /* Expand repetition of a subexpression that can't be counted into copies:
+     *   x{2,4} -> xx(x(x)?)?
+     *   x{2,}  -> xx+
+     * n itself is used as the last copy */
+    struct ReAst *cat, *opt = NULL, *q, *x;
+    int ncopy = (max < 0) ? (min > 0 ? min : 1) : max;
+
+    if ((cat = re_ast_init(p, RE_AST_CAT)) == NULL)
+        return NULL;
+
+    #define COPY() ((--ncopy > 0) ? re_ast_copy(p, n) : n)
+
+    for (int i=0 ; i<(max < 0 ? min-1 : min) ; i++) {
+        if ((x = COPY()) == NULL)
+            return NULL;
+        re_ast_append(cat, x);
+    }
+
+    if (max < 0) {
+        if ((q = re_ast_init(p, min > 0 ? RE_AST_PLUS : RE_AST_STAR)) == NULL || (x = COPY()) == NULL)
+            return NULL;
+        re_ast_append(q, x);
+        re_ast_append(cat, q);
+    }
+    else {
+        // optional copies are nested so there is only one way to match them
+        for (int i=min ; i<max ; i++) {
+            if ((x = COPY()) == NULL)
+                return NULL;
+            if (opt != NULL) {
+                if ((q = re_ast_init(p, RE_AST_CAT)) == NULL)
+                    return NULL;
+                re_ast_append(q, x);
+                re_ast_append(q, opt);
+                x = q;
+            }
+            if ((opt = re_ast_init(p, RE_AST_QUESTION)) == NULL)
+                return NULL;
+            re_ast_append(opt, x);
+        }
+        if (opt != NULL)
+            re_ast_append(cat, opt);
+    }
+    #undef COPY
+
+    if (cat->child == cat->last)
+        return cat->child;
+    return cat;
+}
+
+static struct ReAst* re_ast_head(struct ReAst *n)
+{
+    /* Leaf that alternative n starts with, NULL if it doesn't start with a leaf */
+    if (n->type == RE_AST_CAT)
+        n = n->child;
+    if (n->type == RE_AST_CHAR || n->type == RE_AST_CLASS || n->type == RE_AST_RANGE ||
+        n->type == RE_AST_BOL || n->type == RE_AST_EOL)
+        return n;
+    return NULL;
+}
+
+static int re_ast_leaf_equal(struct ReAst *n0, struct ReAst *n1)
+{
+    if (n0 == NULL || n1 == NULL || n0->type != n1->type)
+        return 0;
+
+    switch (n0->type) {
+        case RE_AST_CHAR:
+            return n0->c == n1->c;
+        case RE_AST_CLASS:
+            return memcmp(n0->cls->bits, n1->cls->bits, sizeof(n0->cls->bits)) == 0;
+        case RE_AST_RANGE:
+            return n0->c == n1->c && n0->span == n1->span;
+        default:
+            return 1;
+    }
+}
+
+static int re_ast_add_tail(struct ReAst *alt, struct ReAst *n)
+{
+    /* Add alternative n without its head to alt.
+     * Returns 1 when nothing is left of n */
+    if (n->type != RE_AST_CAT)
+        return 1;
+
+    n->child = n->child->next;
+    if (n->child == n->last)
+        re_ast_append(alt, n->child);
+    else
+        re_ast_append(alt, n);
+    return 0;
+}
+
+static struct ReAst* re_ast_simplify(struct ReAstPool *p, struct ReAst *n);
+
+static void re_ast_factor(struct ReAstPool *p, struct ReAst *n)
+{
+    /* Factor out the leaf that alternatives start with: ab|ac|d -> a(b|c)|d
+     * If an alternative is only the leaf, the rest becomes optional: a|ab -> a(b)? */
+    struct ReAst **cp, **dp;
+    struct ReAst *c, *d, *head, *cat, *alt, *rest, *next;
+
+    for (cp=&n->child ; *cp!=NULL ; cp=&(*cp)->next) {
+        c = *cp;
+        if ((head = re_ast_head(c)) == NULL)
+            continue;
+
+        for (d=c->next ; d!=NULL ; d=d->next) {
+            if (re_ast_leaf_equal(head, re_ast_head(d)))
+                break;
+        }
+        if (d == NULL)
+            continue;
+
+        // new concat, alternation and question mark
+        if (p->n + 3 > p->max)
+            break;
+
+        cat = re_ast_init(p, RE_AST_CAT);
+        alt = re_ast_init(p, RE_AST_ALT);
+
+        // replace c by concat
+        cat->next = c->next;
+        *cp = cat;
+
+        int has_empty = re_ast_add_tail(alt, c);
+        re_ast_append(cat, head);
+
+        for (dp=&cat->next ; *dp!=NULL ;) {
+            d = *dp;
+            if (!re_ast_leaf_equal(head, re_ast_head(d))) {
+                dp = &d->next;
+                continue;
+            }
+            *dp = d->next;
+            has_empty |= re_ast_add_tail(alt, d);
+        }
+
+        rest = alt;
+        if (alt->child == NULL) {
+            rest = NULL;
+        }
+        else if (has_empty) {
+            rest = re_ast_init(p, RE_AST_QUESTION);
+            re_ast_append(rest, alt);
+        }
+        if (rest != NULL)
+            re_ast_append(cat, rest);
+
+        // the rest can be factored again
+        next = cat->next;
+        *cp = re_ast_simplify(p, cat);
+        (*cp)->next = next;
+    }
+    re_ast_fix_last(n);
+}
+
+static void re_ast_merge_class(struct ReAstPool *p, struct ReAst *n)
+{
+    /* Merge alternatives that match a single char into one class: a|b|[cd] -> [a-d] */
+    struct ReAst **cp = &n->child;
+    struct ReAst *c, *first = NULL;
+    struct ReClass *cls = NULL;
+    char chr;
+
+    while (*cp != NULL) {
+        c = *cp;
+        if (c->type != RE_AST_CHAR && c->type != RE_AST_CLASS) {
+            cp = &c->next;
+            continue;
+        }
+        if (first == NULL) {
+            first = c;
+            cp = &c->next;
+            continue;
+        }
+        if (cls == NULL) {
+            if (p->ncls >= p->maxcls)
+                break;
+            cls = re_ast_class_init(p);
+            if (first->type == RE_AST_CHAR)
+                RE_CLASS_ADD(cls, first->c);
+            else
+                re_set_or(cls->bits, first->cls->bits, 256 / RE_SET_BITS);
+            first->type = RE_AST_CLASS;
+            first->cls = cls;
+        }
+        if (c->type == RE_AST_CHAR)
+            RE_CLASS_ADD(cls, c->c);
+        else
+            re_set_or(cls->bits, c->cls->bits, 256 / RE_SET_BITS);
+
+        // unlink
+        *cp = c->next;
+    }
+
+    if (cls != NULL && re_class_count(cls, &chr) == 1) {
+        first->type = RE_AST_CHAR;
+        first->c = chr;
+        first->cls = NULL;
+    }
+    re_ast_fix_last(n);
+}
+
+static struct ReAst* re_ast_simplify(struct ReAstPool *p, struct ReAst *n)
+{
+    /* Rewrite tree bottom up. Returns the node that replaces n */
+    struct ReAst *c, *next;
+
+    if (re_ast_is_leaf(n))
+        return n;
+
+    // children of the same kind are pulled up: a(bc) -> abc, a|(b|c) -> a|b|c
+    c = n->child;
+    n->child = n->last = NULL;
+    for (; c != NULL ; c = next) {
+        next = c->next;
+        c = re_ast_simplify(p, c);
+        if (c->type == n->type && (n->type == RE_AST_CAT || n->type == RE_AST_ALT))
+            re_ast_append_children(n, c);
+        else
+            re_ast_append(n, c);
+    }
+
+    switch (n->type) {
+        case RE_AST_STAR:
+        case RE_AST_PLUS:
+        case RE_AST_QUESTION:
+            // x** -> x*, x++ -> x+, (x+)? -> x*
+            c = n->child;
+            if (re_ast_is_quantifier(c)) {
+                if (c->type != n->type)
+                    n->type = RE_AST_STAR;
+                n->child = n->last = c->child;
+            }
+            return n;
+        case RE_AST_REPEAT:
+            // x{1} -> x, x{0,} -> x*, x{1,} -> x+, x{0,1} -> x?
+            if (n->min == 1 && n->max == 1)
+                return n->child;
+            if (n->max < 0 && n->min <= 1)
+                n->type = n->min ? RE_AST_PLUS : RE_AST_STAR;
+            else if (n->max == 1)
+                n->type = RE_AST_QUESTION;
+            return n;
+        case RE_AST_GROUP:
+            return n;
+        case RE_AST_ALT:
+            if (p->is_ordered)
+                break;
+            re_ast_factor(p, n);
+            re_ast_merge_class(p, n);
+            break;
+        default:
+            break;
+    }
+
+    // only one child left
+    if (n->child == n->last)
+        return n->child;
+    return n;
+}
+
+static struct ReAst* re_ast_merge_string(struct ReAstPool *p, struct ReAst *n)
+{
+    /* Merge runs of chars in a concat into a string: abc -> "abc" */
+    struct ReAst *c, *d, *next;
+
+    if (re_ast_is_leaf(n))
+        return n;
+
+    c = n->child;
+    n->child = n->last = NULL;
+    for (; c != NULL ; c = next) {
+        next = c->next;
+        re_ast_append(n, re_ast_merge_string(p, c));
+    }
+
+    if (n->type != RE_AST_CAT)
+        return n;
+
+    for (c=n->child ; c!=NULL ; c=d) {
+        d = c->next;
+        if (c->type != RE_AST_CHAR || d == NULL || d->type != RE_AST_CHAR)
+            continue;
+
+        int len = 1;
+        while (d != NULL && d->type == RE_AST_CHAR) {
+            d = d->next;
+            len++;
+        }
+        if (p->nstr + len > p->maxstr)
+            break;
+
+        char *str = p->str + p->nstr;
+        struct ReAst *tmp = c;
+        for (int i=0 ; i<len ; i++, tmp=tmp->next)
+            str[i] = tmp->c;
+        p->nstr += len;
+
+        c->type = RE_AST_STRING;
+        c->str = str;
+        c->len = len;
+        c->next = d;
+    }
+    re_ast_fix_last(n);
+
+    if (n->child == n->last)
+        return n->child;
+    return n;
+}
+
+static int re_ast_is_eol_anchored(struct ReAst *n)
+{
+    /* Every match ends with $ */
+    if (n->type == RE_AST_CAT)
+        n = n->last;
+    return n->type == RE_AST_EOL;
+}
+
+static void re_ast_reverse(struct ReAst *n)
+{
+    /* Turn tree into the tree of the reversed expression: abc$ -> ^cba
+     * Children of a concat and strings are reversed, ^ and $ swap places */
+    struct ReAst *c, *next, *prev = NULL;
+
+    switch (n->type) {
+        case RE_AST_BOL:
+            n->type = RE_AST_EOL;
+            return;
+        case RE_AST_EOL:
+            n->type = RE_AST_BOL;
+            return;
+        case RE_AST_STRING:
+            for (int i=0 ; i<n->len/2 ; i++) {
+                char tmp = n->str[i];
+                ((char*)n->str)[i] = n->str[n->len-1-i];
+                ((char*)n->str)[n->len-1-i] = tmp;
+            }
+            return;
+        default:
+            break;
+    }
+
+    for (c=n->child ; c!=NULL ; c=c->next)
+        re_ast_reverse(c);
+
+    if (n->type != RE_AST_CAT)
+        return;
+
+    n->last = n->child;
+    for (c=n->child ; c!=NULL ; c=next) {
+        next = c->next;
+        c->next = prev;
+        prev = c;
+    }
+    n->child = prev;
+}
+
+static int re_ast_to_postfix(struct ReAst *n, struct ReAst **out, int *len, int max)
+{
+    /* Flatten tree back into postfix order for the compilers.
+     * A concat or alternation with k children is emitted k-1 times as binary operator,
+     * quantifiers and groups follow their child.
+     * A repetition of a char or class is compiled into one state and takes its child
+     * along, one of UTF-8 chars follows its byte sequences */
+    #define PUSH(N) if (*len >= max) { ERROR("Postfix list full, max=%d\n", max); return -1; } out[(*len)++] = N
+
+    if (n->type == RE_AST_REPEAT && !re_ast_is_utf8_repeat(n)) {
+        PUSH(n);
+        return 0;
+    }
+
+    int i = 0;
+    for (struct ReAst *c=n->child ; c!=NULL ; c=c->next, i++) {
+        if (re_ast_to_postfix(c, out, len, max) < 0)
+            return -1;
+        if (i > 0 && !re_ast_is_quantifier(n) && n->type != RE_AST_GROUP && n->type != RE_AST_REPEAT) {
+            PUSH(n);
+        }
+    }
+    if (n->child == NULL || re_ast_is_quantifier(n) || n->type == RE_AST_GROUP || n->type == RE_AST_REPEAT) {
+        PUSH(n);
+    }
+    return 0;
+
+    #undef PUSH
+}
+
+
+static void re_info_literal(struct ReAstInfo *r, const char *s, int len)
+{
+    /* Facts of a subexpression that only matches s */
+    memset(r, 0, sizeof(struct ReAstInfo));
+    r->info.minlen = r->info.maxlen = len;
+    if (len > 0)
+        RE_SET_ADD(r->info.first, (unsigned char)s[0]);
+
+    r->is_exact = len <= RE_MAX_LITERAL;
+    r->info.nprefix = r->info.nsuffix = len < RE_MAX_LITERAL ? len : RE_MAX_LITERAL;
+    memcpy(r->info.prefix, s, r->info.nprefix);
+    memcpy(r->info.suffix, s + len - r->info.nsuffix, r->info.nsuffix);
+}
+
+static void re_info_cat(struct ReAstInfo *r, const struct ReAstInfo *c)
+{
+    /* Append facts of c to the facts of the concat in r */
+    int n;
+
+    // the first byte can come from c when everything before it can be empty
+    if (r->info.minlen == 0)
+        re_set_or(r->info.first, c->info.first, 256 / RE_SET_BITS);
+
+    r->info.minlen += c->info.minlen;
+    if (r->info.maxlen < 0 || c->info.maxlen < 0)
+        r->info.maxlen = -1;
+    else
+        r->info.maxlen += c->info.maxlen;
+
+    // a prefix grows while everything before it is exact
+    if (r->is_exact) {
+        n = RE_MAX_LITERAL - r->info.nprefix;
+        if (n > c->info.nprefix)
+            n = c->info.nprefix;
+        memcpy(r->info.prefix + r->info.nprefix, c->info.prefix, n);
+        r->info.nprefix += n;
+        r->is_exact = c->is_exact && n == c->info.nprefix;
+    }
+
+    // the suffix of c is kept, with the suffix before it when c is exact
+    if (c->is_exact) {
+        n = r->info.nsuffix + c->info.nsuffix - RE_MAX_LITERAL;
+        if (n > 0) {
+            memmove(r->info.suffix, r->info.suffix + n, r->info.nsuffix - n);
+            r->info.nsuffix -= n;
+        }
+        memcpy(r->info.suffix + r->info.nsuffix, c->info.suffix, c->info.nsuffix);
+        r->info.nsuffix += c->info.nsuffix;
+    }
+    else {
+        memcpy(r->info.suffix, c->info.suffix, c->info.nsuffix);
+        r->info.nsuffix = c->info.nsuffix;
+    }
+    r->info.is_eol = c->info.is_eol;
+    r->info.has_anchors |= c->info.has_anchors;
+}
+
+static void re_info_alt(struct ReAstInfo *r, const struct ReAstInfo *c)
+{
+    /* Merge facts of alternative c into the facts of the alternation in r */
+    int n;
+
+    re_set_or(r->info.first, c->info.first, 256 / RE_SET_BITS);
+    if (c->info.minlen < r->info.minlen)
+        r->info.minlen = c->info.minlen;
+    if (r->info.maxlen >= 0 && (c->info.maxlen < 0 || c->info.maxlen > r->info.maxlen))
+        r->info.maxlen = c->info.maxlen;
+
+    for (n=0 ; n<r->info.nprefix && n<c->info.nprefix && r->info.prefix[n] == c->info.prefix[n] ; n++)
+        ;
+    r->is_exact = r->is_exact && c->is_exact && n == r->info.nprefix && n == c->info.nprefix;
+    r->info.nprefix = n;
+
+    for (n=0 ; n<r->info.nsuffix && n<c->info.nsuffix &&
+            r->info.suffix[r->info.nsuffix-1-n] == c->info.suffix[c->info.nsuffix-1-n] ; n++)
+        ;
+    memmove(r->info.suffix, r->info.suffix + r->info.nsuffix - n, n);
+    r->info.nsuffix = n;
+
+    r->info.is_bol &= c->info.is_bol;
+    r->info.is_eol &= c->info.is_eol;
+    r->info.has_anchors |= c->info.has_anchors;
+}
+
+static void re_ast_info(struct ReAst *n, struct ReAstInfo *r)
+{
+    /* Gather the facts that hold for every match of the subtree */
+    struct ReAstInfo c;
+    struct ReAst *child;
+
+    switch (n->type) {
+        case RE_AST_CHAR:
+            re_info_literal(r, &n->c, 1);
+            return;
+        case RE_AST_STRING:
+            re_info_literal(r, n->str, n->len);
+            return;
+        case RE_AST_CLASS:
+        case RE_AST_RANGE:
+            re_info_literal(r, "", 0);
+            r->info.minlen = r->info.maxlen = 1;
+            r->is_exact = 0;
+            if (n->type == RE_AST_CLASS)
+                memcpy(r->info.first, n->cls->bits, sizeof(r->info.first));
+            for (int i=0 ; n->type == RE_AST_RANGE && i<=n->span ; i++)
+                RE_SET_ADD(r->info.first, (unsigned char)(n->c + i));
+            return;
+        case RE_AST_BOL:
+        case RE_AST_EOL:
+            re_info_literal(r, "", 0);
+            r->info.is_bol = n->type == RE_AST_BOL;
+            r->info.is_eol = n->type == RE_AST_EOL;
+            r->info.has_anchors = 1;
+            return;
+        case RE_AST_CAT:
+            re_ast_info(n->child, r);
+            for (child=n->child->next ; child!=NULL ; child=child->next) {
+                re_ast_info(child, &c);
+                re_info_cat(r, &c);
+            }
+            return;
+        case RE_AST_ALT:
+            re_ast_info(n->child, r);
+            for (child=n->child->next ; child!=NULL ; child=child->next) {
+                re_ast_info(child, &c);
+                re_info_alt(r, &c);
+            }
+            return;
+        case RE_AST_GROUP:
+            re_ast_info(n->child, r);
+            return;
+        default:
+            break;
+    }
+
+    // quantifiers repeat the child min to max times
+    re_ast_info(n->child, r);
+    int min = (n->type == RE_AST_REPEAT) ? n->min : (n->type == RE_AST_PLUS);
+    int max = (n->type == RE_AST_REPEAT) ? n->max : (n->type == RE_AST_QUESTION) ? 1 : -1;
+    int cmin = r->info.minlen;
+    int cmax = r->info.maxlen;
+
+    if (min == 0) {
+        r->info.nprefix = r->info.nsuffix = 0;
+        r->info.is_bol = r->info.is_eol = 0;
+        if (max == 0)
+            memset(r->info.first, 0, sizeof(r->info.first));
+    }
+    else if (r->is_exact && min > 1) {
+        // x{3} starts and ends with xxx
+        c = *r;
+        for (int i=1 ; i<min ; i++)
+            re_info_cat(r, &c);
+    }
+    r->is_exact = r->is_exact && min == max;
+
+    r->info.minlen = cmin * min;
+    if (cmax < 0 || (max < 0 && cmax > 0))
+        r->info.maxlen = -1;
+    else
+        r->info.maxlen = (max < 0) ? 0 : cmax * max;
+}
+
+
+///// PARSER /////////////////////////////////////////////////////
+/* Recursive descent parser, builds the syntax tree in one pass over the expression:
+ *   alt    := cat ('|' cat)*
+ *   cat    := repeat+
+ *   repeat := atom ('*' | '+' | '?' | '{n,m}')*
+ *   atom   := '(' alt ')' | '[' '^'? item* ']' | char
+ * Tokens are read one at a time with re_token_from_str(), the parser looks one token
+ * ahead. Sequences and alternations are flattened into one node with many children.
+ * A repetition of a char or class, or with RE_UTF8 of the byte sequences of one char,
+ * becomes a REPEAT node for the NFA, all other repetitions are unrolled. Errors give
+ * the offset in the expression. */
+
+struct ReParser {
+    const char *expr;
+    const char *p;              // next char to read
+    const char *at;             // start of the current token
+    struct ReToken tok;         // current token, UNDEFINED at the end of the expression
+    struct ReAstPool *ap;
+    struct TokenList *tl;       // pool for the items of character classes
+    int flags;
+    int ngroups;
+    struct ReAst *seq;          // last atom that is UTF-8 byte sequences and its amount of nodes
+    int nseq;
+};
+
+#define RE_PARSE_AT(PS) ((long)((PS)->at - (PS)->expr))
+
+static struct ReAst* re_parse_alt(struct ReParser *ps);
+
+static int re_parse_next(struct ReParser *ps, int in_cclass)
+{
+    /* Read the next token. Returns -1 when it is malformed */
+    memset(&ps->tok, 0, sizeof(struct ReToken));
+    ps->at = ps->p;
+    if (*ps->p == '\0')
+        return 0;
+    if (re_token_from_str(&ps->tok, &ps->p, in_cclass, ps->flags) == NULL) {
+        ERROR("Malformed expression at %ld: %s\n", RE_PARSE_AT(ps), ps->expr);
+        return -1;
+    }
+    DEBUG("TOKEN @ %ld -> %s %s\n", RE_PARSE_AT(ps), re_token_type_to_str(ps->tok.type), re_token_to_str(&ps->tok));
+    return 1;
+}
+
+static struct ReAst* re_parse_leaf(struct ReParser *ps, struct ReToken *t)
+{
+    /* Leaf of token, UTF-8 byte sequences are kept for a repetition that follows */
+    int nseq;
+    struct ReAst *n = re_ast_leaf_from_token(ps->ap, t, ps->flags, &nseq);
+
+    if (n != NULL && nseq > 0) {
+        ps->seq = n;
+        ps->nseq = nseq;
+    }
+    return n;
+}
+
+static struct ReAst* re_parse_class(struct ReParser *ps)
+{
+    /* Items up to ']' are linked to a class token: [^a-z_] -> NEGATED a-z -> _
+     * Only the first '^' negates, meta chars in a class match themselves */
+    long at = RE_PARSE_AT(ps);
+    struct ReToken *cls, *last, *t;
+
+    if ((cls = re_tokenlist_token_init(ps->tl, RE_TOK_TYPE_CCLASS)) == NULL)
+        return NULL;
+
+    for (last=cls ; ; ) {
+        if (re_parse_next(ps, 1) < 0)
+            return NULL;
+        if (ps->tok.type == RE_TOK_TYPE_UNDEFINED) {
+            ERROR("Character class at %ld is not closed: %s\n", at, ps->expr);
+            return NULL;
+        }
+        if (ps->tok.type == RE_TOK_TYPE_CCLASS_END)
+            break;
+        if (ps->tok.type == RE_TOK_TYPE_CARET && last == cls && cls->type == RE_TOK_TYPE_CCLASS) {
+            cls->type = RE_TOK_TYPE_CCLASS_NEGATED;
+            continue;
+        }
+        if ((t = re_tokenlist_token_init(ps->tl, RE_TOK_TYPE_UNDEFINED)) == NULL)
+            return NULL;
+        *t = ps->tok;
+        last->next = t;
+        last = t;
+    }
+
+    if (re_parse_next(ps, 0) < 0)
+        return NULL;
+    return re_parse_leaf(ps, cls);
+}
+
+static struct ReAst* re_parse_atom(struct ReParser *ps)
+{
+    /* Group, class or a single char. Without RE_CAPTURE a group is only its content */
+    long at = RE_PARSE_AT(ps);
+    struct ReAst *n, *g;
+    int group;
+
+    switch (ps->tok.type) {
+        case RE_TOK_TYPE_GROUP_START:
+            group = ++ps->ngroups;
+            if (re_parse_next(ps, 0) < 0 || (n = re_parse_alt(ps)) == NULL)
+                return NULL;
+            if (ps->tok.type != RE_TOK_TYPE_GROUP_END) {
+                ERROR("Group at %ld is not closed: %s\n", at, ps->expr);
+                return NULL;
+            }
+            if (re_parse_next(ps, 0) < 0)
+                return NULL;
+            if (!(ps->flags & RE_CAPTURE))
+                return n;
+            if ((g = re_ast_init(ps->ap, RE_AST_GROUP)) == NULL)
+                return NULL;
+            g->group = group;
+            re_ast_append(g, n);
+            return g;
+        case RE_TOK_TYPE_CCLASS_START:
+            return re_parse_class(ps);
+        case RE_TOK_TYPE_CCLASS_END:
+            ERROR("Unexpected ']' at %ld: %s\n", at, ps->expr);
+            return NULL;
+        default:
+            if ((n = re_parse_leaf(ps, &ps->tok)) == NULL)
+                return NULL;
+            if (re_parse_next(ps, 0) < 0)
+                return NULL;
+            return n;
+    }
+}
+
+static struct ReAst* re_parse_repeat(struct ReParser *ps)
+{
+    /* Atom and the quantifiers that follow it, a+? is (a+)? */
+    int can_count = !(ps->flags & RE_GLUSHKOV);
+    struct ReAst *n, *q;
+    enum ReAstType type;
+
+    if ((n = re_parse_atom(ps)) == NULL)
+        return NULL;
+
+    for (;;) {
+        switch (ps->tok.type) {
+            case RE_TOK_TYPE_STAR:
+            case RE_TOK_TYPE_PLUS:
+            case RE_TOK_TYPE_QUESTION:
+                if (ps->tok.type == RE_TOK_TYPE_STAR)
+                    type = RE_AST_STAR;
+                else if (ps->tok.type == RE_TOK_TYPE_PLUS)
+                    type = RE_AST_PLUS;
+                else
+                    type = RE_AST_QUESTION;
+
+                if ((q = re_ast_init(ps->ap, type)) == NULL)
+                    return NULL;
+                re_ast_append(q, n);
+                n = q;
+                break;
+            case RE_TOK_TYPE_REPEAT:
+                // the capture engine can't count UTF-8 chars, it has its counts in the ring
+                if (can_count && (((n->type == RE_AST_CHAR || n->type == RE_AST_CLASS) &&
+                                   re_repeat_is_counted(1, ps->tok.min, ps->tok.max)) ||
+                                  (n == ps->seq && !(ps->flags & RE_CAPTURE) &&
+                                   re_repeat_is_counted(ps->nseq, ps->tok.min, ps->tok.max)))) {
+                    if ((q = re_ast_init(ps->ap, RE_AST_REPEAT)) == NULL)
+                        return NULL;
+                    q->min = ps->tok.min;
+                    q->max = ps->tok.max;
+                    re_ast_append(q, n);
+                    n = q;
+                }
+                else if ((n = re_ast_unroll(ps->ap, n, ps->tok.min, ps->tok.max)) == NULL) {
+                    return NULL;
+                }
+                break;
+            default:
+                return n;
+        }
+        if (re_parse_next(ps, 0) < 0)
+            return NULL;
+    }
+}
+
+static struct ReAst* re_parse_cat(struct ReParser *ps)
+{
+    /* Sequence up to '|', ')' or the end of the expression */
+    struct ReAst *cat = NULL;
+    struct ReAst *first = NULL;
+    struct ReAst *n;
+
+    for (;;) {
+        switch (ps->tok.type) {
+            case RE_TOK_TYPE_UNDEFINED:
+            case RE_TOK_TYPE_PIPE:
+            case RE_TOK_TYPE_GROUP_END:
+                if (first == NULL) {
+                    ERROR("Empty alternative at %ld: %s\n", RE_PARSE_AT(ps), ps->expr);
+                    return NULL;
+                }
+                return (cat != NULL) ? cat : first;
+            case RE_TOK_TYPE_STAR:
+            case RE_TOK_TYPE_PLUS:
+            case RE_TOK_TYPE_QUESTION:
+            case RE_TOK_TYPE_REPEAT:
+                ERROR("Nothing to repeat at %ld: %s\n", RE_PARSE_AT(ps), ps->expr);
+                return NULL;
+            default:
+                break;
+        }
+
+        if ((n = re_parse_repeat(ps)) == NULL)
+            return NULL;
+
+        if (first == NULL) {
+            first = n;
+            continue;
+        }
+        if (cat == NULL && first->type == RE_AST_CAT) {
+            cat = first;
+        }
+        else if (cat == NULL) {
+            if ((cat = re_ast_init(ps->ap, RE_AST_CAT)) == NULL)
+                return NULL;
+            re_ast_append(cat, first);
+        }
+
+        if (n->type == RE_AST_CAT)
+            re_ast_append_children(cat, n);
+        else
+            re_ast_append(cat, n);
+    }
+}
+
+static struct ReAst* re_parse_alt(struct ReParser *ps)
+{
+    /* Alternatives up to ')' or the end of the expression */
+    struct ReAst *alt = NULL;
+    struct ReAst *first, *n;
+
+    if ((first = re_parse_cat(ps)) == NULL)
+        return NULL;
+
+    while (ps->tok.type == RE_TOK_TYPE_PIPE) {
+        if (re_parse_next(ps, 0) < 0 || (n = re_parse_cat(ps)) == NULL)
+            return NULL;
+
+        if (alt == NULL && first->type == RE_AST_ALT) {
+            alt = first;
+        }
+        else if (alt == NULL) {
+            if ((alt = re_ast_init(ps->ap, RE_AST_ALT)) == NULL)
+                return NULL;
+            re_ast_append(alt, first);
+        }
+
+        if (n->type == RE_AST_ALT)
+            re_ast_append_children(alt, n);
+        else
+            re_ast_append(alt, n);
+    }
+    return (alt != NULL) ? alt : first;
+}
+
+static struct ReAst* re_parse(struct ReParser *ps, const char *expr, struct ReAstPool *ap, struct TokenList *tl, int flags)
+{
+    /* Syntax tree of expression, ps->ngroups gets the number of groups.
+     * Returns NULL on error */
+    memset(ps, 0, sizeof(struct ReParser));
+    ps->expr = expr;
+    ps->p = expr;
+    ps->ap = ap;
+    ps->tl = tl;
+    ps->flags = flags;
+
+    struct ReAst *n;
+    if (re_parse_next(ps, 0) < 0 || (n = re_parse_alt(ps)) == NULL)
+        return NULL;
+    if (ps->tok.type == RE_TOK_TYPE_GROUP_END) {
+        ERROR("Unexpected ')' at %ld: %s\n", RE_PARSE_AT(ps), ps->expr);
+        return NULL;
+    }
+    return n;
+}
+
+///// GLUSHKOV //////////////////////////////////////////////////
+/* Position automaton built from the same postfix node list as the NFA.
+ * Every char/class is a position. For every subexpression we track the
+ * positions it can start and end with. When two subexpressions are joined the end
+ * positions of the first get the start positions of the second as follow positions.
+ * https://en.wikipedia.org/wiki/Glushkov%27s_construction_algorithm */
+
+static void re_glushkov_follow(struct ReGlushkov *gl, const unsigned int *from, const unsigned int *to)
+{
+    /* All positions in from can be followed by all positions in to */
+    for (int p=0 ; p<gl->npos ; p++) {
+        if (RE_SET_TEST(from, p))
+            re_set_or(gl->follow + p*gl->nwords, to, gl->nwords);
+    }
+}
+
+#ifdef DO_DEBUG
+static void re_glushkov_debug(struct ReGlushkov *gl)
+{
+    for (int p=0 ; p<gl->npos ; p++) {
+        printf("  POS %d: %s%s%s ->", p, re_state_to_str(&gl->pos[p]),
+               RE_SET_TEST(gl->first, p) ? " FIRST" : "",
+               RE_SET_TEST(gl->last, p) ? " LAST" : "");
+        for (int q=0 ; q<gl->npos ; q++) {
+            if (RE_SET_TEST(gl->follow + p*gl->nwords, q))
+                printf(" %d", q);
+        }
+        printf("\n");
+    }
+}
+#endif
+
+static struct ReGlushkov* re_glushkov_init(struct ReArena *a, int maxpos)
+{
+    /* Get automaton and its sets from arena */
+    int nwords = (maxpos + RE_SET_BITS - 1) / RE_SET_BITS;
+    size_t setsiz = sizeof(unsigned int) * nwords;
+
+    struct ReGlushkov *gl = re_arena_alloc(a, sizeof(struct ReGlushkov));
+    if (gl == NULL)
+        return NULL;
+
+    gl->nwords = nwords;
+    gl->pos    = re_arena_alloc(a, sizeof(struct ReState) * maxpos);
+    gl->follow = re_arena_alloc(a, setsiz * maxpos);
+    gl->chr    = re_arena_alloc(a, setsiz * 256);
+    gl->first  = re_arena_alloc(a, setsiz);
+    gl->last   = re_arena_alloc(a, setsiz);
+    gl->reach  = re_arena_alloc(a, setsiz);
+    gl->next   = re_arena_alloc(a, setsiz);
+    gl->anchors = re_arena_alloc(a, setsiz);
+
+    if (!gl->pos || !gl->follow || !gl->chr || !gl->first || !gl->last || !gl->reach || !gl->next || !gl->anchors)
+        return NULL;
+    return gl;
+}
+
+static int re_glushkov_pos_init(struct ReGlushkov *gl, int maxpos, struct ReState *s)
+{
+    /* Add position and precompute which chars are accepted by it.
+     * Returns the new position */
+    if (gl->npos >= maxpos) {
+        ERROR("Max positions reached: %d\n", maxpos);
+        return -1;
+    }
+    int p = gl->npos++;
+    gl->pos[p] = *s;
+
+    if (s->type != STATE_TYPE_NONE) {
+        RE_SET_ADD(gl->anchors, p);
+        gl->has_anchors = 1;
+        return p;
+    }
+
+    for (int c=0 ; c<256 ; c++) {
+        if (re_state_match_chr(s, (char)c))
+            RE_SET_ADD(gl->chr + c*gl->nwords, p);
+    }
+    return p;
+}
+
+static struct ReGlushkov* re_glushkov_compile(struct ReGlushkov *gl, struct ReArena *a, struct ReAst **nodes, int nnodes, int maxpos)
+{
+    /* Create position automaton from postfix nodes.
+     * Same stack machine as re_compile() but instead of groups of states the stack
+     * holds the first/last position sets of subexpressions. */
+    int nwords = gl->nwords;
+    size_t setsiz = sizeof(unsigned int) * nwords;
+    struct ReState s;
+    int p = 0;
+
+    // Every position pushes one entry at most, every entry has a first and last set
+    struct ReGlushkovSet *stack = re_arena_alloc(a, sizeof(struct ReGlushkovSet) * maxpos);
+    unsigned int *sets = re_arena_alloc(a, setsiz * 2 * maxpos);
+    if (stack == NULL || sets == NULL)
+        return NULL;
+
+    for (int i=0 ; i<maxpos ; i++) {
+        stack[i].first = sets + (2*i) * nwords;
+        stack[i].last  = sets + (2*i+1) * nwords;
+    }
+
+    struct ReGlushkovSet *stackp = stack;
+    struct ReGlushkovSet *g0, *g1;
+
+    #define NEED(N) if (stackp - stack < N) { ERROR("Malformed expression, missing operand for: %s\n", ast_type_table[(*n)->type]); return NULL; }
+
+    struct ReAst **n = nodes;
+    for (int i=0 ; i<nnodes ; i++, n++) {
+        switch ((*n)->type) {
+            case RE_AST_CAT:
+                NEED(2);
+                g1 = --stackp;
+                g0 = stackp - 1;
+                re_glushkov_follow(gl, g0->last, g1->first);
+                if (g0->nullable)
+                    re_set_or(g0->first, g1->first, nwords);
+                if (!g1->nullable)
+                    memset(g0->last, 0, setsiz);
+                re_set_or(g0->last, g1->last, nwords);
+                g0->nullable = g0->nullable && g1->nullable;
+                break;
+            case RE_AST_ALT:
+                NEED(2);
+                g1 = --stackp;
+                g0 = stackp - 1;
+                re_set_or(g0->first, g1->first, nwords);
+                re_set_or(g0->last, g1->last, nwords);
+                g0->nullable = g0->nullable || g1->nullable;
+                break;
+            case RE_AST_STAR:
+                NEED(1);
+                g0 = stackp - 1;
+                re_glushkov_follow(gl, g0->last, g0->first);
+                g0->nullable = 1;
+                break;
+            case RE_AST_PLUS:
+                NEED(1);
+                g0 = stackp - 1;
+                re_glushkov_follow(gl, g0->last, g0->first);
+                break;
+            case RE_AST_QUESTION:
+                NEED(1);
+                g0 = stackp - 1;
+                g0->nullable = 1;
+                break;
+            case RE_AST_STRING:     // chain of positions, one for every char
+                g0 = stackp++;
+                memset(g0->first, 0, setsiz);
+                memset(g0->last, 0, setsiz);
+                g0->nullable = 0;
+
+                memset(&s, 0, sizeof(struct ReState));
+                for (int j=0 ; j<(*n)->len ; j++) {
+                    s.c = (*n)->str[j];
+                    if ((p = re_glushkov_pos_init(gl, maxpos, &s)) < 0)
+                        return NULL;
+                    if (j == 0)
+                        RE_SET_ADD(g0->first, p);
+                    else
+                        RE_SET_ADD(gl->follow + (p-1)*nwords, p);
+                }
+                RE_SET_ADD(g0->last, p);
+                break;
+            default:        // it is a char, class or anchor, create a position
+                memset(&s, 0, sizeof(struct ReState));
+                re_state_set_ast(&s, *n);
+                if ((p = re_glushkov_pos_init(gl, maxpos, &s)) < 0)
+                    return NULL;
+
+                g0 = stackp++;
+                memset(g0->first, 0, setsiz);
+                memset(g0->last, 0, setsiz);
+                RE_SET_ADD(g0->first, p);
+                RE_SET_ADD(g0->last, p);
+                g0->nullable = 0;
+                break;
+        }
+    }
+    if (stackp - stack != 1) {
+        ERROR("Malformed expression, %ld sets left on stack\n", stackp - stack);
+        return NULL;
+    }
+    memcpy(gl->first, stack->first, setsiz);
+    memcpy(gl->last, stack->last, setsiz);
+    gl->nullable = stack->nullable;
+
+    // Anchored at start when every match starts with a caret
+    gl->is_anchored = !gl->nullable;
+    for (p=0 ; p<gl->npos ; p++) {
+        if (RE_SET_TEST(gl->first, p) && gl->pos[p].type != STATE_TYPE_BOL)
+            gl->is_anchored = 0;
+    }
+    if (gl->is_anchored)
+        DEBUG("IS ANCHORED AT START\n");
+    return gl;
+
+    #undef NEED
+}
+
+static int re_glushkov_anchors(struct ReGlushkov *gl, unsigned int *set, int is_bol, int is_eol)
+{
+    /* Anchors don't take a char, when they hold at the current place in the input
+     * the positions that follow them are added to set. Repeated until no positions
+     * are added, an anchor can follow another one.
+     * Returns 1 when an anchor that can end a match holds */
+    int is_match = 0;
+    int is_added = 1;
+
+    while (is_added) {
+        is_added = 0;
+        for (int w=0 ; w<gl->nwords ; w++) {
+            unsigned int bits = set[w] & gl->anchors[w];
+            for (unsigned int b=0 ; bits != 0 && b<RE_SET_BITS ; b++) {
+                if (!(bits & (1u << b)))
+                    continue;
+
+                int p = w*RE_SET_BITS + b;
+                if (gl->pos[p].type == STATE_TYPE_BOL ? !is_bol : !is_eol)
+                    continue;
+
+                if (RE_SET_TEST(gl->last, p))
+                    is_match = 1;
+
+                const unsigned int *follow = gl->follow + p * gl->nwords;
+                for (int v=0 ; v<gl->nwords ; v++) {
+                    if (follow[v] & ~set[v]) {
+                        set[v] |= follow[v];
+                        is_added = 1;
+                    }
+                }
+            }
+        }
+    }
+    return is_match;
+}
+
+static int re_glushkov_match_at(struct ReGlushkov *gl, const char *str, unsigned int start, unsigned int len, struct ReStats *st)
+{
+    /* Run position automaton on string from start, the input ends at len or '\0'.
+     * reach holds the positions that may accept the next char. The positions that
+     * accept it give the next reach set through their follow sets.
+     * Work is added to st unless it is NULL.
+     * Returns end of longest match, or -1 if there is none */
+    size_t setsiz = sizeof(unsigned int) * gl->nwords;
+    unsigned int *reach = gl->reach;
+    unsigned int *next = gl->next;
+    unsigned int *bak;
+    int end = gl->nullable ? (int)start : -1;
+
+    memcpy(reach, gl->first, setsiz);
+    if (gl->has_anchors && re_glushkov_anchors(gl, reach, start == 0, start == len || str[start] == '\0'))
+        end = start;
+
+    for (unsigned int i=start ; i<len && str[i] ; i++) {
+        const unsigned int *chr = gl->chr + (unsigned char)str[i] * gl->nwords;
+        int has_pos = 0;
+        int is_match = 0;
+
+        memset(next, 0, setsiz);
+
+        if (st != NULL) {
+            unsigned int n = re_set_count(reach, gl->nwords);
+            st->bytes++;
+            st->states += n;
+            if (n > st->peak)
+                st->peak = n;
+        }
+
+        for (int w=0 ; w<gl->nwords ; w++) {
+            unsigned int bits = reach[w] & chr[w];
+            if (bits == 0)
+                continue;
+
+            has_pos = 1;
+            if (bits & gl->last[w])
+                is_match = 1;
+
+            for (unsigned int b=0 ; b<RE_SET_BITS ; b++) {
+                if (bits & (1u << b))
+                    re_set_or(next, gl->follow + (w*RE_SET_BITS + b) * gl->nwords, gl->nwords);
+            }
+        }
+
+        if (!has_pos)
+            break;
+
+        if (is_match)
+            end = i + 1;
+
+        if (gl->has_anchors && re_glushkov_anchors(gl, next, 0, i+1 == len || str[i+1] == '\0'))
+            end = i + 1;
+
+        bak = reach;
+        reach = next;
+        next = bak;
+    }
+    return end;
+}
+
+static void re_glushkov_match(struct Regex *re, const char *str, unsigned int from, unsigned int len, struct ReMatch *m)
+{
+    /* Sets have no room to track where a thread started, so try every start position
+     * from from on until one matches. Positions whose char can't start a match are
+     * skipped. The input ends at len or '\0' */
+    struct ReGlushkov *gl = re->glushkov;
+    struct ReStats *st = (re->flags & RE_STATS) ? &re->stats : NULL;
+    int end;
+
+    for (unsigned int i=from ; ; i++) {
+        int is_end = i == len || str[i] == '\0';
+        const unsigned int *chr = gl->chr + (unsigned char)(is_end ? '\0' : str[i]) * gl->nwords;
+        int can_start = gl->nullable;
+        for (int w=0 ; w<gl->nwords && !can_start ; w++)
+            can_start = (gl->first[w] & (chr[w] | gl->anchors[w])) != 0;
+
+        if (!can_start && st != NULL)
+            st->prefilter_skips++;
+
+        if (can_start && (end = re_glushkov_match_at(gl, str, i, len, st)) >= 0) {
+            m->istart = i;
+            m->iend = end;
+            m->state = 1;
+            return;
+        }
+        if (is_end || gl->is_anchored)
+            return;
+    }
+}
+
+
+///// AHO-CORASICK ///////////////////////////////////////////////
+/* Alternations of plain strings are matched with an Aho-Corasick automaton instead of
+ * an NFA. The strings are put in a trie and every node gets a failure link to the node
+ * of its longest proper suffix that is also in the trie. Links are followed at compile
+ * time so the table holds a transition for every node and byte class. Matching is one
+ * table lookup per byte, no matter how many strings there are.
+ * https://en.wikipedia.org/wiki/Aho%E2%80%93Corasick_algorithm */
+
+static struct ReAc* re_ac_init(struct ReArena *a, int maxnodes, int nclasses)
+{
+    /* Get automaton and its tables from arena */
+    struct ReAc *ac = re_arena_alloc(a, sizeof(struct ReAc));
+    if (ac == NULL)
+        return NULL;
+
+    ac->delta = re_arena_alloc(a, sizeof(unsigned short) * maxnodes * nclasses);
+    ac->olen = re_arena_alloc(a, sizeof(unsigned short) * maxnodes);
+    if (ac->delta == NULL || ac->olen == NULL)
+        return NULL;
+
+    ac->nclasses = nclasses;
+    return ac;
+}
+
+#ifdef DO_DEBUG
+static void re_ac_debug(struct ReAc *ac)
+{
+    for (int v=0 ; v<ac->nnodes ; v++) {
+        printf("  NODE %d: len=%d ->", v, ac->olen[v]);
+        for (int b=0 ; b<256 ; b++) {
+            int u = ac->delta[v*ac->nclasses + ac->cls[b]];
+            if (ac->cls[b] != 0 && u != 0)
+                printf(" %c:%d", b, u);
+        }
+        printf("\n");
+    }
+}
+#endif
+
+static struct ReAc* re_ac_compile(struct ReAc *ac, struct ReArena *a, struct TokenList *tl, int maxnodes, int flags)
+{
+    /* Build trie from infix tokens, then resolve failure links breadth first.
+     * Node 0 is the root, a 0 transition while building the trie means no child yet.
+     * With RE_ICASE both cases of a letter share a byte class. */
+    unsigned short *fail = re_arena_alloc(a, sizeof(unsigned short) * maxnodes);
+    unsigned short *queue = re_arena_alloc(a, sizeof(unsigned short) * maxnodes);
+    if (fail == NULL || queue == NULL)
+        return NULL;
+
+    int ncls = 1;
+    int v = 0;
+    int depth = 0;
+    ac->nnodes = 1;
+
+    struct ReToken **t = tl->tokens;
+    for (int i=0 ; i<=tl->n ; i++, t++) {
+        // end of string
+        if (i == tl->n || (*t)->type == RE_TOK_TYPE_PIPE || (*t)->type == RE_TOK_TYPE_GROUP_END) {
+            if (depth > 0) {
+                ac->olen[v] = depth;
+                if (depth > ac->maxlen)
+                    ac->maxlen = depth;
+            }
+            v = 0;
+            depth = 0;
+            continue;
+        }
+        if ((*t)->type != RE_TOK_TYPE_CHAR)
+            continue;
+
+        // a UTF-8 char is added as the string of its bytes
+        unsigned char bytes[4];
+        int nbytes = 1;
+        bytes[0] = (*t)->c0;
+        if ((flags & RE_UTF8) && (*t)->cp0 >= 0x80)
+            nbytes = re_utf8_encode((*t)->cp0, bytes);
+
+        for (int j=0 ; j<nbytes ; j++) {
+            unsigned char b = bytes[j];
+            if (ac->cls[b] == 0) {
+                if (ncls >= ac->nclasses) {
+                    ERROR("Max byte classes reached: %d\n", ac->nclasses);
+                    return NULL;
+                }
+                ac->cls[b] = ncls++;
+                if (flags & RE_ICASE)
+                    ac->cls[(unsigned char)re_other_case(b)] = ac->cls[b];
+            }
+
+            unsigned short *u = ac->delta + v*ac->nclasses + ac->cls[b];
+            if (*u == 0) {
+                if (ac->nnodes >= maxnodes) {
+                    ERROR("Max nodes reached: %d\n", maxnodes);
+                    return NULL;
+                }
+                *u = ac->nnodes++;
+            }
+            v = *u;
+            depth++;
+        }
+    }
+
+    // Children of root fail to root
+    int head = 0;
+    int tail = 0;
+    for (int c=0 ; c<ac->nclasses ; c++) {
+        int u = ac->delta[c];
+        if (u != 0) {
+            fail[u] = 0;
+            queue[tail++] = u;
+        }
+    }
+
+    // Missing transitions take the transition of the failure node, which is less deep
+    // and already resolved
+    while (head < tail) {
+        v = queue[head++];
+        unsigned short *row = ac->delta + v*ac->nclasses;
+        unsigned short *frow = ac->delta + fail[v]*ac->nclasses;
+
+        for (int c=0 ; c<ac->nclasses ; c++) {
+            int u = row[c];
+            if (u == 0) {
+                row[c] = frow[c];
+                continue;
+            }
+            fail[u] = frow[c];
+            if (ac->olen[u] == 0)
+                ac->olen[u] = ac->olen[fail[u]];
+            queue[tail++] = u;
+        }
+    }
+    return ac;
+}
+
+static void re_ac_info(struct TokenList *tl, struct ReInfo *info, int flags)
+{
+    /* Facts of an alternation of strings, the same the syntax tree would give.
+     * With RE_ICASE a letter is a class of both cases, it is no part of a literal */
+    struct ReAstInfo r, s, c;
+    int nstr = 0;
+
+    re_info_literal(&r, "", 0);
+    re_info_literal(&s, "", 0);
+
+    struct ReToken **t = tl->tokens;
+    for (int i=0 ; i<=tl->n ; i++, t++) {
+        if (i == tl->n || (*t)->type == RE_TOK_TYPE_PIPE || (*t)->type == RE_TOK_TYPE_GROUP_END) {
+            if (s.info.minlen > 0) {
+                if (nstr++ == 0)
+                    r = s;
+                else
+                    re_info_alt(&r, &s);
+            }
+            re_info_literal(&s, "", 0);
+            continue;
+        }
+        if ((*t)->type != RE_TOK_TYPE_CHAR)
+            continue;
+
+        unsigned char bytes[4];
+        int nbytes = 1;
+        bytes[0] = (*t)->c0;
+        if ((flags & RE_UTF8) && (*t)->cp0 >= 0x80)
+            nbytes = re_utf8_encode((*t)->cp0, bytes);
+
+        for (int j=0 ; j<nbytes ; j++) {
+            re_info_literal(&c, (const char*)bytes + j, 1);
+            if ((flags & RE_ICASE) && re_is_alpha(bytes[j])) {
+                RE_SET_ADD(c.info.first, (unsigned char)re_other_case(bytes[j]));
+                c.info.nprefix = c.info.nsuffix = 0;
+                c.is_exact = 0;
+            }
+            re_info_cat(&s, &c);
+        }
+    }
+    *info = r.info;
+}
+
+static void re_ac_match(struct ReAc *ac, const char *str, unsigned int from, unsigned int len, struct ReMatch *m, struct ReStats *st)
+{
+    /* The longest string that ends at a node gives the leftmost match that ends there.
+     * Stop when no match that starts before the current one can end any more.
+     * The search starts at from, the input ends at len or '\0'.
+     * Work is added to st unless it is NULL, one node is active per byte */
+    int v = 0;
+    unsigned int i;
+
+    for (i=from ; i<len && str[i] ; i++) {
+        v = ac->delta[v*ac->nclasses + ac->cls[(unsigned char)str[i]]];
+
+        if (ac->olen[v] > 0) {
+            unsigned int start = i+1 - ac->olen[v];
+            if (m->state < 0 || start < m->istart) {
+                m->istart = start;
+                m->iend = i+1;
+                m->state = 1;
+            }
+            else if (start == m->istart) {
+                m->iend = i+1;
+            }
+        }
+        if (m->state > 0 && i+1 >= m->istart + ac->maxlen) {
+            i++;
+            break;
+        }
+    }
+
+    if (st != NULL) {
+        st->bytes += i - from;
+        st->states += i - from;
+        if (i > from && st->peak < 1)
+            st->peak = 1;
+    }
+}
+
+
+///// LITERAL ////////////////////////////////////////////////////
+/* An expression that is one plain string is found with a substring search, no automaton
+ * is compiled for it. With SSE2, 16 positions at a time are compared on the first and
+ * the last byte of the string and only the positions where both agree are compared in
+ * full. The Two-Way algorithm of Crochemore and Perrin takes over for the last few
+ * positions, and when too many positions pass the filter for nothing, it never looks
+ * at a byte of the input more than twice.
+ * http://www-igm.univ-mlv.fr/~lecroq/string/node26.html */
+
+// Bytes compared in full that the filter may spend for nothing before Two-Way takes over,
+// on top of one per byte of input
+#define RE_LIT_SLACK 256
+
+static struct ReLiteral* re_lit_init(struct ReArena *a, int len)
+{
+    /* Get literal and room for its string from arena */
+    struct ReLiteral *lit = re_arena_alloc(a, sizeof(struct ReLiteral));
+    if (lit == NULL)
+        return NULL;
+
+    if ((lit->s = re_arena_alloc(a, len)) == NULL)
+        return NULL;
+    lit->len = len;
+    return lit;
+}
+
+static int re_lit_max_suffix(const unsigned char *s, int len, int is_rev, int *period)
+{
+    /* Find the lexicographically largest suffix of s, with the order of bytes turned
+     * around when is_rev is set.
+     * Returns the index before it and sets its period */
+    int i = -1;
+    int j = 0;
+    int k = 1;
+    int p = 1;
+
+    while (j + k < len) {
+        unsigned char a = s[i + k];
+        unsigned char b = s[j + k];
+
+        if (a == b) {
+            if (k == p) {
+                j += p;
+                k = 1;
+            }
+            else {
+                k++;
+            }
+        }
+        else if (is_rev ? a < b : a > b) {
+            j += k;
+            k = 1;
+            p = j - i;
+        }
+        else {
+            i = j++;
+            k = p = 1;
+        }
+    }
+    *period = p;
+    return i;
+}
+
+static struct ReLiteral* re_lit_compile(struct ReLiteral *lit, struct ReAst *n)
+{
+    /* Copy the string of a CHAR or STRING node and factorize it for Two-Way. The node
+     * can be in a CAT with a .* before and after it.
+     * The string is split at the larger of the two maximal suffixes */
+    unsigned char *s = (unsigned char*)lit->s;
+    int p0, p1, ms, ms1;
+
+    lit->has_head = lit->has_tail = 0;
+    if (n->type == RE_AST_CAT) {
+        struct ReAst *c = n->child;
+        if (c->type == RE_AST_STAR) {
+            lit->has_head = 1;
+            c = c->next;
+        }
+        if (c->next != NULL && c->next->type == RE_AST_STAR)
+            lit->has_tail = 1;
+        n = c;
+    }
+
+    if (n->type == RE_AST_CHAR && lit->len == 1) {
+        s[0] = n->c;
+    }
+    else if (n->type == RE_AST_STRING && lit->len == n->len) {
+        memcpy(s, n->str, n->len);
+    }
+    else {
+        ERROR("Expression is not the string it was sized for\n");
+        return NULL;
+    }
+
+    ms = re_lit_max_suffix(s, lit->len, 0, &p0);
+    ms1 = re_lit_max_suffix(s, lit->len, 1, &p1);
+    if (ms1 > ms) {
+        ms = ms1;
+        p0 = p1;
+    }
+    lit->ms = ms;
+
+    // left half repeats in the right one, a shift by the period keeps what matched
+    if (memcmp(s, s + p0, ms + 1) == 0) {
+        lit->period = p0;
+        lit->mem0 = lit->len - p0;
+    }
+    else {
+        lit->period = ((ms > lit->len - ms - 1) ? ms : lit->len - ms - 1) + 1;
+        lit->mem0 = 0;
+    }
+    return lit;
+}
+
+static const unsigned char* re_lit_twoway(const struct ReLiteral *lit, const unsigned char *h, const unsigned char *end)
+{
+    /* Two-Way search of [h, end). The right half is compared left to right, on a
+     * mismatch at k the string can move on by k - ms. When it matched, the left half is
+     * compared right to left. mem bytes at the start are known to match after a shift
+     * by the period.
+     * Returns the first match, or NULL */
+    const unsigned char *s = lit->s;
+    int mem = 0;
+    int k;
+
+    while (end - h >= lit->len) {
+        for (k = (lit->ms + 1 > mem) ? lit->ms + 1 : mem ; k < lit->len && s[k] == h[k] ; k++)
+            ;
+        if (k < lit->len) {
+            h += k - lit->ms;
+            mem = 0;
+            continue;
+        }
+
+        for (k = lit->ms + 1 ; k > mem && s[k-1] == h[k-1] ; k--)
+            ;
+        if (k <= mem)
+            return h;
+        h += lit->period;
+        mem = lit->mem0;
+    }
+    return NULL;
+}
+
+#ifdef __SSE2__
+static const unsigned char* re_lit_filter_sse2(const struct ReLiteral *lit, const unsigned char **h, const unsigned char *end)
+{
+    /* Compare 16 positions at a time on the first and last byte, the positions where
+     * both are equal are compared in full. Stops where fewer than 16 positions are left
+     * or when the full compares cost more than RE_LIT_SLACK + the bytes filtered.
+     * Returns the first match, or NULL and sets h to where the search has to go on */
+    const unsigned char *s = lit->s;
+    const unsigned char *p = *h;
+    const __m128i first = _mm_set1_epi8(s[0]);
+    const __m128i last = _mm_set1_epi8(s[lit->len - 1]);
+    size_t wasted = 0;
+
+    for (; end - p >= lit->len - 1 + 16 && wasted <= (size_t)(p - *h) + RE_LIT_SLACK ; p += 16) {
+        __m128i b0 = _mm_loadu_si128((const __m128i*)p);
+        __m128i b1 = _mm_loadu_si128((const __m128i*)(p + lit->len - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(b0, first), _mm_cmpeq_epi8(b1, last)));
+
+        for (; mask != 0 ; mask &= mask - 1) {
+            const unsigned char *q = p + __builtin_ctz(mask);
+            if (memcmp(q + 1, s + 1, lit->len - 2) == 0)
+                return q;
+            wasted += lit->len;
+        }
+    }
+    *h = p;
+    return NULL;
+}
+#endif
+
+static const unsigned char* re_lit_find(const struct ReLiteral *lit, const unsigned char *h, const unsigned char *end)
+{
+    /* First match of the string in [h, end). A string of one byte is a memchr().
+     * Returns NULL when there is none */
+    if (end - h < lit->len)
+        return NULL;
+    if (lit->len == 1)
+        return memchr(h, lit->s[0], end - h);
+
+#ifdef __SSE2__
+    const unsigned char *found = re_lit_filter_sse2(lit, &h, end);
+    if (found != NULL)
+        return found;
+#endif
+    return re_lit_twoway(lit, h, end);
+}
+
+static void re_lit_match(struct ReLiteral *lit, const char *str, unsigned int from, unsigned int len, struct ReMatch *m, struct ReStats *st)
+{
+    /* The first match is the leftmost and longest one, all matches have the same length.
+     * A .* in front moves the start back to where the chars that '.' takes start, a
+     * match can then end in any later match of the string before a linebreak. A .* after
+     * it moves the end on to the next linebreak. The string has no linebreak then.
+     * The search starts at from, the input ends at len or '\0'.
+     * Work is added to st unless it is NULL, bytes up to the end of the match count */
+    const unsigned char *s = (const unsigned char*)str;
+    const unsigned char *end = s + from + strnlen(str + from, len - from);
+    const unsigned char *found = re_lit_find(lit, s + from, end);
+    const unsigned char *p, *q;
+
+    if (found == NULL) {
+        if (st != NULL)
+            st->bytes += end - (s + from);
+        return;
+    }
+
+    for (p = found ; lit->has_head && p > s + from && !re_is_linebreak(p[-1]) ; p--)
+        ;
+    for (q = found + lit->len ; lit->has_tail && q < end && !re_is_linebreak(*q) ; q++)
+        ;
+    if (lit->has_head && !lit->has_tail) {
+        const unsigned char *eol = q;
+        while (eol < end && !re_is_linebreak(*eol))
+            eol++;
+        for (; (found = re_lit_find(lit, found + 1, eol)) != NULL ; q = found + lit->len)
+            ;
+    }
+
+    m->istart = p - s;
+    m->iend = q - s;
+    m->state = 1;
+    if (st != NULL)
+        st->bytes += q - (s + from);
+}
+
+static const char* re_lit_find_line(struct ReLiteral *lit, const char *p, const char *end, const char **eol, struct ReStats *st)
+{
+    /* The whole buffer is searched at once, the line around the first match is the
+     * line. The string must not have a '\n' */
+    const unsigned char *found = re_lit_find(lit, (const unsigned char*)p, (const unsigned char*)end);
+    const char *bol;
+
+    if (st != NULL)
+        st->bytes += (found != NULL ? (const char*)found + lit->len : end) - p;
+    if (found == NULL)
+        return NULL;
+
+    for (bol = (const char*)found ; bol > p && bol[-1] != '\n' ; bol--)
+        ;
+    *eol = memchr((const char*)found + lit->len, '\n', end - ((const char*)found + lit->len));
+    if (*eol == NULL)
+        *eol = end;
+    return bol;
+}
+
+
+///// LAZY DFA ///////////////////////////////////////////////////
+/* A search that isn't anchored adds the start states back after every char, like a .* in
+ * front of the expression, so the walk can stop at the first state that has the match
+ * state to tell there is a match. Where it is takes an anchored walk forward and a walk of
+ * the reversed expression backwards, see re_match_captures().
+ * ^ holds in the start state only, $ is kept in the set and checked at the end of input.
+ * Expressions with counting states have no DFA, a counter has no finite set of states. */
+
+// Transition that was not taken yet
+#define RE_DFA_UNKNOWN   (-1)
+// Returned when the cache has no room for a new state
+#define RE_DFA_FULL      (-2)
+// Transitions into states that end the walk are stored tagged, the walk only has to
+// check for a negative value to leave the fast path
+#define RE_DFA_TAG(id)   (-3 - (id))
+
+enum ReDfaFlag {
+    RE_DFA_MATCH      = 1 << 0,     // set has the match state
+    RE_DFA_EOL_MATCH  = 1 << 1,     // set reaches the match state at the end of input
+    RE_DFA_DEAD       = 1 << 2,     // set is empty, nothing can match any more
+    RE_DFA_START      = 1 << 3,     // state at the start of the input
+    RE_DFA_ANCHORED   = 1 << 4,     // start states are not added back
+    RE_DFA_REVERSE    = 1 << 5,     // set of the reversed NFA, input is read backwards
+};
+
+// Flags that are part of what a state is, equal sets with other flags are other states
+#define RE_DFA_KEY (RE_DFA_START | RE_DFA_ANCHORED | RE_DFA_REVERSE)
+
+/* Walks through the DFA, their states share the cache */
+enum ReDfaMode {
+    RE_DFA_SEARCH    = 0,                   // is there a match anywhere
+    RE_DFA_FORWARD   = RE_DFA_ANCHORED,     // where is the end of a match that starts here
+    RE_DFA_BACKWARD  = RE_DFA_REVERSE,      // where do matches start, read from the end
+};
+
+/* A string of re_match_batch() in the DFA */
+struct ReDfaLane {
+    const unsigned char *p;
+    const unsigned char *end;
+    int id;
+    size_t i;
+};
+
+static int re_dfa_cmp(const void *a, const void *b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+static void re_dfa_reset(struct ReDfa *dfa)
+{
+    /* Drop all states */
+    memset(dfa->table, 0xff, sizeof(int) * dfa->tablesiz);
+    dfa->nstates = 0;
+    dfa->nsets = 0;
+    for (int i=0 ; i<6 ; i++)
+        dfa->start[i] = -1;
+}
+
+static struct ReDfa* re_dfa_init(struct Regex *re)
+{
+    /* Split the bytes in classes that every NFA state treats the same and take the
+     * cache from the allocator of the regex.
+     * Returns NULL when there is no allocator, the NFA can't be a DFA or the cache
+     * doesn't fit enough states */
+    struct ReDfa tmp;
+    struct ReArena a;
+    unsigned char is_edge[256];
+    int avg;
+
+    size_t size = re->dfa_budget;
+
+    if (re->start == NULL || re->ncounters > 0 || re->alloc.alloc == NULL || size == 0)
+        return NULL;
+
+    memset(&tmp, 0, sizeof(struct ReDfa));
+    memset(is_edge, 0, sizeof(is_edge));
+
+    // a new class starts at every byte where a state starts or stops to match
+    for (int i=0 ; i<re->spooln ; i++) {
+        struct ReState *s = &re->spool[i];
+        if (s->type != STATE_TYPE_NONE)
+            continue;
+        int prev = re_state_match_chr(s, 0);
+        for (int c=1 ; c<256 ; c++) {
+            int cur = re_state_match_chr(s, c);
+            if (cur != prev)
+                is_edge[c] = 1;
+            prev = cur;
+        }
+    }
+    for (int c=1 ; c<256 ; c++)
+        tmp.cls[c] = tmp.cls[c-1] + is_edge[c];
+    tmp.nclasses = tmp.cls[255] + 1;
+    tmp.nnfa = re->spooln;
+
+    // Room for the sets that are kept when the cache is emptied is always there.
+    // The rest is shared by the states, guessing that sets are small.
+    avg = tmp.nnfa < 16 ? tmp.nnfa : 16;
+    size_t fixed = RE_ALIGN(sizeof(struct ReDfa)) +
+                   RE_ALIGN(sizeof(int) * tmp.nnfa) * (RE_DFA_LANES + 1) +
+                   RE_ALIGN(sizeof(int) * tmp.nnfa * (RE_DFA_LANES + 2)) +
+                   RE_ARENA_ALIGN * 8;
+    // a state takes its transitions, flags, set bounds, a set of avg entries and at most
+    // 4 slots in the hash table, it is kept at least half empty
+    size_t per = sizeof(int) * tmp.nclasses + 1 + sizeof(int) * (2 + avg + 4);
+    if (fixed >= size || (size - fixed) / per < RE_DFA_LANES + 2) {
+        INFO("NFA too large for DFA cache of %ld bytes: %d states\n", size, tmp.nnfa);
+        return NULL;
+    }
+    tmp.maxstates = (size - fixed) / per;
+    tmp.maxsets = tmp.nnfa * (RE_DFA_LANES + 2) + tmp.maxstates * avg;
+    for (tmp.tablesiz=1 ; tmp.tablesiz < tmp.maxstates * 2 ; tmp.tablesiz *= 2)
+        ;
+
+    void *buf = re->alloc.alloc(size, re->alloc.ctx);
+    if (buf == NULL) {
+        ERROR("Failed to allocate %ld bytes for DFA\n", size);
+        return NULL;
+    }
+    re_arena_init(&a, buf, size);
+
+    struct ReDfa *dfa = re_arena_alloc(&a, sizeof(struct ReDfa));
+    *dfa = tmp;
+    dfa->trans = re_arena_alloc(&a, sizeof(int) * dfa->maxstates * dfa->nclasses);
+    dfa->flags = re_arena_alloc(&a, dfa->maxstates);
+    dfa->setoff = re_arena_alloc(&a, sizeof(int) * dfa->maxstates);
+    dfa->setlen = re_arena_alloc(&a, sizeof(int) * dfa->maxstates);
+    dfa->sets = re_arena_alloc(&a, sizeof(int) * dfa->maxsets);
+    dfa->table = re_arena_alloc(&a, sizeof(int) * dfa->tablesiz);
+    dfa->scratch = re_arena_alloc(&a, sizeof(int) * dfa->nnfa);
+    dfa->save = re_arena_alloc(&a, sizeof(int) * dfa->nnfa * RE_DFA_LANES);
+    if (dfa->save == NULL) {
+        re->alloc.free(buf, re->alloc.ctx);
+        return NULL;
+    }
+
+    re_dfa_reset(dfa);
+    DEBUG("DFA: %d classes, %d states max, %d set entries max\n", dfa->nclasses, dfa->maxstates, dfa->maxsets);
+    return dfa;
+}
+
+static void re_dfa_closure(struct Regex *re, struct ReDfa *dfa, struct ReState *s, int *n, int at_start)
+{
+    /* Add state, or the states it splits into, to the set in scratch.
+     * Caller bumps re->listid for every new set */
+    if (s == NULL || s->lastlist == re->listid)
+        return;
+    s->lastlist = re->listid;
+
+    switch (s->type) {
+        case STATE_TYPE_SPLIT:
+            re_dfa_closure(re, dfa, s->out, n, at_start);
+            re_dfa_closure(re, dfa, s->out1, n, at_start);
+            break;
+        case STATE_TYPE_BOL:
+            if (at_start)
+                re_dfa_closure(re, dfa, s->out, n, at_start);
+            break;
+        case STATE_TYPE_SAVE:
+            re_dfa_closure(re, dfa, s->out, n, at_start);
+            break;
+        default:
+            dfa->scratch[(*n)++] = s - re->spool;
+            break;
+    }
+}
+
+static int re_dfa_eol_match(struct Regex *re, struct ReState *s, int at_start)
+{
+    /* Check if the match state can be reached from s without taking a char, when
+     * the end of input is reached */
+    if (s == NULL || s->lastlist == re->listid)
+        return 0;
+    s->lastlist = re->listid;
+
+    switch (s->type) {
+        case STATE_TYPE_MATCH:
+            return 1;
+        case STATE_TYPE_SPLIT:
+            return re_dfa_eol_match(re, s->out, at_start) || re_dfa_eol_match(re, s->out1, at_start);
+        case STATE_TYPE_EOL:
+        case STATE_TYPE_SAVE:
+            return re_dfa_eol_match(re, s->out, at_start);
+        case STATE_TYPE_BOL:
+            return at_start && re_dfa_eol_match(re, s->out, at_start);
+        default:
+            return 0;
+    }
+}
+
+static int re_dfa_add(struct Regex *re, struct ReDfa *dfa, int *set, int n, unsigned char key)
+{
+    /* Find the state of a sorted set with the RE_DFA_KEY flags in key, or make it.
+     * Returns state id, or RE_DFA_FULL when there is no room for it */
+    unsigned int h = 2166136261u;
+    unsigned char flags = key;
+    int at_start = (key & RE_DFA_START) != 0;
+    int slot, id;
+
+    for (int i=0 ; i<n ; i++)
+        h = (h ^ set[i]) * 16777619u;
+    h = (h ^ flags) * 16777619u;
+
+    for (slot = h & (dfa->tablesiz-1) ; (id = dfa->table[slot]) >= 0 ; slot = (slot+1) & (dfa->tablesiz-1)) {
+        if ((dfa->flags[id] & RE_DFA_KEY) == key && dfa->setlen[id] == n &&
+                memcmp(dfa->sets + dfa->setoff[id], set, sizeof(int) * n) == 0)
+            return id;
+    }
+
+    if (dfa->nstates == dfa->maxstates || dfa->nsets + n > dfa->maxsets)
+        return RE_DFA_FULL;
+
+    id = dfa->nstates++;
+    dfa->table[slot] = id;
+    dfa->setoff[id] = dfa->nsets;
+    dfa->setlen[id] = n;
+    memcpy(dfa->sets + dfa->nsets, set, sizeof(int) * n);
+    dfa->nsets += n;
+    for (int c=0 ; c<dfa->nclasses ; c++)
+        dfa->trans[id*dfa->nclasses + c] = RE_DFA_UNKNOWN;
+
+    if (n == 0)
+        flags |= RE_DFA_DEAD;
+
+    re->listid++;
+    for (int i=0 ; i<n ; i++) {
+        struct ReState *s = &re->spool[set[i]];
+        if (s->type == STATE_TYPE_MATCH)
+            flags |= RE_DFA_MATCH | RE_DFA_EOL_MATCH;
+        else if (s->type == STATE_TYPE_EOL && re_dfa_eol_match(re, s->out, at_start))
+            flags |= RE_DFA_EOL_MATCH;
+    }
+    dfa->flags[id] = flags;
+    return id;
+}
+
+static int re_dfa_start(struct Regex *re, struct ReDfa *dfa, enum ReDfaMode mode, int at_start)
+{
+    /* Get the state a walk starts in, ^ only holds at the start of the input.
+     * Returns state id, or RE_DFA_FULL */
+    int *start = &dfa->start[(mode >> 4) * 2 + at_start];
+    int n = 0;
+
+    if (*start >= 0)
+        return *start;
+
+    re->listid++;
+    re_dfa_closure(re, dfa, (mode & RE_DFA_REVERSE) ? re->rev : re->start, &n, at_start);
+    qsort(dfa->scratch, n, sizeof(int), re_dfa_cmp);
+    *start = re_dfa_add(re, dfa, dfa->scratch, n, mode | (at_start ? RE_DFA_START : 0));
+    return *start;
+}
+
+static int re_dfa_step(struct Regex *re, struct ReDfa *dfa, int id, unsigned char c)
+{
+    /* Make the transition of state on char and store it.
+     * Returns the stored transition, or RE_DFA_FULL */
+    const int *set = dfa->sets + dfa->setoff[id];
+    unsigned char mode = dfa->flags[id] & (RE_DFA_ANCHORED | RE_DFA_REVERSE);
+    int n = 0;
+    int next;
+
+    re->listid++;
+    for (int i=0 ; i<dfa->setlen[id] ; i++) {
+        struct ReState *s = &re->spool[set[i]];
+        if (s->type == STATE_TYPE_NONE && re_state_match_chr(s, c)) {
+            re_dfa_closure(re, dfa, s->out, &n, 0);
+            re_dfa_closure(re, dfa, s->out1, &n, 0);
+        }
+    }
+    if (!(mode & RE_DFA_ANCHORED))
+        re_dfa_closure(re, dfa, (mode & RE_DFA_REVERSE) ? re->rev : re->start, &n, 0);
+    qsort(dfa->scratch, n, sizeof(int), re_dfa_cmp);
+
+    if ((next = re_dfa_add(re, dfa, dfa->scratch, n, mode)) == RE_DFA_FULL)
+        return RE_DFA_FULL;
+
+    if (dfa->flags[next] & (RE_DFA_MATCH | RE_DFA_DEAD))
+        next = RE_DFA_TAG(next);
+    dfa->trans[id*dfa->nclasses + dfa->cls[c]] = next;
+    return next;
+}
+
+static struct ReDfa* re_dfa_get(struct Regex *re)
+{
+    /* DFA of regex, it is made on first use. Returns NULL when there is none */
+    if (re->dfa == NULL && !re->no_dfa) {
+        re->dfa = re_dfa_init(re);
+        re->no_dfa = re->dfa == NULL;
+    }
+    return re->dfa;
+}
+
+static int re_dfa_flush(struct Regex *re, struct ReDfa *dfa, struct ReDfaLane *lanes, int nlanes, unsigned long walked)
+{
+    /* Empty the cache but keep the states the lanes are in. walked is the bytes the
+     * current walk took so far. A cache that filled up before it was walked for
+     * RE_DFA_MIN_YIELD bytes per state is thrashing, making states costs more than the
+     * NFA would.
+     * Returns 1 when the walk can go on in the DFA, 0 when it should go to the NFA */
+    int len[RE_DFA_LANES];
+    unsigned char key[RE_DFA_LANES];
+    unsigned long used = dfa->nbytes + walked - dfa->mark;
+    int is_thrashing = used < (unsigned long)dfa->nstates * RE_DFA_MIN_YIELD;
+
+    DEBUG("DFA cache full, %d states after %ld bytes\n", dfa->nstates, used);
+    dfa->nbytes = 0;
+    dfa->mark = walked;
+    if (re->flags & RE_STATS) {
+        re->stats.dfa_flushes++;
+        re->stats.dfa_fallbacks += is_thrashing;
+    }
+
+    for (int i=0 ; i<nlanes ; i++) {
+        int id = lanes[i].id;
+        len[i] = dfa->setlen[id];
+        key[i] = dfa->flags[id] & RE_DFA_KEY;
+        memcpy(dfa->save + i*dfa->nnfa, dfa->sets + dfa->setoff[id], sizeof(int) * len[i]);
+    }
+
+    re_dfa_reset(dfa);
+
+    // there is always room for these
+    for (int i=0 ; i<nlanes ; i++)
+        lanes[i].id = re_dfa_add(re, dfa, dfa->save + i*dfa->nnfa, len[i], key[i]);
+    return !is_thrashing;
+}
+
+static void re_dfa_walk_end(struct ReDfa *dfa, unsigned long walked)
+{
+    /* Add the bytes of a walk that is done to the bytes the cache was used for */
+    dfa->nbytes += walked - dfa->mark;
+    dfa->mark = 0;
+}
+
+static int re_ac_is_match(struct ReAc *ac, const char *str, struct ReStats *st)
+{
+    /* Any node that ends a string is a match, no need to look for the leftmost one */
+    int v = 0;
+    unsigned int i;
+
+    for (i=0 ; str[i] && ac->olen[v] == 0 ; i++)
+        v = ac->delta[v*ac->nclasses + ac->cls[(unsigned char)str[i]]];
+
+    if (st != NULL) {
+        st->bytes += i;
+        st->states += i;
+        if (i > 0 && st->peak < 1)
+            st->peak = 1;
+    }
+    return ac->olen[v] > 0;
+}
+
+
+///// SHUFFLE DFA ////////////////////////////////////////////////
+/* Expressions whose search DFA has at most RE_SHUF_STATES states, after the states that
+ * can't be told apart are merged, get the whole DFA as a table of byte shuffles. With
+ * SSSE3 the rows of 4 bytes are combined into one with PSHUFB, which doesn't wait for
+ * the state, and the state takes one shuffle per 4 bytes instead of a dependent load
+ * per byte. Without it the same table is walked a byte at a time. re_is_match() and
+ * re_match_batch() use it, they only need to know if there is a match.
+ * http://0x80.pl/notesen/2023-03-06-parsing-shuffle-dfa.html */
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define RE_SHUF_SSSE3
+#endif
+
+static struct ReShuffle* re_shuf_init(struct Regex *re)
+{
+    /* Make every transition of the search DFA from its start, up to RE_SHUF_EXPLORE
+     * states, and merge the states that can't be told apart: split states by their
+     * flags, then by the groups of their next states, until no group splits (Moore).
+     * Returns NULL when there are more than RE_SHUF_STATES groups, the DFA cache is too
+     * small or there is no DFA */
+    struct ReDfa *dfa = re_dfa_get(re);
+    struct ReShuffle *sh;
+    unsigned char *next;
+    unsigned char rep[256];
+    int ids[RE_SHUF_EXPLORE];
+    unsigned char grp[RE_SHUF_EXPLORE];
+    unsigned char ngrp[RE_SHUF_EXPLORE];
+    int n = 0;
+    int ngroups = 0;
+    int is_ok = 1;
+
+    if (dfa == NULL)
+        return NULL;
+
+    // a byte of every class to make its transitions with
+    for (int c=255 ; c>=0 ; c--)
+        rep[dfa->cls[c]] = c;
+
+    if ((ids[n++] = re_dfa_start(re, dfa, RE_DFA_SEARCH, 1)) == RE_DFA_FULL)
+        return NULL;
+    if ((next = re->alloc.alloc(RE_SHUF_EXPLORE * dfa->nclasses, re->alloc.ctx)) == NULL)
+        return NULL;
+
+    for (int i=0 ; i<n && is_ok ; i++) {
+        int is_final = (dfa->flags[ids[i]] & (RE_DFA_MATCH | RE_DFA_DEAD)) != 0;
+
+        for (int c=0 ; c<dfa->nclasses && is_ok ; c++) {
+            int v = dfa->trans[ids[i]*dfa->nclasses + c];
+            int j;
+
+            if (is_final) {
+                next[i*dfa->nclasses + c] = i;
+                continue;
+            }
+            if (v == RE_DFA_UNKNOWN && (v = re_dfa_step(re, dfa, ids[i], rep[c])) == RE_DFA_FULL) {
+                is_ok = 0;
+                break;
+            }
+            if (v < 0)
+                v = RE_DFA_TAG(v);
+
+            for (j=0 ; j<n && ids[j] != v ; j++)
+                ;
+            if (j == n && (is_ok = n < RE_SHUF_EXPLORE))
+                ids[n++] = v;
+            next[i*dfa->nclasses + c] = j;
+        }
+    }
+
+    // groups of equal flags, then split them until the count stays the same
+    for (int i=0 ; i<n ; i++)
+        grp[i] = dfa->flags[ids[i]] & (RE_DFA_MATCH | RE_DFA_DEAD | RE_DFA_EOL_MATCH);
+    for (int k=-1 ; is_ok && k != ngroups ; ) {
+        k = ngroups;
+        ngroups = 0;
+        for (int i=0 ; i<n ; i++) {
+            int j;
+            for (j=0 ; j<i ; j++) {
+                int c = 0;
+                if (grp[j] != grp[i])
+                    continue;
+                while (c < dfa->nclasses && grp[next[i*dfa->nclasses + c]] == grp[next[j*dfa->nclasses + c]])
+                    c++;
+                if (c == dfa->nclasses)
+                    break;
+            }
+            ngrp[i] = (j < i) ? ngrp[j] : ngroups++;
+        }
+        memcpy(grp, ngrp, n);
+    }
+
+    if (!is_ok || ngroups > RE_SHUF_STATES ||
+            (sh = re->alloc.alloc(sizeof(struct ReShuffle), re->alloc.ctx)) == NULL) {
+        DEBUG("No shuffle DFA: %d states, %d groups\n", n, ngroups);
+        re->alloc.free(next, re->alloc.ctx);
+        return NULL;
+    }
+
+    memset(sh, 0, sizeof(struct ReShuffle));
+    sh->nstates = ngroups;
+    sh->start = grp[0];
+    for (int i=0 ; i<n ; i++) {
+        unsigned char fl = dfa->flags[ids[i]];
+        for (int b=0 ; b<256 ; b++)
+            sh->trans[b][grp[i]] = grp[next[i*dfa->nclasses + dfa->cls[b]]];
+        if (fl & (RE_DFA_MATCH | RE_DFA_DEAD))
+            sh->final |= 1 << grp[i];
+        if (fl & RE_DFA_MATCH)
+            sh->match |= 1 << grp[i];
+        if (fl & RE_DFA_EOL_MATCH)
+            sh->eol_match |= 1 << grp[i];
+    }
+#ifdef RE_SHUF_SSSE3
+    sh->has_ssse3 = __builtin_cpu_supports("ssse3") != 0;
+#endif
+
+    re->alloc.free(next, re->alloc.ctx);
+    DEBUG("SHUFFLE DFA: %d states from %d, ssse3=%d\n", ngroups, n, sh->has_ssse3);
+    return sh;
+}
+
+static struct ReShuffle* re_shuf_get(struct Regex *re)
+{
+    /* Shuffle DFA of regex, it is made on first use. Returns NULL when there is none */
+    if (re->shuf == NULL && !re->no_shuf) {
+        re->shuf = re_shuf_init(re);
+        re->no_shuf = re->shuf == NULL;
+    }
+    return re->shuf;
+}
+
+static int re_shuf_walk(const struct ReShuffle *sh, int s, const unsigned char **p, const unsigned char *end)
+{
+    /* Step from state s a byte at a time until end or a final state.
+     * Returns the state, p is set to where the walk stopped */
+    const unsigned char *q = *p;
+
+    for (; q < end && !((sh->final >> s) & 1) ; q++)
+        s = sh->trans[*q][s];
+    *p = q;
+    return s;
+}
+
+#ifdef RE_SHUF_SSSE3
+__attribute__((target("ssse3")))
+static int re_shuf_walk_ssse3(const struct ReShuffle *sh, const unsigned char **p, const unsigned char *end)
+{
+    /* Combine the rows of 4 bytes, m[s] = t3[t2[t1[t0[s]]]], and step the state with
+     * it. All lanes hold the state, it is checked for a final state every 16 bytes, the
+     * bytes that are left are walked one at a time.
+     * Returns the state, p is set to where the walk stopped */
+    const unsigned char *q = *p;
+    __m128i v = _mm_set1_epi8(sh->start);
+    int s = sh->start;
+
+    for (; end - q >= 16 && !((sh->final >> s) & 1) ; q += 16) {
+        for (int k=0 ; k<16 ; k+=4) {
+            __m128i t0 = _mm_loadu_si128((const __m128i*)sh->trans[q[k]]);
+            __m128i t1 = _mm_loadu_si128((const __m128i*)sh->trans[q[k+1]]);
+            __m128i t2 = _mm_loadu_si128((const __m128i*)sh->trans[q[k+2]]);
+            __m128i t3 = _mm_loadu_si128((const __m128i*)sh->trans[q[k+3]]);
+            __m128i m = _mm_shuffle_epi8(_mm_shuffle_epi8(t3, t2), _mm_shuffle_epi8(t1, t0));
+            v = _mm_shuffle_epi8(m, v);
+        }
+        s = _mm_cvtsi128_si32(v) & 0xff;
+    }
+    *p = q;
+    return re_shuf_walk(sh, s, p, end);
+}
+#endif
+
+static int re_shuf_is_match(struct Regex *re, const struct ReShuffle *sh, const unsigned char *p, const unsigned char *end)
+{
+    /* Check if [p, end) has a match. Returns 1 on match, 0 otherwise */
+    const unsigned char *q = p;
+    int s;
+
+#ifdef RE_SHUF_SSSE3
+    if (sh->has_ssse3)
+        s = re_shuf_walk_ssse3(sh, &q, end);
+    else
+#endif
+        s = re_shuf_walk(sh, sh->start, &q, end);
+
+    if (re->flags & RE_STATS)
+        re_stats_add(re, q - p, q - p, q > p);
+    if ((sh->final >> s) & 1)
+        return (sh->match >> s) & 1;
+    return (sh->eol_match >> s) & 1;
+}
+
+
+///// REGEX MAIN STRUCT //////////////////////////////////////////
+static struct ReSizes* re_sizes_from_expr(struct ReSizes *sz, const char *expr, int flags)
+{
+    /* Dry run the tokenizer to find the pool sizes needed for expression.
+     * Every token ends up as one syntax tree node at most, character classes get an
+     * extra token and concat symbols can double the length of the token list.
+     * States and positions are counted the way the compiler makes them: one for every
+     * char or class, one split for every quantifier and '|'. The rewrites only take
+     * them away.
+     * Repetitions that are unrolled count as the expression they expand to.
+     * Returns NULL when the expanded expression is too large or needs more than
+     * RE_MAX_COMPILE_SIZE bytes */
+    struct ReToken t;
+    int ntok = 0;
+    int ncclass = 0;
+    int ncitem = 0;         // tokens in classes, the parser takes only these from the pool
+    int nclass = 0;
+    int npipe = 0;
+    int in_cclass = 0;
+    int is_eol = 0;         // last token is $
+    int is_bounded = 1;     // no repetition without a maximum
+
+    // Code points >= 0x80 of the current class with RE_UTF8
+    struct ReUtf8Set uset;
+    int is_negated = 0;
+    int nitem = 0;
+    unsigned char bytes[4];
+
+    // Expression is an alternation of strings, optionally in one group: (GET|POST)
+    int is_strings = 1;
+    int is_empty = 1;       // current string is empty
+    int nchar = 0;
+    int ngroup = 0;
+    int ngroup_end = 0;
+    int igroup_end = -1;
+    // Expression is one string of plain chars, a .* in front and after it only grows the
+    // matches: .*error.* Steps are 0 at the start, 1 after the '.' of the head, 2 in the
+    // string, 3 after the '.' of the tail, 4 after the tail, -1 when it isn't one.
+    int lit = 0;
+    int has_dotstar = 0;
+    int has_break = 0;      // string has a char that '.' doesn't take
+    struct ReClass chars;
+    memset(&chars, 0, sizeof(struct ReClass));
+
+    // A repetition gets a counting state when compiled to an NFA and the repeated atom is
+    // a char or class with more copies than RE_MAX_UNROLL, else it is unrolled. Marks are the counts where the last atom starts.
+    // A captured group is unrolled so every copy saves its own positions.
+    // With RE_UTF8 the byte sequences of a char are counted the same way, when their
+    // nodes times the copies are more than RE_MAX_UNROLL. Not with RE_CAPTURE.
+    int can_count = !(flags & RE_GLUSHKOV);
+    long neff = 0;          // tokens after unrolling
+    long nst = 0;           // NFA states after unrolling, without the match state
+    long nleaf = 0;         // chars and classes after unrolling, the Glushkov positions
+    long ncounter = 0;
+    long nring = 0;
+    int is_countable = 0;   // last atom is a char or class
+    int nseq = 0;           // last atom is UTF-8 byte sequences of that many nodes
+    int natom = 0;          // atoms in current group
+    int has_pipe = 0;
+    long mark = 0, smark = 0, lmark = 0, cmark = 0, rmark = 0;
+    long nutf8 = 0, umark = 0;  // tokens that are UTF-8 sequences, with RE_UTF8
+    int is_utf8_unrolled = 0;   // one of them is in a repetition that is unrolled
+    struct {
+        long mark, smark, lmark, cmark, rmark, umark;
+        int natom, has_pipe;
+    } group[100], *gp = group;
+
+    while (*expr != '\0') {
+        memset(&t, 0, sizeof(struct ReToken));
+        re_token_from_str(&t, &expr, in_cclass, flags);
+
+        if (in_cclass && t.type != RE_TOK_TYPE_CCLASS_END) {
+            // part of the class atom
+        }
+        else if (t.type == RE_TOK_TYPE_GROUP_START) {
+            if (gp >= group+100) {
+                ERROR("Too many nested groups\n");
+                return NULL;
+            }
+            gp->mark = neff;
+            gp->smark = nst;
+            gp->lmark = nleaf;
+            gp->cmark = ncounter;
+            gp->rmark = nring;
+            gp->umark = nutf8;
+            gp->natom = natom;
+            gp->has_pipe = has_pipe;
+            gp++;
+            natom = 0;
+            has_pipe = 0;
+        }
+        else if (t.type == RE_TOK_TYPE_GROUP_END) {
+            // group of one char or class is countable: (a){3}
+            int is_atom = natom == 1 && !has_pipe && !(flags & RE_CAPTURE);
+            is_countable = is_countable && is_atom;
+            if (!is_atom)
+                nseq = 0;
+            if (gp > group) {
+                gp--;
+                mark = gp->mark;
+                smark = gp->smark;
+                lmark = gp->lmark;
+                cmark = gp->cmark;
+                rmark = gp->rmark;
+                umark = gp->umark;
+                natom = gp->natom;
+                has_pipe = gp->has_pipe;
+            }
+            natom++;
+            // a captured group is saved where it starts and ends
+            if (flags & RE_CAPTURE)
+                nst += 2;
+        }
+        else if (t.type == RE_TOK_TYPE_PIPE) {
+            has_pipe = 1;
+            nst++;
+        }
+        else if (t.type == RE_TOK_TYPE_STAR || t.type == RE_TOK_TYPE_PLUS || t.type == RE_TOK_TYPE_QUESTION) {
+            is_bounded = is_bounded && t.type == RE_TOK_TYPE_QUESTION;
+            is_countable = 0;
+            nseq = 0;
+            nst++;
+        }
+        else if (t.type == RE_TOK_TYPE_REPEAT) {
+            is_bounded = is_bounded && t.max >= 0;
+            if (can_count && ((is_countable && re_repeat_is_counted(1, t.min, t.max)) ||
+                              (nseq > 0 && !(flags & RE_CAPTURE) && re_repeat_is_counted(nseq, t.min, t.max)))) {
+                // a UTF-8 counter has a state where its chars end as well
+                neff += (nseq > 0);
+                nst += (nseq > 0) ? 2 : 0;
+                ncounter++;
+                nring += (t.max >= 0 ? t.max : t.min + 1) + 1;
+            }
+            else {
+                // copies of the atom + a quantifier and concat for every copy,
+                // the optional copies have a split each: x{2,4} -> xx(x(x)?)?
+                long ncopy = (t.max < 0) ? (t.min > 0 ? t.min : 1) : t.max;
+                neff += (ncopy - 1) * (neff - mark) + 2 * ncopy;
+                nst += (ncopy - 1) * (nst - smark) + ((t.max < 0) ? 1 : t.max - t.min);
+                nleaf += (ncopy - 1) * (nleaf - lmark);
+                ncounter += (ncopy - 1) * (ncounter - cmark);
+                nring += (ncopy - 1) * (nring - rmark);
+                is_utf8_unrolled = is_utf8_unrolled || nutf8 > umark;
+                if (neff > RE_MAX_EXPANDED || nring > RE_MAX_EXPANDED) {
+                    ERROR("Expression is too large when repetitions are unrolled\n");
+                    return NULL;
+                }
+            }
+            is_countable = 0;
+            nseq = 0;
+        }
+        else if (t.type != RE_TOK_TYPE_CCLASS_END) {
+            // start of atom, a class atom starts here as well and ends at ']'
+            is_countable = t.type != RE_TOK_TYPE_CARET && t.type != RE_TOK_TYPE_END;
+            nseq = 0;
+            mark = neff;
+            smark = nst;
+            lmark = nleaf;
+            cmark = ncounter;
+            rmark = nring;
+            umark = nutf8;
+            natom++;
+            nst++;
+            nleaf++;
+        }
+        neff++;
+
+        // With RE_UTF8 a token that matches non-ASCII chars is an alternation of byte
+        // sequences, it is not a char or class any more
+        if (flags & RE_UTF8) {
+            int nset = 0;
+            if (t.type == RE_TOK_TYPE_CCLASS_START) {
+                uset.n = 0;
+                is_negated = 0;
+                nitem = 0;
+            }
+            else if (in_cclass && t.type != RE_TOK_TYPE_CCLASS_END) {
+                if (t.type == RE_TOK_TYPE_CARET && nitem == 0)
+                    is_negated = 1;
+                else if (re_utf8_set_add(&uset, &t) < 0)
+                    return NULL;
+                nitem++;
+            }
+            else if (in_cclass) {
+                re_utf8_set_finish(&uset, is_negated);
+                nset = uset.n;
+            }
+            else if ((nset = re_utf8_set_from_token(&uset, &t)) < 0) {
+                return NULL;
+            }
+
+            if (nset > 0) {
+                if ((nseq = re_ast_utf8_count(&uset)) < 0)
+                    return NULL;
+                neff += nseq + 1;
+                nst += nseq + 1;
+                nleaf += nseq;
+                nutf8++;
+                is_countable = 0;
+            }
+        }
+
+        switch (t.type) {
+            case RE_TOK_TYPE_CHAR:
+                // both cases of a letter are one byte class, a UTF-8 char is a string of bytes
+                if ((flags & RE_UTF8) && t.cp0 >= 0x80) {
+                    int len = re_utf8_encode(t.cp0, bytes);
+                    for (int i=0 ; i<len ; i++)
+                        RE_CLASS_ADD(&chars, bytes[i]);
+                    nchar += len - 1;
+                }
+                else {
+                    RE_CLASS_ADD(&chars, ((flags & RE_ICASE) && re_is_alpha(t.c0)) ? (t.c0 | 0x20) : t.c0);
+                }
+                is_empty = 0;
+                nchar++;
+                break;
+            case RE_TOK_TYPE_PIPE:
+            case RE_TOK_TYPE_GROUP_END:
+                if (is_empty)
+                    is_strings = 0;
+                if (t.type == RE_TOK_TYPE_GROUP_END) {
+                    igroup_end = ntok;
+                    ngroup_end++;
+                }
+                is_empty = 1;
+                break;
+            case RE_TOK_TYPE_GROUP_START:
+                if (ntok > 0)
+                    is_strings = 0;
+                ngroup++;
+                break;
+            default:
+                is_strings = 0;
+                break;
+        }
+
+        // With RE_UTF8 '.' is no class of bytes that a match can be grown over
+        int is_char = t.type == RE_TOK_TYPE_CHAR && !((flags & RE_ICASE) && re_is_alpha(t.c0));
+        int is_dot = t.type == RE_TOK_TYPE_DOT && !(flags & RE_UTF8);
+        if (lit == 0 && is_dot) {
+            lit = 1;
+        }
+        else if ((lit == 1 || lit == 3) && t.type == RE_TOK_TYPE_STAR) {
+            lit++;
+            has_dotstar = 1;
+        }
+        else if ((lit == 0 || lit == 2) && is_char) {
+            lit = 2;
+            has_break = has_break || re_is_linebreak(t.c0);
+        }
+        else if (lit == 2 && is_dot) {
+            lit = 3;
+        }
+        else {
+            lit = -1;
+        }
+
+        if (t.type != RE_TOK_TYPE_GROUP_END)
+            is_eol = !in_cclass && t.type == RE_TOK_TYPE_END;
+
+        if (t.type == RE_TOK_TYPE_CCLASS_START) {
+            in_cclass = 1;
+            ncclass++;
+        }
+        else if (t.type == RE_TOK_TYPE_CCLASS_END) {
+            in_cclass = 0;
+        }
+        else if (in_cclass) {
+            ncitem++;
+        }
+        else if (re_token_is_class(&t)) {
+            nclass++;
+        }
+        else if (!in_cclass && (flags & RE_ICASE) && t.type == RE_TOK_TYPE_CHAR && re_is_alpha(t.c0)) {
+            nclass++;
+        }
+        else if (!in_cclass && t.type == RE_TOK_TYPE_PIPE) {
+            npipe++;
+        }
+        ntok++;
+    }
+
+    sz->ntokens = ncclass + ncitem;
+    sz->nlist = 0;
+    sz->nast = 3*neff + 2;
+    sz->nclass = ncclass + nclass + npipe;
+    sz->nstr = neff;
+    sz->nacnodes = 0;
+    sz->naccls = 0;
+    sz->ncounters = ncounter;
+    sz->nrings = nring;
+    sz->nthreads = 0;
+    sz->ncaps = 0;
+    sz->nlit = 0;
+
+    // A single string is not an alternation, group must hold the full expression
+    if (ngroup > 1 || ngroup != ngroup_end || (ngroup == 1 && igroup_end != ntok-1))
+        is_strings = 0;
+    if (npipe == 0 || (is_empty && igroup_end != ntok-1) || nchar+1 > 0xffff)
+        is_strings = 0;
+    if (flags & RE_CAPTURE)
+        is_strings = 0;
+
+    if (is_strings) {
+        DEBUG("IS ALTERNATION OF STRINGS\n");
+        char c;
+        sz->ntokens = ntok;
+        sz->nlist = ntok;
+        sz->nacnodes = nchar + 1;
+        sz->naccls = re_class_count(&chars, &c) + 1;
+        sz->nast = 0;
+        sz->nclass = 0;
+        sz->nstr = 0;
+        sz->nstates = 0;
+        sz->npos = 0;
+        sz->nwords = 0;
+    }
+    else if ((lit == 2 || lit == 4) && nchar > 0 && !(has_dotstar && has_break)) {
+        DEBUG("IS LITERAL\n");
+        // a concat of the tokens, a UTF-8 char is a concat of its bytes
+        sz->nast = neff + nchar + 1;
+        sz->nlit = nchar;
+        sz->nstates = 0;
+        sz->ncounters = 0;
+        sz->nrings = 0;
+        sz->npos = 0;
+        sz->nwords = 0;
+    }
+    else if (flags & RE_GLUSHKOV) {
+        sz->nstates = 0;
+        sz->npos = nleaf;
+        sz->nwords = (nleaf + RE_SET_BITS - 1) / RE_SET_BITS;
+    }
+    else {
+        sz->nstates = nst + 1;
+        sz->npos = 0;
+        sz->nwords = 0;
+
+        // room for the reversed NFA
+        if (is_eol || (flags & RE_CAPTURE) || (is_bounded && ncounter == 0)) {
+            sz->nstates *= 2;
+            sz->ncounters *= 2;
+            sz->nrings *= 2;
+        }
+        if (flags & RE_CAPTURE)
+            sz->ncaps = 2 * ngroup;
+        sz->nthreads = sz->nstates + ((flags & RE_CAPTURE) ? nring : 0);
+    }
+
+    // a UTF-8 sequence in a repeated group, or in any repetition with RE_CAPTURE, is copied for every count
+    size_t size = re_sizes_resident(sz) + re_sizes_scratch(sz);
+    if (size > RE_MAX_COMPILE_SIZE) {
+        ERROR("Expression is too large, it needs %zu bytes and at most %d are allowed%s\n", size, RE_MAX_COMPILE_SIZE,
+              is_utf8_unrolled ? ". With RE_UTF8 a repeated group with '.' or a non-ASCII class in it is unrolled, with RE_CAPTURE any repetition of them" : "");
+        return NULL;
+    }
+    return sz;
+}
+
+static size_t re_sizes_resident(struct ReSizes *sz)
+{
+    /* Amount of arena memory the compiled expression keeps.
+     * Must reflect the persistent allocations done in re_init_pools(),
+     * re_glushkov_init(), re_ac_init() and re_lit_init() */
+    size_t setsiz = sizeof(unsigned int) * sz->nwords;
+    size_t size = RE_ALIGN(sizeof(struct ReClass) * sz->nclass);
+
+    if (sz->nacnodes > 0) {
+        size += RE_ALIGN(sizeof(struct ReAc)) +
+                RE_ALIGN(sizeof(unsigned short) * sz->nacnodes * sz->naccls) +
+                RE_ALIGN(sizeof(unsigned short) * sz->nacnodes);
+    }
+    if (sz->nlit > 0) {
+        size += RE_ALIGN(sizeof(struct ReLiteral)) +
+                RE_ALIGN(sz->nlit);
+    }
+    if (sz->nstates > 0) {
+        size += RE_ALIGN(sizeof(struct ReState) * sz->nstates) +
+                RE_ALIGN(sizeof(struct ReState*) * sz->nthreads) * 2 +
+                RE_ALIGN(sizeof(unsigned int) * sz->nthreads) * 2;
+    }
+    if (sz->ncaps > 0) {
+        size += RE_ALIGN(sizeof(int) * sz->nthreads * sz->ncaps) * 2 +
+                RE_ALIGN(sizeof(int) * sz->ncaps);
+    }
+    if (sz->ncounters > 0) {
+        size += RE_ALIGN(sizeof(struct ReCounter) * sz->ncounters) +
+                RE_ALIGN(sizeof(struct ReCount) * sz->nrings);
+    }
+    if (sz->npos > 0) {
+        size += RE_ALIGN(sizeof(struct ReGlushkov)) +
+                RE_ALIGN(sizeof(struct ReState) * sz->npos) +
+                RE_ALIGN(setsiz * sz->npos) +
+                RE_ALIGN(setsiz * 256) +
+                RE_ALIGN(setsiz) * 5;
+    }
+    return size;
+}
+
+static size_t re_sizes_scratch(struct ReSizes *sz)
+{
+    /* Amount of arena memory only used while compiling.
+     * Must reflect the temporary allocations done in re_init_pools(), re_compile(),
+     * re_glushkov_compile() and re_ac_compile() */
+    size_t setsiz = sizeof(unsigned int) * sz->nwords;
+    size_t size = RE_ALIGN(sizeof(struct ReToken*) * sz->nlist) +
+                  RE_ALIGN(sizeof(struct ReToken) * sz->ntokens);
+
+    // failure links and the queue of Aho-Corasick
+    if (sz->nacnodes > 0) {
+        return size + RE_ALIGN(sizeof(unsigned short) * sz->nacnodes) +
+                      RE_ALIGN(sizeof(unsigned short) * sz->nacnodes);
+    }
+
+    // a literal is compiled from the tree
+    size += RE_ALIGN(sizeof(struct ReAst) * sz->nast) +
+            RE_ALIGN(sz->nstr);
+    if (sz->nlit > 0)
+        return size;
+
+    size += RE_ALIGN(sizeof(struct ReAst*) * 2 * sz->nast);
+
+    if (sz->nstates > 0) {
+        size += RE_ALIGN(sizeof(struct Group) * sz->nstates) +
+                RE_ALIGN(sizeof(struct OutList) * sz->nstates);
+    }
+    if (sz->npos > 0) {
+        size += RE_ALIGN(sizeof(struct ReGlushkovSet) * sz->npos) +
+                RE_ALIGN(setsiz * 2 * sz->npos);
+    }
+    return size;
+}
+
+size_t re_compile_size(const char *expr)
+{
+    return re_compile_size_flags(expr, RE_FLAG_NONE);
+}
+
+size_t re_compile_size_flags(const char *expr, int flags)
+{
+    /* Exact amount of bytes a compiled expr keeps: the Regex struct, the automaton and
+     * the match lists. Compiling it takes re_scratch_size() bytes more */
+    struct ReSizes sz;
+    if (re_sizes_from_expr(&sz, expr, flags) == NULL)
+        return 0;
+    return RE_ALIGN(sizeof(struct Regex)) + re_sizes_resident(&sz);
+}
+
+size_t re_scratch_size(const char *expr)
+{
+    return re_scratch_size_flags(expr, RE_FLAG_NONE);
+}
+
+size_t re_scratch_size_flags(const char *expr, int flags)
+{
+    /* Bytes the tokens, syntax tree and the other pools of the compiler take while expr
+     * is compiled. They are free again when it is done */
+    struct ReSizes sz;
+    if (re_sizes_from_expr(&sz, expr, flags) == NULL)
+        return 0;
+    return re_sizes_scratch(&sz);
+}
+
+struct Regex* re_init(struct Regex *re, const char *expr)
+{
+    return re_init_alloc(re, expr, RE_FLAG_NONE, NULL);
+}
+
+struct Regex* re_init_flags(struct Regex *re, const char *expr, int flags)
+{
+    return re_init_alloc(re, expr, flags, NULL);
+}
+
+struct Regex* re_init_alloc(struct Regex *re, const char *expr, int flags, const struct ReAllocator *alloc)
+{
+    /* Initialize regex in a buffer that is sized to fit the compiled expression.
+     * Buffer is taken from alloc, or from malloc() when alloc is NULL, the compiler
+     * gets a second one that is given back when done.
+     * Buffer should be freed with re_free() */
+    struct ReSizes sz;
+    struct ReArena a, t;
+    if (re_sizes_from_expr(&sz, expr, flags) == NULL)
+        return NULL;
+
+    if (alloc == NULL)
+        alloc = &re_std_allocator;
+
+    size_t size = re_sizes_resident(&sz);
+    size_t scratch = re_sizes_scratch(&sz);
+    void *buf = alloc->alloc(size, alloc->ctx);
+    void *tmp = alloc->alloc(scratch, alloc->ctx);
+    if (buf == NULL || tmp == NULL) {
+        ERROR("Failed to allocate %ld bytes\n", size + scratch);
+        if (buf != NULL)
+            alloc->free(buf, alloc->ctx);
+        if (tmp != NULL)
+            alloc->free(tmp, alloc->ctx);
+        return NULL;
+    }
+    re_arena_init(&a, buf, size);
+    re_arena_init(&t, tmp, scratch);
+
+    re = re_init_pools(re, &a, &t, expr, flags, &sz);
+    alloc->free(tmp, alloc->ctx);
+    if (re == NULL) {
+        alloc->free(buf, alloc->ctx);
+        return NULL;
+    }
+    re->is_owner = 1;
+    re->alloc = *alloc;
+    re_plan(re);
+    return re;
+}
+
+struct Regex* re_init_in(void *buf, size_t size, const char *expr)
+{
+    return re_init_in_flags(buf, size, expr, RE_FLAG_NONE);
+}
+
+struct Regex* re_init_in_flags(void *buf, size_t size, const char *expr, int flags)
+{
+    /* Compile expression into caller memory, nothing is allocated on the heap.
+     * Buffer must be aligned to RE_ARENA_ALIGN and at least re_compile_size() +
+     * re_scratch_size() bytes. The Regex struct is placed at the start of buf and the
+     * compiled expression keeps re_compile_size() bytes, the rest is free again. */
+    struct ReArena a;
+    struct Regex *re;
+
+    if ((size_t)buf % RE_ARENA_ALIGN) {
+        ERROR("Buffer is not aligned to %ld bytes\n", RE_ARENA_ALIGN);
+        return NULL;
+    }
+
+    re_arena_init(&a, buf, size);
+    if ((re = re_arena_alloc(&a, sizeof(struct Regex))) == NULL)
+        return NULL;
+
+    return re_init_arena(re, &a, expr, flags);
+}
+
+void re_set_allocator(struct Regex *re, const struct ReAllocator *alloc)
+{
+    /* Set allocator for dynamic engines, NULL disables them.
+     * Not allowed when the arena buffer was allocated by re_init_alloc() */
+    if (re->is_owner) {
+        ERROR("Regex owns its buffer, allocator can not be changed\n");
+        return;
+    }
+    if (alloc == NULL)
+        memset(&re->alloc, 0, sizeof(struct ReAllocator));
+    else
+        re->alloc = *alloc;
+    re_plan(re);
+}
+
+void re_set_dfa_budget(struct Regex *re, size_t size)
+{
+    /* Set the bytes the lazy DFA may take from the allocator, 0 disables it and the
+     * shuffle DFA. A DFA that was made already is dropped, it is made again with the new
+     * size when needed */
+    if (re->dfa != NULL && re->alloc.free != NULL)
+        re->alloc.free(re->dfa, re->alloc.ctx);
+    if (re->shuf != NULL && re->alloc.free != NULL)
+        re->alloc.free(re->shuf, re->alloc.ctx);
+    re->dfa = NULL;
+    re->no_dfa = 0;
+    re->shuf = NULL;
+    re->no_shuf = 0;
+    re->dfa_budget = size;
+    re_plan(re);
+}
+
+void re_set_backtrack_limit(struct Regex *re, size_t max)
+{
+    /* Set the largest states x (input length + 1) the backtracker takes, 0 disables it.
+     * It takes about 4 bytes per unit from the allocator, 8 with RE_CAPTURE */
+    if (re->bt != NULL && re->alloc.free != NULL)
+        re->alloc.free(re->bt, re->alloc.ctx);
+    re->bt = NULL;
+    re->no_bt = 0;
+    re->bt_limit = max;
+    re_plan(re);
+}
+
+void re_free(struct Regex *re)
+{
+    if (re->dfa != NULL && re->alloc.free != NULL)
+        re->alloc.free(re->dfa, re->alloc.ctx);
+    if (re->shuf != NULL && re->alloc.free != NULL)
+        re->alloc.free(re->shuf, re->alloc.ctx);
+    if (re->bt != NULL && re->alloc.free != NULL)
+        re->alloc.free(re->bt, re->alloc.ctx);
+    if (re->is_owner && re->alloc.free != NULL)
+        re->alloc.free(re->arena.buf, re->alloc.ctx);
+    memset(re, 0, sizeof(struct Regex));
+}
+
+struct Regex* re_init_arena(struct Regex *re, struct ReArena *a, const char *expr, int flags)
+{
+    /* Initialize main struct with memory from a. The compiled expression is taken from
+     * the bottom of the free part of a and the pools of the compiler from its top, only
+     * the compiled expression is kept when done */
+    struct ReSizes sz;
+    struct ReArena t;
+    if (re_sizes_from_expr(&sz, expr, flags) == NULL)
+        return NULL;
+
+    size_t size = a->size;
+    size_t scratch = re_sizes_scratch(&sz);
+    size_t top = ((size_t)(a->buf + size) & ~(RE_ARENA_ALIGN - 1)) - (size_t)a->buf;
+    if (top < scratch || top - scratch < a->used) {
+        ERROR("Arena full: %ld/%ld, compiler needs=%ld\n", a->used, a->size, scratch);
+        return NULL;
+    }
+    re_arena_init(&t, a->buf + top - scratch, scratch);
+
+    a->size = top - scratch;
+    re = re_init_pools(re, a, &t, expr, flags, &sz);
+    a->size = size;
+    return re;
+}
+
+static struct Regex* re_init_pools(struct Regex *re, struct ReArena *a, struct ReArena *t, const char *expr, int flags, struct ReSizes *sz)
+{
+    /* Compile expression, a gets the pools of the compiled expression and t the ones that
+     * are only used while compiling.
+     * Get the pools sized by the dry run over the expression from the arenas
+     * Parse the expression into a syntax tree, classes are parsed on the way
+     * Simplify the tree and merge runs of chars into strings
+     * Flatten the tree to postfix and compile it into NFA or position automaton
+     * Alternations of strings skip the parser and go straight to Aho-Corasick
+     * A single string is found with a substring search, it only needs the tree for info
+     * ...
+     * PROFIT! */
+
+    struct TokenList tl;
+    struct ReAstPool ap;
+    struct ReParser ps;
+    struct ReAst *ast;
+    struct ReAst **postfix;
+    int npostfix = 0;
+
+    memset(re, 0, sizeof(struct Regex));
+    memset(&ap, 0, sizeof(struct ReAstPool));
+    re->dfa_budget = RE_DFA_CACHE_SIZE;
+    re->bt_limit = RE_BACKTRACK_MAX;
+    if ((flags & RE_CAPTURE) && (flags & RE_GLUSHKOV)) {
+        ERROR("RE_CAPTURE needs the NFA, it can't be used with RE_GLUSHKOV\n");
+        return NULL;
+    }
+    re->flags = flags;
+
+    if (*expr == '\0') {
+        ERROR("Empty expression\n");
+        return NULL;
+    }
+
+    // Persistent pools, classes are referenced by states and positions
+    if ((ap.classes = re_arena_alloc(a, sizeof(struct ReClass) * sz->nclass)) == NULL)
+        return NULL;
+    ap.maxcls = sz->nclass;
+
+    if (sz->nstates > 0) {
+        re->spool = re_arena_alloc(a, sizeof(struct ReState) * sz->nstates);
+        re->l0.states = re_arena_alloc(a, sizeof(struct ReState*) * sz->nthreads);
+        re->l1.states = re_arena_alloc(a, sizeof(struct ReState*) * sz->nthreads);
+        re->l0.starts = re_arena_alloc(a, sizeof(unsigned int) * sz->nthreads);
+        re->l1.starts = re_arena_alloc(a, sizeof(unsigned int) * sz->nthreads);
+        if (re->spool == NULL || re->l0.states == NULL || re->l1.states == NULL ||
+            re->l0.starts == NULL || re->l1.starts == NULL)
+            return NULL;
+        re->spoolmax = sz->nstates;
+    }
+    if (sz->ncaps > 0) {
+        re->l0.caps = re_arena_alloc(a, sizeof(int) * sz->nthreads * sz->ncaps);
+        re->l1.caps = re_arena_alloc(a, sizeof(int) * sz->nthreads * sz->ncaps);
+        re->caps = re_arena_alloc(a, sizeof(int) * sz->ncaps);
+        if (re->l0.caps == NULL || re->l1.caps == NULL || re->caps == NULL)
+            return NULL;
+    }
+    if (sz->ncounters > 0) {
+        re->counters = re_arena_alloc(a, sizeof(struct ReCounter) * sz->ncounters);
+        re->rings = re_arena_alloc(a, sizeof(struct ReCount) * sz->nrings);
+        if (re->counters == NULL || re->rings == NULL)
+            return NULL;
+        re->maxcounters = sz->ncounters;
+        re->maxrings = sz->nrings;
+    }
+    if (sz->npos > 0) {
+        if ((re->glushkov = re_glushkov_init(a, sz->npos)) == NULL)
+            return NULL;
+    }
+    if (sz->nacnodes > 0) {
+        if ((re->ac = re_ac_init(a, sz->nacnodes, sz->naccls)) == NULL)
+            return NULL;
+    }
+    if (sz->nlit > 0) {
+        if ((re->lit = re_lit_init(a, sz->nlit)) == NULL)
+            return NULL;
+    }
+
+    // Temporary pools
+    if (re_tokenlist_init(&tl, t, sz->nlist, sz->ntokens) == NULL)
+        return NULL;
+
+    if (re->ac != NULL) {
+        if (re_tokenlist_from_str(expr, &tl, flags) == NULL)
+            return NULL;
+        if (re_ac_compile(re->ac, t, &tl, sz->nacnodes, flags) == NULL)
+            return NULL;
+        re_ac_info(&tl, &re->info, flags);
+        re->info.can_be_empty = re->info.minlen == 0;
+
+#ifdef DO_DEBUG
+        DEBUG("AHO-CORASICK:\n");
+        re_ac_debug(re->ac);
+#endif
+
+        re->arena = *a;
+        re->arena.size = a->used;
+        re_plan(re);
+        return re;
+    }
+
+    ap.nodes = re_arena_alloc(t, sizeof(struct ReAst) * sz->nast);
+    ap.str = re_arena_alloc(t, sz->nstr);
+    if (ap.nodes == NULL || ap.str == NULL)
+        return NULL;
+    ap.max = sz->nast;
+    ap.maxstr = sz->nstr;
+    ap.is_ordered = (flags & RE_CAPTURE) != 0;
+
+    if ((ast = re_parse(&ps, expr, &ap, &tl, flags)) == NULL)
+        return NULL;
+    if (flags & RE_CAPTURE)
+        re->ngroups = ps.ngroups;
+
+#ifdef DO_DEBUG
+    DEBUG("AST:\n");
+    re_ast_debug(ast, 0);
+#endif
+
+    ast = re_ast_simplify(&ap, ast);
+    ast = re_ast_merge_string(&ap, ast);
+
+    // before the tree is reversed
+    struct ReAstInfo info;
+    re_ast_info(ast, &info);
+    re->info = info.info;
+    re->info.can_be_empty = re->info.minlen == 0;
+
+#ifdef DO_DEBUG
+    DEBUG("SIMPLIFIED AST:\n");
+    re_ast_debug(ast, 0);
+#endif
+
+    // one string needs no automaton
+    if (re->lit != NULL) {
+        if (re_lit_compile(re->lit, ast) == NULL)
+            return NULL;
+        DEBUG("LITERAL: len=%d ms=%d period=%d\n", re->lit->len, re->lit->ms, re->lit->period);
+
+        re->arena = *a;
+        re->arena.size = a->used;
+        re_plan(re);
+        return re;
+    }
+
+    if ((postfix = re_arena_alloc(t, sizeof(struct ReAst*) * 2 * sz->nast)) == NULL)
+        return NULL;
+    if (re_ast_to_postfix(ast, postfix, &npostfix, 2 * sz->nast) < 0)
+        return NULL;
+
+    if (flags & RE_GLUSHKOV) {
+        if (re_glushkov_compile(re->glushkov, t, postfix, npostfix, sz->npos) == NULL)
+            return NULL;
+
+#ifdef DO_DEBUG
+        DEBUG("GLUSHKOV:\n");
+        re_glushkov_debug(re->glushkov);
+#endif
+    }
+    else {
+        // scratch of the compiler is given back so the reversed NFA can use it
+        size_t cmark = t->used;
+        if ((re->start = re_compile(re, t, postfix, npostfix)) == NULL)
+            return NULL;
+        t->used = cmark;
+
+#ifdef DO_DEBUG
+        DEBUG("NFA:\n");
+        re->listid++;
+        re_state_debug(re, re->start, 0);
+#endif
+
+        // Expressions that only match at the end of the input are matched backwards
+        // from there, unless they are anchored at the start as well.
+        // Captures, and the DFA for matches of bounded length, need the reversed NFA to
+        // find where a match starts.
+        int is_rev = re_ast_is_eol_anchored(ast) && re->start->type != STATE_TYPE_BOL;
+        int is_dfa = re->ncounters == 0 && re->info.maxlen >= 0;
+        if ((is_rev || is_dfa || (flags & RE_CAPTURE)) &&
+            re->spoolmax >= 2 * re->spooln && re->maxcounters >= 2 * re->ncounters && re->maxrings >= 2 * re->nrings) {
+            re_ast_reverse(ast);
+            npostfix = 0;
+            if (re_ast_to_postfix(ast, postfix, &npostfix, 2 * sz->nast) < 0)
+                return NULL;
+            if ((re->rev = re_compile(re, t, postfix, npostfix)) == NULL)
+                return NULL;
+            if (is_rev)
+                re->rstart = re->rev;
+
+#ifdef DO_DEBUG
+            DEBUG("REVERSED NFA:\n");
+            re->listid++;
+            re_state_debug(re, re->rev, 0);
+#endif
+        }
+    }
+
+    // From here on the regex owns what it took from a, t is given back by the caller
+    re->arena = *a;
+    re->arena.size = a->used;
+    re_plan(re);
+    return re;
+}
+
+static struct ReState* re_compile(struct Regex *re, struct ReArena *a, struct ReAst **nodes, int nnodes)
+{
+    /* Create NFA from pattern */
+
+    // Groups are chained states
+    // The group can be treated as a black box with one start point
+    // and many out points.
+    // This is how we can split states.
+    // The out points need to be connected to a start point
+    // of the next group
+    // This will create a tree structure
+    //
+    // Groups are pushed onto the stack. We wait for a meta char
+    // and then decide how the group should be treated
+    // When done, the group is pushed back to the stack
+
+    // A leaf pushes a group onto the stack
+    // An operator pops one or two groups from the stack
+    // Only nodes that create a state push a group or use an outlist.
+    struct Group *stack = re_arena_alloc(a, sizeof(struct Group) * re->spoolmax);
+    struct OutList *lpool = re_arena_alloc(a, sizeof(struct OutList) * re->spoolmax);
+    if (stack == NULL || lpool == NULL)
+        return NULL;
+
+    struct Group *stackp = stack;
+    struct Group g, g0, g1; // the paths groups take from stack
+
+    struct ReState *s;
+    struct OutList *outlistp = lpool;
+    struct OutList *l = NULL;
+
+    #define PUSH(S) *stackp++ = S
+    #define POP()   *--stackp
+    #define GET_OL() outlistp++
+
+    // Operators need one or two groups on the stack
+    #define NEED(N) if (stackp - stack < N) { ERROR("Malformed expression, missing operand for: %s\n", ast_type_table[(*n)->type]); return NULL; }
+
+    struct ReAst **n = nodes;
+    for (int i=0 ; i<nnodes ; i++, n++) {
+
+        switch ((*n)->type) {
+            case RE_AST_CAT:
+            case RE_AST_ALT:
+                NEED(2);
+                break;
+            case RE_AST_QUESTION:
+            case RE_AST_STAR:
+            case RE_AST_PLUS:
+            case RE_AST_GROUP:
+                NEED(1);
+                break;
+            case RE_AST_REPEAT:
+                if (re_ast_is_utf8_repeat(*n))
+                    NEED(1);
+                break;
+            default:
+                break;
+        }
+
+        switch ((*n)->type) {
+            case RE_AST_CAT:       // concat
+                g1 = POP();
+                g0 = POP();
+                group_patch_outlist(&g0, &g1.start);
+                g = group_init(g0.start, g1.out);
+                PUSH(g);
+                break;
+            case RE_AST_QUESTION:       // zero or one
+                g = POP();
+                if ((s = re_state_init(re, STATE_TYPE_SPLIT, g.start, NULL)) == NULL)
+                    return NULL;
+                l = ol_init(GET_OL(), &s->out1);
+                l = outlist_join(g.out, l);
+                g = group_init(s, l);
+                PUSH(g);
+                break;
+            case RE_AST_ALT:       // alternate
+                g1 = POP();
+                g0 = POP();
+                if ((s = re_state_init(re, STATE_TYPE_SPLIT, g0.start, g1.start)) == NULL)
+                    return NULL;
+                l = outlist_join(g0.out, g1.out);
+                PUSH(group_init(s, l));
+
+                break;
+            case RE_AST_STAR:       // zero or more
+                g = POP();
+                if ((s = re_state_init(re, STATE_TYPE_SPLIT, g.start, NULL)) == NULL)
+                    return NULL;
+                group_patch_outlist(&g, &s);
+                l = ol_init(GET_OL(), &s->out1);
+                PUSH(group_init(s, l));
+                break;
+            case RE_AST_PLUS:       // one or more
+                g = POP();
+                if ((s = re_state_init(re, STATE_TYPE_SPLIT, g.start, NULL)) == NULL)
+                    return NULL;
+                group_patch_outlist(&g, &s);
+                l = ol_init(GET_OL(), &s->out1);
+                PUSH(group_init(g.start, l));
+                break;
+            case RE_AST_REPEAT:     // counting state, loops on itself without a split
+                if (re_ast_is_utf8_repeat(*n)) {
+                    // the sequences end in a state that counts the char and loops back
+                    g = POP();
+                    if ((s = re_state_init(re, STATE_TYPE_UTF8_COUNT, NULL, g.start)) == NULL)
+                        return NULL;
+                    if ((s->cnt = re_counter_init(re, (*n)->min, (*n)->max)) == NULL)
+                        return NULL;
+                    struct ReState *next = re_state_init(re, STATE_TYPE_UTF8_NEXT, NULL, s);
+                    if (next == NULL)
+                        return NULL;
+                    group_patch_outlist(&g, &next);
+                    l = ol_init(GET_OL(), &s->out);
+                    PUSH(group_init(s, l));
+                    break;
+                }
+                if ((s = re_state_init(re, STATE_TYPE_COUNT, NULL, NULL)) == NULL)
+                    return NULL;
+                re_state_set_ast(s, (*n)->child);
+                s->type = STATE_TYPE_COUNT;
+                if ((s->cnt = re_counter_init(re, (*n)->min, (*n)->max)) == NULL)
+                    return NULL;
+                l = ol_init(GET_OL(), &s->out);
+                PUSH(group_init(s, l));
+                break;
+            case RE_AST_GROUP:      // save states around the group keep where it starts and ends
+                g = POP();
+                if ((s = re_state_init(re, STATE_TYPE_SAVE, NULL, NULL)) == NULL)
+                    return NULL;
+                s->slot = 2 * ((*n)->group - 1) + 1;
+                group_patch_outlist(&g, &s);
+                l = ol_init(GET_OL(), &s->out);
+                if ((s = re_state_init(re, STATE_TYPE_SAVE, g.start, NULL)) == NULL)
+                    return NULL;
+                s->slot = 2 * ((*n)->group - 1);
+                PUSH(group_init(s, l));
+                break;
+            case RE_AST_STRING:     // chain of states, one for every char
+                s = NULL;
+                for (int j=(*n)->len-1 ; j>=0 ; j--) {
+                    if ((s = re_state_init(re, STATE_TYPE_NONE, s, NULL)) == NULL)
+                        return NULL;
+                    s->c = (*n)->str[j];
+                    if (j == (*n)->len-1)
+                        l = ol_init(GET_OL(), &s->out);
+                }
+                PUSH(group_init(s, l));
+                break;
+            default:        // it is a char, class or anchor
+                if ((s = re_state_init(re, STATE_TYPE_NONE, NULL, NULL)) == NULL)
+                    return NULL;
+                re_state_set_ast(s, *n);
+                l = ol_init(GET_OL(), &s->out);
+                g = group_init(s, l);
+                PUSH(g);
+                break;
+        }
+    }
+    if (stackp - stack != 1) {
+        ERROR("Malformed expression, %ld groups left on stack\n", stackp - stack);
+        return NULL;
+    }
+    g = POP();
+
+    // connect last state that indicates a succesfull match
+    struct ReState *match_state = re_state_init(re, STATE_TYPE_MATCH, NULL, NULL);
+    if (match_state == NULL)
+        return NULL;
+
+    group_patch_outlist(&g, &match_state);
+
+    //re_state_debug(g.start, 0);
+    return g.start;
+
+    #undef POP
+    #undef PUSH
+    #undef GET_OL
+    #undef NEED
+}
+
+void re_match_debug(struct ReMatch *m)
+{
+    if (m->state >= 0) {
+        DEBUG("RESULT: %s\n", m->result);
+        DEBUG("START:  %d\n", m->istart);
+        DEBUG("END:    %d\n", m->iend);
+        DEBUG("ENDP:   %s\n", m->endp);
+    }
+    else {
+        DEBUG("Parsing failed\n");
+    }
+}
+
+static void re_stats_add(struct Regex *re, unsigned long nbytes, unsigned long nstates, unsigned long peak)
+{
+    re->stats.bytes += nbytes;
+    re->stats.states += nstates;
+    if (peak > re->stats.peak)
+        re->stats.peak = peak;
+}
+
+struct ReInfo re_info(struct Regex *re)
+{
+    /* Facts that hold for every match, see struct ReInfo */
+    return re->info;
+}
+
+struct ReStats re_stats(struct Regex *re)
+{
+    /* Counters of a Regex compiled with RE_STATS, all zero without it */
+    return re->stats;
+}
+
+void re_stats_reset(struct Regex *re)
+{
+    memset(&re->stats, 0, sizeof(struct ReStats));
+}
+
+#ifdef DO_DEBUG
+static const char* re_dot_label(struct ReState *s, char *buf, size_t size)
+{
+    /* Plain label of state for re_dot(), re_state_to_str() adds terminal colors */
+    char tmp[RE_MAX_TOKEN_STR_REPR];
+
+    switch (s->type) {
+        case STATE_TYPE_MATCH:
+            return "MATCH";
+        case STATE_TYPE_SPLIT:
+            return "";
+        case STATE_TYPE_BOL:
+            return "^";
+        case STATE_TYPE_EOL:
+            return "$";
+        case STATE_TYPE_SAVE:
+            snprintf(buf, size, "save %d", s->slot);
+            return buf;
+        case STATE_TYPE_UTF8_COUNT:
+            snprintf(buf, size, "utf8{%d,%d}", s->cnt->min, s->cnt->max);
+            return buf;
+        case STATE_TYPE_UTF8_NEXT:
+            return "next";
+        default:
+            break;
+    }
+
+    if (s->cls != NULL)
+        re_class_to_str(s->cls, tmp, sizeof(tmp));
+    else if (s->span > 0)
+        snprintf(tmp, sizeof(tmp), "\\x%02x-\\x%02x", (unsigned char)s->c, (unsigned char)s->c + s->span);
+    else if (s->c > ' ' && s->c < 127)
+        snprintf(tmp, sizeof(tmp), "%c", s->c);
+    else
+        snprintf(tmp, sizeof(tmp), "\\x%02x", (unsigned char)s->c);
+
+    if (s->type == STATE_TYPE_COUNT)
+        snprintf(buf, size, "%.40s{%d,%d}", tmp, s->cnt->min, s->cnt->max);
+    else
+        snprintf(buf, size, "%s", tmp);
+    return buf;
+}
 
-        //for (int i=0 ; i<stackp-stack ; i++) {
-        //    DEBUG("GROUP: %d ******************************\n", i);
-        //    re_state_debug(stack[i].start, 0);
-        //}
+static void re_dot_edge(FILE *f, struct Regex *re, struct ReState *s, struct ReState *to, unsigned long maxhits)
+{
+    if (to == NULL)
+        return;
+    fprintf(f, "    s%ld -> s%ld [label=\"%lu\" penwidth=%.1f];\n",
+            (long)(s - re->spool), (long)(to - re->spool), s->hits,
+            1.0 + (maxhits ? 4.0 * s->hits / maxhits : 0.0));
+}
 
-        switch ((*t)->type) {
-            case RE_TOK_TYPE_CONCAT:       // concat
-                g1 = POP();
-                g0 = POP();
-                group_patch_outlist(&g0, &g1.start);
-                g = group_init(g0.start, g1.out);
-                PUSH(g);
+void re_dot(struct Regex *re, FILE *f)
+{
+    /* Write the NFA as a Graphviz digraph. Edges are labelled with the hits of the
+     * state they leave and drawn thicker the more often they were taken. Hits add up
+     * over all matches since the regex was compiled.
+     *   dot -Tsvg out.dot > out.svg */
+    char buf[RE_MAX_TOKEN_STR_REPR];
+    unsigned long maxhits = 0;
+
+    if (re->start == NULL) {
+        ERROR("Regex has no NFA to export\n");
+        return;
+    }
+
+    for (int i=0 ; i<re->spooln ; i++) {
+        if (re->spool[i].hits > maxhits)
+            maxhits = re->spool[i].hits;
+    }
+
+    fprintf(f, "digraph nfa {\n");
+    fprintf(f, "    rankdir=LR;\n");
+    fprintf(f, "    node [shape=circle];\n");
+
+    for (int i=0 ; i<re->spooln ; i++) {
+        struct ReState *s = &re->spool[i];
+
+        fprintf(f, "    s%d [label=\"", i);
+        for (const char *c=re_dot_label(s, buf, sizeof(buf)) ; *c ; c++) {
+            if (*c == '"' || *c == '\\')
+                fputc('\\', f);
+            fputc(*c, f);
+        }
+        fprintf(f, "\"%s];\n", s->type == STATE_TYPE_MATCH ? " shape=doublecircle" :
+                               s->type == STATE_TYPE_SPLIT ? " shape=point" : "");
+
+        re_dot_edge(f, re, s, s->out, maxhits);
+        re_dot_edge(f, re, s, s->out1, maxhits);
+    }
+
+    fprintf(f, "    start [shape=none];\n");
+    fprintf(f, "    start -> s%ld;\n", (long)(re->start - re->spool));
+    if (re->rstart != NULL) {
+        fprintf(f, "    rstart [shape=none];\n");
+        fprintf(f, "    rstart -> s%ld [style=dashed];\n", (long)(re->rstart - re->spool));
+    }
+    fprintf(f, "}\n");
+}
+#endif
+
+#ifdef DO_DEBUG
+static void debug_match_list(struct MatchList *l)
+{
+    struct ReState **s = l->states;
+    for (int i=0 ; i<l->n ; i++, s++) {
+        if ((*s)->type == STATE_TYPE_MATCH) {
+            DEBUG("MATCHLIST: [%d] MATCH\n", i);
+        }
+        else {
+            DEBUG("MATCHLIST: [%d] %s\n", i, re_state_to_str(*s));
+        }
+    }
+    DEBUG("\n");
+}
+#endif
+
+static int re_is_short(struct Regex *re, const char *str)
+{
+    /* Check if string is shorter than the shortest match, only looks at that many chars */
+    for (int i=0 ; i<re->info.minlen ; i++) {
+        if (str[i] == '\0')
+            return 1;
+    }
+    return 0;
+}
+
+static unsigned int re_skip_to_first(struct Regex *re, const char *str, unsigned int i, unsigned int len)
+{
+    /* Find the next char from i on that can start a match, or the end of the string */
+    while (i < len && str[i] != '\0' && !RE_SET_TEST(re->info.first, (unsigned char)str[i]))
+        i++;
+    return i;
+}
+
+static void re_nfa_match(struct Regex *re, const char *str, unsigned int from, unsigned int len, struct ReMatch *m)
+{
+    /* Run NFA state machine on string to find the leftmost longest match.
+     * A new thread is started at every char until a match is found. When threads meet
+     * in a state the one that started leftmost owns it.
+     * The search starts at from, ^ only holds at 0. The input ends at len or '\0' */
+
+    // These pointers are swapped between iterations.
+    // clist holds current states that need to be checked.
+    // nlist (becomes cclist) holds the next states that need to be checked on next iteration
+    // The lists are preallocated in the regex arena and sized to fit all states.
+    struct MatchList *clist = &re->l0;
+    struct MatchList *nlist = &re->l1;
+    struct MatchList *bak;
+
+    struct ReState *start = re->start;
+    int is_anchored = 0;
+    int can_skip = 0;
+    unsigned int i = from;
+
+    // work done, added to re->stats at the end
+    unsigned long nbytes = 0;
+    unsigned long nstates = 0;
+    unsigned long peak = 0;
+    unsigned long skipped = 0;
+
+    // only threads that start at the start of the input can get past ^
+    if (start->type == STATE_TYPE_BOL) {
+        DEBUG("IS ANCHORED AT START\n");
+        is_anchored = 1;
+    }
+
+    // With no thread alive only a char in the first set can start a match
+    if (!is_anchored && re->info.minlen > 0) {
+        can_skip = 1;
+        i = re_skip_to_first(re, str, from, len);
+        skipped += i - from;
+    }
+
+    // counters are left over from the last match
+    re_counters_reset(re);
+
+    re_match_list_init(re, clist, i);
+    re_match_list_append(re, clist, start, i);
+
+    DEBUG("INPUT STRING: %s\n", str);
+
+    for ( ; ; i++) {
+        int is_end = i == len || str[i] == '\0';
+        if (is_end)
+            re_match_list_at_end(re, clist);
+        re_match_list_has_match(re, clist, i, m);
+#ifdef DO_DEBUG
+        debug_match_list(clist);
+#endif
+
+        if (is_end || (clist->n == 0 && (m->state > 0 || is_anchored)))
+            break;
+
+        DEBUG("MATCHING CHAR: '%c'\n", str[i]);
+        re_match_list_init(re, nlist, i+1);
+
+        nbytes++;
+        nstates += clist->n;
+        if ((unsigned long)clist->n > peak)
+            peak = clist->n;
+
+        // Check all paths in clist and check for matches against c.
+        // Add all matches to nlist so we can process them on the next run.
+        re_match_list_has_token(re, clist, nlist, str[i]);
+
+        // Only threads that start left of a found match can improve it
+        if (m->state < 0 && !is_anchored) {
+            if (can_skip && nlist->n == 0) {
+                unsigned int next = re_skip_to_first(re, str, i+1, len);
+                skipped += next - (i+1);
+                i = next - 1;
+                re_match_list_init(re, nlist, i+1);
+            }
+            // with RE_UTF8 no match starts inside a char
+            if (!(re->flags & RE_UTF8) || i+1 == len || !RE_UTF8_IS_CONT(str[i+1]))
+                re_match_list_append(re, nlist, start, i+1);
+        }
+
+        // switch lists
+        bak = clist;
+        clist = nlist;
+        nlist = bak;
+    }
+
+    if (re->flags & RE_STATS) {
+        re_stats_add(re, nbytes, nstates, peak);
+        re->stats.prefilter_skips += skipped;
+    }
+}
+
+static void re_nfa_match_rev(struct Regex *re, const char *str, unsigned int from, unsigned int len, struct ReMatch *m)
+{
+    /* Every match of an expression that ends with $ ends at the end of the input, len.
+     * Run the reversed NFA backwards from there, one thread is enough. The longest match
+     * it finds is the leftmost one. Only the part of the input that can be in a match is
+     * looked at, the rest is only scanned for its end. Matches start at from or later,
+     * ^ only holds at 0 */
+    struct MatchList *clist = &re->l0;
+    struct MatchList *nlist = &re->l1;
+    struct MatchList *bak;
+    struct ReMatch rm;
+    unsigned long nstates = 0;
+    unsigned long peak = 0;
+    unsigned int i;
+
+    rm.state = -1;
+    re_counters_reset(re);
+
+    // positions in the lists count from the end of the input
+    re_match_list_init(re, clist, 0);
+    re_match_list_append(re, clist, re->rstart, 0);
+
+    for (i=0 ; ; i++) {
+        if (i == len && from == 0)
+            re_match_list_at_end(re, clist);
+        re_match_list_has_match(re, clist, i, &rm);
+
+        if (i == len - from || clist->n == 0)
+            break;
+
+        nstates += clist->n;
+        if ((unsigned long)clist->n > peak)
+            peak = clist->n;
+
+        re_match_list_init(re, nlist, i+1);
+        re_match_list_has_token(re, clist, nlist, str[len-1-i]);
+
+        bak = clist;
+        clist = nlist;
+        nlist = bak;
+    }
+
+    // the scan for the end of the input counts as well
+    if (re->flags & RE_STATS)
+        re_stats_add(re, len + i, nstates, peak);
+
+    if (rm.state > 0) {
+        m->istart = len - rm.iend;
+        m->iend = len;
+        m->state = 1;
+    }
+}
+
+///// BACKTRACK //////////////////////////////////////////////////
+
+// Stack entry that puts a capture slot back, the old value + 1 is the entry below it
+#define RE_BT_RESTORE 0x80000000u
+
+static struct ReBacktrack* re_bt_init(struct Regex *re)
+{
+    /* Take the visited bitmap and the stack from the allocator of the regex. A visit
+     * pushes one pair at most, or a capture slot that takes two entries.
+     * Returns NULL when there is no allocator or the NFA has counting states, their
+     * threads aren't told apart by (state, position) */
+    struct ReArena a;
+    size_t limit = re->bt_limit;
+    size_t nstack = (re->flags & RE_CAPTURE) ? 2 * limit : limit;
+
+    if (re->start == NULL || re->ncounters > 0 || re->alloc.alloc == NULL || limit == 0 || limit >= RE_BT_RESTORE)
+        return NULL;
+
+    size_t size = RE_ALIGN(sizeof(struct ReBacktrack)) +
+                  RE_ALIGN(sizeof(unsigned int) * (limit / RE_SET_BITS + 1)) +
+                  RE_ALIGN(sizeof(unsigned int) * nstack);
+    void *buf = re->alloc.alloc(size, re->alloc.ctx);
+    if (buf == NULL) {
+        ERROR("Failed to allocate %ld bytes for backtracker\n", size);
+        return NULL;
+    }
+    re_arena_init(&a, buf, size);
+
+    struct ReBacktrack *bt = re_arena_alloc(&a, sizeof(struct ReBacktrack));
+    bt->visited = re_arena_alloc(&a, sizeof(unsigned int) * (limit / RE_SET_BITS + 1));
+    bt->stack = re_arena_alloc(&a, sizeof(unsigned int) * nstack);
+    bt->limit = limit;
+    return bt;
+}
+
+static struct ReBacktrack* re_bt_get(struct Regex *re, unsigned int width)
+{
+    /* Backtracker of regex when width positions fit in its bitmap, it is made on first use.
+     * The bits that are needed are cleared. Returns NULL when they don't fit or there is
+     * no backtracker */
+    if (re->bt == NULL && !re->no_bt) {
+        re->bt = re_bt_init(re);
+        re->no_bt = re->bt == NULL;
+    }
+    if (re->bt == NULL || (size_t)re->spooln * width > re->bt->limit)
+        return NULL;
+
+    memset(re->bt->visited, 0, sizeof(unsigned int) * (re->spooln * width / RE_SET_BITS + 1));
+    return re->bt;
+}
+
+static int re_bt_run(struct Regex *re, struct ReBacktrack *bt, const char *str, unsigned int start,
+                     unsigned int base, unsigned int width, unsigned int len, int *caps)
+{
+    /* Walk the NFA depth first from start. Positions run from base to base + width - 1,
+     * no char is taken past that, and the input ends at len. A (state, position) pair is
+     * visited once: the matches that can be reached from it don't depend on how it was
+     * reached, so the walk is at most states x width steps.
+     * Without caps every path is walked, returns the end of the longest match from start.
+     * With caps the first out of a state is walked first, the same priority the Pike VM
+     * gives threads. The walk stops at the first path that gets to the match state at the
+     * last position, caps has its slots then. Returns the end of the match.
+     * Returns -1 when there is none */
+    unsigned int *stack = bt->stack;
+    unsigned int top = 0;
+    unsigned int last = base + width - 1;
+    int best = -1;
+    int is_done = 0;
+
+    // work done, added to re->stats at the end
+    unsigned long nbytes = 0;
+    unsigned long nstates = 0;
+    unsigned long peak = 0;
+
+    stack[top++] = (re->start - re->spool) * width + (start - base);
+
+    while (top > 0 && !is_done) {
+        unsigned int k = stack[--top];
+
+        if (k & RE_BT_RESTORE) {
+            caps[k & ~RE_BT_RESTORE] = (int)stack[--top] - 1;
+            continue;
+        }
+
+        struct ReState *s = &re->spool[k / width];
+        unsigned int pos = base + k % width;
+
+        // take the first out of every state, the second one waits on the stack
+        while (s != NULL && !RE_SET_TEST(bt->visited, k)) {
+            struct ReState *next = NULL;
+
+            RE_SET_ADD(bt->visited, k);
+            nstates++;
+
+            switch (s->type) {
+                case STATE_TYPE_NONE:
+                    if (pos < last && re_state_match_chr(s, str[pos])) {
+                        RE_HIT(s);
+                        nbytes++;
+                        pos++;
+                        if (s->out1 != NULL)
+                            stack[top++] = (s->out1 - re->spool) * width + (pos - base);
+                        next = s->out;
+                    }
+                    break;
+                case STATE_TYPE_SPLIT:
+                    if (s->out1 != NULL)
+                        stack[top++] = (s->out1 - re->spool) * width + (pos - base);
+                    next = s->out;
+                    break;
+                case STATE_TYPE_BOL:
+                    if (pos == 0)
+                        next = s->out;
+                    break;
+                case STATE_TYPE_EOL:
+                    if (pos == len)
+                        next = s->out;
+                    break;
+                case STATE_TYPE_SAVE:
+                    if (caps != NULL) {
+                        stack[top++] = caps[s->slot] + 1;
+                        stack[top++] = RE_BT_RESTORE | s->slot;
+                        caps[s->slot] = pos;
+                    }
+                    next = s->out;
+                    break;
+                case STATE_TYPE_MATCH:
+                    if (caps == NULL && (int)pos > best)
+                        best = pos;
+                    is_done = caps != NULL && pos == last;
+                    break;
+                default:
+                    break;
+            }
+
+            if (top > peak)
+                peak = top;
+            s = is_done ? NULL : next;
+            if (s != NULL)
+                k = (s - re->spool) * width + (pos - base);
+        }
+    }
+
+    if (re->flags & RE_STATS)
+        re_stats_add(re, nbytes, nstates, peak);
+
+    if (caps != NULL)
+        return is_done ? (int)last : -1;
+    return best;
+}
+
+static int re_bt_match(struct Regex *re, const char *str, unsigned int from, unsigned int len, struct ReMatch *m)
+{
+    /* Find the leftmost longest match that starts at from or later with the backtracker.
+     * Pairs that were visited from a start that didn't match can't lead to a match from
+     * the next start either, the bitmap is kept for all of them.
+     * The input ends at len or '\0', ^ only holds at 0.
+     * Returns 0 when the input doesn't fit, 1 when it was searched */
+    struct ReBacktrack *bt;
+    unsigned long skipped = 0;
+
+    if (re->start == NULL || re->bt_limit == 0 || from > len)
+        return 0;
+
+    // only look as far as the longest input that fits, width is one more than its length
+    size_t maxw = re->bt_limit / re->spooln;
+    size_t n = strnlen(str + from, (len - from < maxw) ? len - from : maxw);
+    if (n == maxw || (bt = re_bt_get(re, n + 1)) == NULL)
+        return 0;
+    n += from;
+
+    int is_anchored = re->start->type == STATE_TYPE_BOL;
+    int can_skip = !is_anchored && re->info.minlen > 0;
+
+    for (unsigned int i=from ; i<=n && !(is_anchored && i > 0) ; i++) {
+        if (can_skip) {
+            unsigned int next = re_skip_to_first(re, str, i, n);
+            skipped += next - i;
+            if ((i = next) == n)
                 break;
-            case RE_TOK_TYPE_QUESTION:       // zero or one
-                g = POP();
-                s = re_state_init(re, *t, STATE_TYPE_SPLIT, g.start, NULL);
-                l = ol_init(GET_OL(), &s->out1);
-                l = outlist_join(g.out, l);
-                g = group_init(s, l);
-                PUSH(g);
+        }
+        int end = re_bt_run(re, bt, str, i, from, n - from + 1, n, NULL);
+        if (end >= 0) {
+            m->istart = i;
+            m->iend = end;
+            m->state = 1;
+            break;
+        }
+    }
+
+    if (re->flags & RE_STATS)
+        re->stats.prefilter_skips += skipped;
+    return 1;
+}
+
+static int re_bt_captures(struct Regex *re, const char *str, unsigned int len, struct ReCapture *m)
+{
+    /* Place the groups of the match m like re_pike_match() with the backtracker.
+     * Result is left in re->caps. Returns 1 on match, 0 otherwise, -1 when the match
+     * doesn't fit */
+    struct ReBacktrack *bt;
+    unsigned int width = m->iend - m->istart + 1;
+
+    if (re->plan.find != RE_ENGINE_BACKTRACK && re->plan.find_short != RE_ENGINE_BACKTRACK)
+        return -1;
+    if ((bt = re_bt_get(re, width)) == NULL)
+        return -1;
+
+    for (int i=0 ; i<2*re->ngroups ; i++)
+        re->caps[i] = -1;
+    return re_bt_run(re, bt, str, m->istart, m->istart, width, len, re->caps) >= 0;
+}
+
+///// PLANNER ////////////////////////////////////////////////////
+
+static const char *engine_table[] = {
+    "auto", "nfa", "nfa-reverse", "backtrack", "dfa", "shuffle", "glushkov", "aho-corasick", "literal",
+};
+
+const char* re_engine_name(enum ReEngine engine)
+{
+    if ((unsigned int)engine >= sizeof(engine_table) / sizeof(engine_table[0]))
+        return "unknown";
+    return engine_table[engine];
+}
+
+static int re_dfa_can_init(struct Regex *re)
+{
+    /* Check if the lazy DFA can be tried, same as re_dfa_init() without making it */
+    return re->start != NULL && re->ncounters == 0 && re->alloc.alloc != NULL && re->dfa_budget > 0;
+}
+
+static int re_bt_can_init(struct Regex *re)
+{
+    /* Check if the backtracker can be tried and fits an input of at least one byte */
+    return re->start != NULL && re->ncounters == 0 && re->alloc.alloc != NULL &&
+           re->bt_limit < RE_BT_RESTORE && re->bt_limit / re->spooln >= 2;
+}
+
+static void re_plan(struct Regex *re)
+{
+    /* Pick the engines of regex from the facts of the expression, an engine set with
+     * re_set_engine() wins. The automaton that was compiled decides the find engine,
+     * short inputs that fit the backtracker don't need the NFA lists. Expressions the
+     * DFA can run are found and tested with it, small ones are likely to fit the shuffle
+     * DFA for tests */
+    struct RePlan *p = &re->plan;
+    enum ReEngine force = p->force;
+
+    memset(p, 0, sizeof(struct RePlan));
+    p->force = force;
+
+    if (re->ac != NULL)
+        p->find = RE_ENGINE_AHO_CORASICK;
+    else if (re->lit != NULL)
+        p->find = RE_ENGINE_LITERAL;
+    else if (re->glushkov != NULL)
+        p->find = RE_ENGINE_GLUSHKOV;
+    else if (re->rstart != NULL)
+        p->find = RE_ENGINE_NFA_REVERSE;
+    else if (re_dfa_can_init(re))
+        p->find = RE_ENGINE_DFA;
+    else
+        p->find = RE_ENGINE_NFA;
+
+    if ((p->find == RE_ENGINE_NFA || p->find == RE_ENGINE_DFA) && re_bt_can_init(re)) {
+        p->find_short = RE_ENGINE_BACKTRACK;
+        p->short_len = re->bt_limit / re->spooln - 1;
+    }
+
+    p->test = p->find;
+    if (re_dfa_can_init(re))
+        p->test = (re->spooln <= RE_SHUF_EXPLORE) ? RE_ENGINE_SHUFFLE : RE_ENGINE_DFA;
+
+    switch (force) {
+        case RE_ENGINE_AUTO:
+            break;
+        case RE_ENGINE_SHUFFLE:
+            p->test = force;
+            break;
+        default:
+            p->find = force;
+            p->find_short = RE_ENGINE_AUTO;
+            p->short_len = 0;
+            p->test = force;
+            break;
+    }
+    DEBUG("PLAN: find=%s short=%s/%u test=%s force=%s\n", re_engine_name(p->find), re_engine_name(p->find_short),
+          p->short_len, re_engine_name(p->test), re_engine_name(p->force));
+}
+
+static enum ReEngine re_plan_test(struct Regex *re)
+{
+    /* Test engine of regex, the DFAs are made here on first use. One that can't be made
+     * is replaced in the plan by the next one */
+    if (re->plan.test == RE_ENGINE_SHUFFLE && re_shuf_get(re) == NULL)
+        re->plan.test = RE_ENGINE_DFA;
+    if (re->plan.test == RE_ENGINE_DFA && re_dfa_get(re) == NULL) {
+        if (re->plan.find == RE_ENGINE_DFA)
+            re->plan.find = RE_ENGINE_NFA;
+        re->plan.test = re->plan.find;
+    }
+    return re->plan.test;
+}
+
+static struct ReDfa* re_plan_dfa(struct Regex *re)
+{
+    /* Lazy DFA of regex when the plan tests with a DFA, the shuffle DFA can't find
+     * where a match is or start over at a line. Returns NULL when it isn't used */
+    if (re->plan.test != RE_ENGINE_DFA && re->plan.test != RE_ENGINE_SHUFFLE)
+        return NULL;
+    return re_dfa_get(re);
+}
+
+int re_set_engine(struct Regex *re, enum ReEngine engine)
+{
+    /* Force the engine regex is matched with, for benchmarks. A find engine is used by
+     * every call, a test engine only by the calls that don't need where the match is.
+     * RE_ENGINE_AUTO lets the planner pick again.
+     * Returns 0, or -1 when the engine can't run the compiled expression */
+    int can_run = 0;
+
+    switch (engine) {
+        case RE_ENGINE_AUTO:         can_run = 1; break;
+        case RE_ENGINE_NFA:          can_run = re->start != NULL; break;
+        case RE_ENGINE_NFA_REVERSE:  can_run = re->rstart != NULL; break;
+        case RE_ENGINE_BACKTRACK:    can_run = re_bt_can_init(re); break;
+        case RE_ENGINE_DFA:          can_run = re_dfa_get(re) != NULL; break;
+        case RE_ENGINE_SHUFFLE:      can_run = re_shuf_get(re) != NULL; break;
+        case RE_ENGINE_GLUSHKOV:     can_run = re->glushkov != NULL; break;
+        case RE_ENGINE_AHO_CORASICK: can_run = re->ac != NULL; break;
+        case RE_ENGINE_LITERAL:      can_run = re->lit != NULL; break;
+    }
+    if (!can_run) {
+        ERROR("Engine %s can't run this expression\n", re_engine_name(engine));
+        return -1;
+    }
+    re->plan.force = engine;
+    re_plan(re);
+    return 0;
+}
+
+void re_explain(struct Regex *re, FILE *f)
+{
+    /* Print the facts of regex the planner looks at and the engines it picked */
+    struct RePlan *p = &re->plan;
+    struct ReInfo *info = &re->info;
+    int nfirst = 0;
+
+    for (int c=0 ; c<256 ; c++)
+        nfirst += RE_SET_TEST(info->first, c) != 0;
+
+    if (re->ac != NULL)
+        fprintf(f, "automaton:  aho-corasick, %d nodes\n", re->ac->nnodes);
+    else if (re->lit != NULL)
+        fprintf(f, "automaton:  none, %d byte string%s%s\n", re->lit->len,
+                re->lit->has_head ? ", .* before" : "", re->lit->has_tail ? ", .* after" : "");
+    else if (re->glushkov != NULL)
+        fprintf(f, "automaton:  glushkov, %d positions\n", re->glushkov->npos);
+    else
+        fprintf(f, "automaton:  nfa, %d states, %d counters%s\n", re->spooln, re->ncounters,
+                (re->rev != NULL) ? ", reversed" : "");
+    fprintf(f, "groups:     %d\n", re->ngroups);
+    if (info->maxlen < 0)
+        fprintf(f, "length:     %d or more\n", info->minlen);
+    else
+        fprintf(f, "length:     %d to %d\n", info->minlen, info->maxlen);
+    fprintf(f, "anchors:    %s%s%s\n", info->is_bol ? "^ at start " : "", info->is_eol ? "$ at end" : "",
+            (info->is_bol || info->is_eol) ? "" : (info->has_anchors ? "inside" : "none"));
+    fprintf(f, "prefix:     \"%.*s\", %d first bytes\n", info->nprefix, info->prefix, nfirst);
+
+    fprintf(f, "find:       %s", re_engine_name(p->find));
+    if (p->find == RE_ENGINE_DFA && re->dfa == NULL)
+        fprintf(f, ", made on first use");
+    if (p->find == RE_ENGINE_DFA)
+        fprintf(f, ", nfa %s", (info->maxlen >= 0 && re->rev != NULL) ?
+                "when it can't be made or thrashes" : "finds where a match is after the dfa found one");
+    fprintf(f, "\n");
+    if (p->find_short != RE_ENGINE_AUTO)
+        fprintf(f, "find short: %s, inputs up to %u bytes\n", re_engine_name(p->find_short), p->short_len);
+    fprintf(f, "test:       %s", re_engine_name(p->test));
+    if (p->test == RE_ENGINE_SHUFFLE && re->shuf == NULL)
+        fprintf(f, ", made on first use, dfa when it takes more than %d states", RE_SHUF_STATES);
+    else if (p->test == RE_ENGINE_DFA && re->dfa == NULL)
+        fprintf(f, ", made on first use");
+    if (p->test == RE_ENGINE_SHUFFLE || p->test == RE_ENGINE_DFA)
+        fprintf(f, ", %s when it can't be made", re_engine_name((p->find == RE_ENGINE_DFA) ? RE_ENGINE_NFA : p->find));
+    fprintf(f, "\n");
+    if (p->force != RE_ENGINE_AUTO)
+        fprintf(f, "forced:     %s\n", re_engine_name(p->force));
+}
+
+static void re_match_in(struct Regex *re, const char *str, unsigned int from, unsigned int len, struct ReMatch *m)
+{
+    /* Find leftmost longest match that starts at from or later with the find engine of
+     * regex. The input ends at len or '\0', ^ only holds at 0 */
+    switch (re->plan.find) {
+        case RE_ENGINE_AHO_CORASICK:
+            re_ac_match(re->ac, str, from, len, m, (re->flags & RE_STATS) ? &re->stats : NULL);
+            break;
+        case RE_ENGINE_LITERAL:
+            re_lit_match(re->lit, str, from, len, m, (re->flags & RE_STATS) ? &re->stats : NULL);
+            break;
+        case RE_ENGINE_GLUSHKOV:
+            re_glushkov_match(re, str, from, len, m);
+            break;
+        case RE_ENGINE_NFA_REVERSE:
+            re_nfa_match_rev(re, str, from, strnlen(str, len), m);
+            break;
+        case RE_ENGINE_DFA:
+            // the NFA takes over when the DFA can't be made, its cache thrashes or the
+            // match has no bound on its length
+            if ((re->plan.find_short == RE_ENGINE_BACKTRACK && re_bt_match(re, str, from, len, m)) ||
+                re_dfa_match(re, str, from, len, m))
                 break;
-            case RE_TOK_TYPE_PIPE:       // alternate
-                g1 = POP();
-                g0 = POP();
-                s = re_state_init(re, *t, STATE_TYPE_SPLIT, g0.start, g1.start);
-                l = outlist_join(g0.out, g1.out);
-                PUSH(group_init(s, l));
+            re_nfa_match(re, str, from, len, m);
+            break;
+        default:
+            // the backtracker tells when the input doesn't fit
+            if ((re->plan.find != RE_ENGINE_BACKTRACK && re->plan.find_short != RE_ENGINE_BACKTRACK) ||
+                !re_bt_match(re, str, from, len, m))
+                re_nfa_match(re, str, from, len, m);
+            break;
+    }
+}
+
+struct ReMatch re_match(struct Regex *re, const char *str, char *buf, size_t bufsiz)
+{
+    /* Find leftmost longest match of expression in string.
+     * Matched string is copied to buf when buf is not NULL */
+    struct ReMatch m;
+    memset(&m, 0, sizeof(struct ReMatch));
+    m.state = -1;
+
+    if (re->flags & RE_STATS)
+        re->stats.nmatch++;
+
+    if (!re_is_short(re, str))
+        re_match_in(re, str, 0, RE_NO_LEN, &m);
+
+    if (m.state < 0) {
+        DEBUG("No Match\n");
+        return m;
+    }
+
+    if (buf != NULL) {
+        size_t len = m.iend - m.istart;
+        if (len >= bufsiz) {
+            ERROR("Ouput buffer full: %ld, max=%ld\n", len, bufsiz);
+            m.state = -1;
+            return m;
+        }
+        memcpy(buf, str + m.istart, len);
+        buf[len] = '\0';
+        m.result = buf;
+    }
+    m.endp = str + m.iend;
+    DEBUG("SUCCESS\n");
+    return m;
+}
+
+static int re_nfa_search_from(struct Regex *re, struct ReDfa *dfa, int id, const unsigned char *p, const unsigned char *end, unsigned int pos)
+{
+    /* Go on with the NFA where a search in the DFA left off, in state id at index pos of
+     * the input. The set of the state is where the NFA starts, the start states are added
+     * back after every char like the DFA does. Without a DFA the search starts from
+     * scratch at p. The input ends at end, '\0' is a char like any other.
+     * Returns 1 when there is a match */
+    struct MatchList *clist = &re->l0;
+    struct MatchList *nlist = &re->l1;
+    struct MatchList *bak;
+    unsigned long nbytes = 0;
+    unsigned long nstates = 0;
+    unsigned long peak = 0;
+    int is_match = 0;
+
+    // where threads started is not needed to tell if there is a match
+    re_match_list_init(re, clist, pos);
+    if (dfa == NULL) {
+        re_counters_reset(re);
+        re_match_list_append(re, clist, re->start, 0);
+    }
+    else {
+        const int *set = dfa->sets + dfa->setoff[id];
+        for (int i=0 ; i<dfa->setlen[id] ; i++)
+            re_match_list_store(re, clist, &re->spool[set[i]], 0);
+    }
+
+    for (;;) {
+        if (p == end)
+            re_match_list_at_end(re, clist);
+        for (int j=0 ; j<clist->n && !is_match ; j++)
+            is_match = clist->states[j]->type == STATE_TYPE_MATCH;
+        if (is_match || p == end)
+            break;
+
+        nbytes++;
+        nstates += clist->n;
+        if ((unsigned long)clist->n > peak)
+            peak = clist->n;
+
+        re_match_list_init(re, nlist, clist->pos + 1);
+        re_match_list_has_token(re, clist, nlist, *p++);
+        if (!(re->flags & RE_UTF8) || p == end || !RE_UTF8_IS_CONT(*p))
+            re_match_list_append(re, nlist, re->start, 0);
+
+        bak = clist;
+        clist = nlist;
+        nlist = bak;
+    }
+
+    if (re->flags & RE_STATS)
+        re_stats_add(re, nbytes, nstates, peak);
+    return is_match;
+}
+
+static int re_dfa_is_match(struct Regex *re, struct ReDfa *dfa, const char *str)
+{
+    /* Walk string through the DFA until a match state is reached, or no match can
+     * follow any more. When the cache thrashes the NFA takes over from where the
+     * walk is */
+    struct ReDfaLane l;
+    unsigned long nbytes = 0;
+    unsigned long misses = 0;
+    int is_match = 0;
+    int is_slow = 0;
+    int v;
+
+    l.p = (const unsigned char*)str;
+    if ((l.id = re_dfa_start(re, dfa, RE_DFA_SEARCH, 1)) == RE_DFA_FULL) {
+        is_slow = !re_dfa_flush(re, dfa, &l, 0, 0);
+        l.id = re_dfa_start(re, dfa, RE_DFA_SEARCH, 1);
+    }
+    if (!is_slow && (dfa->flags[l.id] & (RE_DFA_MATCH | RE_DFA_DEAD)))
+        return (dfa->flags[l.id] & RE_DFA_MATCH) != 0;
+
+    for (; !is_slow && *l.p ; l.p++) {
+        v = dfa->trans[l.id*dfa->nclasses + dfa->cls[*l.p]];
+        if (v == RE_DFA_UNKNOWN) {
+            misses++;
+            if ((v = re_dfa_step(re, dfa, l.id, *l.p)) == RE_DFA_FULL) {
+                if ((is_slow = !re_dfa_flush(re, dfa, &l, 1, nbytes)))
+                    break;
+                v = re_dfa_step(re, dfa, l.id, *l.p);
+            }
+        }
+        nbytes++;
+        if (v < 0) {
+            l.id = RE_DFA_TAG(v);
+            break;
+        }
+        l.id = v;
+    }
+
+    // a tagged state is final, otherwise the end of the input was reached
+    if (is_slow)
+        is_match = re_nfa_search_from(re, dfa, l.id, l.p, l.p + strlen((const char*)l.p), nbytes);
+    else if (dfa->flags[l.id] & RE_DFA_MATCH)
+        is_match = 1;
+    else if (*l.p == '\0' && (dfa->flags[l.id] & RE_DFA_EOL_MATCH))
+        is_match = 1;
+
+    re_dfa_walk_end(dfa, nbytes);
+    if (re->flags & RE_STATS) {
+        re_stats_add(re, nbytes, nbytes, nbytes > 0);
+        re->stats.dfa_hits += nbytes - misses;
+        re->stats.dfa_misses += misses;
+    }
+    return is_match;
+}
+
+int re_is_match(struct Regex *re, const char *str)
+{
+    /* Check if string has a match, without finding where it is.
+     * Stops at the first char where a match is certain. Uses the test engine of the
+     * plan: the substring search, the Aho-Corasick automaton, the shuffle DFA or the DFA,
+     * re_match() for the others.
+     * Returns 1 on match, 0 otherwise */
+    enum ReEngine engine = re_plan_test(re);
+
+    // a .* around the string doesn't change if there is a match
+    if (engine == RE_ENGINE_LITERAL) {
+        if (re->flags & RE_STATS)
+            re->stats.nmatch++;
+        return re_lit_find(re->lit, (const unsigned char*)str, (const unsigned char*)str + strlen(str)) != NULL;
+    }
+    if (engine != RE_ENGINE_AHO_CORASICK && engine != RE_ENGINE_SHUFFLE && engine != RE_ENGINE_DFA)
+        return re_match(re, str, NULL, 0).state > 0;
+
+    if (re->flags & RE_STATS)
+        re->stats.nmatch++;
+
+    if (re_is_short(re, str))
+        return 0;
+    if (engine == RE_ENGINE_SHUFFLE)
+        return re_shuf_is_match(re, re->shuf, (const unsigned char*)str, (const unsigned char*)str + strlen(str));
+    if (engine == RE_ENGINE_AHO_CORASICK)
+        return re_ac_is_match(re->ac, str, (re->flags & RE_STATS) ? &re->stats : NULL);
+    return re_dfa_is_match(re, re->dfa, str);
+}
+
+static int re_dfa_next(struct Regex *re, struct ReDfa *dfa, struct ReDfaLane *l, unsigned char c, unsigned long walked, unsigned long *misses)
+{
+    /* Move lane on char, the transition is made when it wasn't taken before.
+     * Returns the new state id with the tag taken off, or RE_DFA_FULL when the cache
+     * thrashes */
+    int v = dfa->trans[l->id*dfa->nclasses + dfa->cls[c]];
+
+    if (v == RE_DFA_UNKNOWN) {
+        (*misses)++;
+        if ((v = re_dfa_step(re, dfa, l->id, c)) == RE_DFA_FULL) {
+            if (!re_dfa_flush(re, dfa, l, 1, walked))
+                return RE_DFA_FULL;
+            v = re_dfa_step(re, dfa, l->id, c);
+        }
+    }
+    l->id = (v < 0) ? RE_DFA_TAG(v) : v;
+    return l->id;
+}
+
+static int re_dfa_lane_start(struct Regex *re, struct ReDfa *dfa, struct ReDfaLane *l, enum ReDfaMode mode, int at_start, unsigned long walked)
+{
+    /* Put lane in the start state of a walk.
+     * Returns state id, or RE_DFA_FULL when the cache thrashes */
+    if ((l->id = re_dfa_start(re, dfa, mode, at_start)) == RE_DFA_FULL) {
+        if (!re_dfa_flush(re, dfa, l, 0, walked))
+            return RE_DFA_FULL;
+        l->id = re_dfa_start(re, dfa, mode, at_start);
+    }
+    return l->id;
+}
+
+static int re_dfa_bounds(struct Regex *re, struct ReDfa *dfa, const char *str, unsigned int from, unsigned int len, struct ReCapture *m)
+{
+    /* Find the leftmost longest match that starts at from or later in three walks. A search
+     * from from finds the first index a match ends at, nothing else is walked when there is
+     * none. The reversed expression read backwards is in a match state at every index a
+     * match starts at, the lowest one is the start. Matches of at most maxlen start and end
+     * within maxlen of that first end, others are walked back from the end of the input.
+     * An anchored walk from the start finds the longest match. When m is NULL only the
+     * search is done.
+     * Returns 1 on match, 0 otherwise, -1 when the cache thrashes */
+    struct ReDfaLane l;
+    unsigned long nbytes = 0;
+    unsigned long misses = 0;
+    unsigned int p, lo, hi;
+    int first = -1;
+    int start = -1;
+    int end = -1;
+    int id;
+
+    // the search stays in its start state over bytes no match starts with, a flush
+    // makes it again under another id
+    const int *restart = &dfa->start[(RE_DFA_SEARCH >> 4) * 2];
+    int can_skip = re->info.minlen > 0;
+
+    id = re_dfa_lane_start(re, dfa, &l, RE_DFA_SEARCH, from == 0, nbytes);
+    for (p=from ; id != RE_DFA_FULL ; p++) {
+        if (can_skip && id == *restart)
+            p = re_skip_to_first(re, str, p, len);
+        if (p == len || (dfa->flags[id] & (RE_DFA_MATCH | RE_DFA_DEAD)))
+            break;
+        id = re_dfa_next(re, dfa, &l, str[p], nbytes++, &misses);
+    }
+    if (id != RE_DFA_FULL && ((dfa->flags[id] & RE_DFA_MATCH) || (p == len && (dfa->flags[id] & RE_DFA_EOL_MATCH))))
+        first = p;
+
+    lo = from;
+    hi = len;
+    if (re->info.maxlen >= 0 && first >= 0) {
+        unsigned int maxlen = re->info.maxlen;
+        lo = (first - from > maxlen) ? first - maxlen : from;
+        hi = (len - first > maxlen) ? first + maxlen : len;
+    }
 
+    if (m != NULL && first >= 0) {
+        id = re_dfa_lane_start(re, dfa, &l, RE_DFA_BACKWARD, hi == len, nbytes);
+        for (p=hi ; id != RE_DFA_FULL ; p--) {
+            if (dfa->flags[id] & RE_DFA_MATCH)
+                start = p;
+            if (p == lo || (dfa->flags[id] & RE_DFA_DEAD))
                 break;
-            case RE_TOK_TYPE_STAR:       // zero or more
-                g = POP();
-                s = re_state_init(re, *t, STATE_TYPE_SPLIT, g.start, NULL);
-                group_patch_outlist(&g, &s);
-                l = ol_init(GET_OL(), &s->out1);
-                PUSH(group_init(g.start, l));
-                break;
-            case RE_TOK_TYPE_PLUS:       // one or more
-                g = POP();
-                s = re_state_init(re, *t, STATE_TYPE_SPLIT, g.start, NULL);
-                group_patch_outlist(&g, &s);
-                l = ol_init(GET_OL(), &s->out1);
-                PUSH(group_init(s, l));
-                break;
-            default:        // it is a normal character
-                s = re_state_init(re, *t, STATE_TYPE_NONE, NULL, NULL);
-                l = ol_init(GET_OL(), &s->out);
-                g = group_init(s, l);
-                PUSH(g);
-                break;
+            id = re_dfa_next(re, dfa, &l, str[p-1], nbytes++, &misses);
         }
+        if (id != RE_DFA_FULL && p == 0 && (dfa->flags[id] & RE_DFA_EOL_MATCH))
+            start = 0;
     }
-    g = POP();
 
-    // connect last state that indicates a succesfull match
-    struct ReState *match_state = re_state_init(re, NULL, STATE_TYPE_MATCH, NULL, NULL);
+    if (id != RE_DFA_FULL && start >= 0) {
+        id = re_dfa_lane_start(re, dfa, &l, RE_DFA_FORWARD, start == 0, nbytes);
+        for (p=start ; id != RE_DFA_FULL ; p++) {
+            if (dfa->flags[id] & RE_DFA_MATCH)
+                end = p;
+            if (p == len || (dfa->flags[id] & RE_DFA_DEAD))
+                break;
+            id = re_dfa_next(re, dfa, &l, str[p], nbytes++, &misses);
+        }
+        if (id != RE_DFA_FULL && p == len && (dfa->flags[id] & RE_DFA_EOL_MATCH))
+            end = len;
+    }
 
-    group_patch_outlist(&g, &match_state);
+    re_dfa_walk_end(dfa, nbytes);
+    if (re->flags & RE_STATS) {
+        re_stats_add(re, nbytes, nbytes, nbytes > 0);
+        re->stats.dfa_hits += nbytes - misses;
+        re->stats.dfa_misses += misses;
+    }
 
-    //re_state_debug(g.start, 0);
-    re->start = g.start;
+    if (id == RE_DFA_FULL)
+        return -1;
+    if (m == NULL)
+        return first >= 0;
+    if (start < 0 || end < 0)
+        return 0;
+    m->istart = start;
+    m->iend = end;
+    return 1;
+}
 
-    return g.start;
+static int re_dfa_match(struct Regex *re, const char *str, unsigned int from, unsigned int len, struct ReMatch *m)
+{
+    /* Find the leftmost longest match that starts at from or later with the DFA. A match
+     * of any length is only searched for: walking back to its start takes the rest of the
+     * input, for every match re_replace() and re_split() look for.
+     * Returns 1 when the input was searched, 0 when the NFA has to find the match */
+    struct ReDfa *dfa = re_dfa_get(re);
+    struct ReCapture c;
+    int is_bounded = re->info.maxlen >= 0 && re->rev != NULL;
+    int found;
+
+    if (dfa == NULL)
+        return 0;
+    // callers that pass len took it from strnlen(), it isn't counted for every match again
+    if (len == RE_NO_LEN)
+        len = from + strlen(str + from);
+    if (from > len)
+        return 0;
+
+    // the shuffle DFA tells faster that there is no match, ^ holding at from only lets
+    // it find one more
+    if (re_plan_test(re) == RE_ENGINE_SHUFFLE &&
+        !re_shuf_is_match(re, re->shuf, (const unsigned char*)str + from, (const unsigned char*)str + len))
+        return 1;
+
+    found = re_dfa_bounds(re, dfa, str, from, len, is_bounded ? &c : NULL);
+    if (found < 0 || (found > 0 && !is_bounded))
+        return 0;
+    if (found > 0) {
+        m->istart = c.istart;
+        m->iend = c.iend;
+        m->state = 1;
+    }
+    return 1;
+}
 
-    #undef POP
-    #undef PUSH
-    #undef GET_OL
+static int re_pike_count(struct Regex *re, struct MatchList *l, struct ReState *s, int reps, int *caps)
+{
+    /* Add a thread that did reps repetitions of a counting state. The state is in the list
+     * once for every count, the entry of the count in the ring marks the list it is in.
+     * Returns 1 when added, 0 when a thread of higher priority has the count */
+    int ncaps = 2 * re->ngroups;
+
+    if (s->cnt->ring[reps].pos == (unsigned int)re->listid)
+        return 0;
+    s->cnt->ring[reps].pos = re->listid;
+    l->states[l->n] = s;
+    l->starts[l->n] = reps;
+    memcpy(l->caps + l->n*ncaps, caps, sizeof(int) * ncaps);
+    l->n++;
+    return 1;
 }
 
-void re_match_debug(struct ReMatch *m)
+static void re_pike_add(struct Regex *re, struct MatchList *l, struct ReState *s, int *caps, unsigned int len)
 {
-    if (m->state >= 0) {
-        DEBUG("RESULT: %s\n", m->result);
-        DEBUG("START:  %d\n", m->istart);
-        DEBUG("END:    %d\n", m->iend);
-        DEBUG("ENDP:   %s\n", m->endp);
+    /* Add state to the list of the capture engine together with the slots of its thread.
+     * States are added in priority order, the first thread to get to a state keeps it */
+    int ncaps = 2 * re->ngroups;
+    int old;
+
+    if (s != NULL && s->type == STATE_TYPE_COUNT) {
+        // entered with no repetitions yet, the counts that follow are added by re_pike_match()
+        if (re_pike_count(re, l, s, 0, caps) && s->cnt->min == 0)
+            re_pike_add(re, l, s->out, caps, len);
+        return;
     }
-    else {
-        DEBUG("Parsing failed\n");
+    if (s == NULL || s->lastlist == re->listid)
+        return;
+    s->lastlist = re->listid;
+
+    switch (s->type) {
+        case STATE_TYPE_SPLIT:
+            re_pike_add(re, l, s->out, caps, len);
+            re_pike_add(re, l, s->out1, caps, len);
+            break;
+        case STATE_TYPE_BOL:
+            if (l->pos == 0)
+                re_pike_add(re, l, s->out, caps, len);
+            break;
+        case STATE_TYPE_EOL:
+            if (l->pos == len)
+                re_pike_add(re, l, s->out, caps, len);
+            break;
+        case STATE_TYPE_SAVE:
+            // the slot is put back for the threads of the other side of a split
+            old = caps[s->slot];
+            caps[s->slot] = l->pos;
+            re_pike_add(re, l, s->out, caps, len);
+            caps[s->slot] = old;
+            break;
+        default:
+            l->states[l->n] = s;
+            memcpy(l->caps + l->n*ncaps, caps, sizeof(int) * ncaps);
+            l->n++;
+            break;
     }
 }
 
-static void debug_match_list(struct MatchList *l)
+static int re_pike_match(struct Regex *re, const char *str, unsigned int len, struct ReCapture *m)
 {
-    struct ReState **s = l->states;
-    for (int i=0 ; i<l->n ; i++, s++) {
-        if ((*s)->type == STATE_TYPE_MATCH) {
-            DEBUG("MATCHLIST: [%d] MATCH\n", i);
+    /* Run the NFA over the bounds of the match only, threads keep the positions of the
+     * save states they passed. Threads are in priority order, the first one to reach
+     * the match state at the end of the match has the groups.
+     * Result is left in re->caps. Returns 1 on match, 0 otherwise */
+    struct MatchList *clist = &re->l0;
+    struct MatchList *nlist = &re->l1;
+    struct MatchList *bak;
+    int ncaps = 2 * re->ngroups;
+    unsigned long nstates = 0;
+    unsigned long peak = 0;
+
+    // short matches are walked depth first instead
+    int found = re_bt_captures(re, str, len, m);
+    if (found >= 0)
+        return found;
+
+    for (int i=0 ; i<ncaps ; i++)
+        re->caps[i] = -1;
+
+    // counts are marked with the list ids that follow
+    for (int k=0 ; k<re->nrings ; k++)
+        re->rings[k].pos = re->listid;
+
+    re_match_list_init(re, clist, m->istart);
+    re_pike_add(re, clist, re->start, re->caps, len);
+
+    for (unsigned int i=m->istart ; i<(unsigned int)m->iend ; i++) {
+        nstates += clist->n;
+        if ((unsigned long)clist->n > peak)
+            peak = clist->n;
+
+        re_match_list_init(re, nlist, i+1);
+        for (int j=0 ; j<clist->n ; j++) {
+            struct ReState *s = clist->states[j];
+            if ((s->type != STATE_TYPE_NONE && s->type != STATE_TYPE_COUNT) || !re_state_match_chr(s, str[i]))
+                continue;
+            RE_HIT(s);
+            if (s->type == STATE_TYPE_COUNT) {
+                // one more repetition, past min an unbounded counter stays at min
+                struct ReCounter *cnt = s->cnt;
+                int reps = clist->starts[j] + 1;
+                if (cnt->max < 0 && reps > cnt->min)
+                    reps = cnt->min;
+                if (cnt->max < 0 || reps < cnt->max)
+                    re_pike_count(re, nlist, s, reps, clist->caps + j*ncaps);
+                if (reps >= cnt->min)
+                    re_pike_add(re, nlist, s->out, clist->caps + j*ncaps, len);
+                continue;
+            }
+            re_pike_add(re, nlist, s->out, clist->caps + j*ncaps, len);
+            re_pike_add(re, nlist, s->out1, clist->caps + j*ncaps, len);
         }
-        else {
-            DEBUG("MATCHLIST: [%d] %s\n", i, re_token_to_str((*s)->t));
+
+        bak = clist;
+        clist = nlist;
+        nlist = bak;
+    }
+
+    if (re->flags & RE_STATS)
+        re_stats_add(re, m->iend - m->istart, nstates, peak);
+
+    for (int j=0 ; j<clist->n ; j++) {
+        if (clist->states[j]->type == STATE_TYPE_MATCH) {
+            memcpy(re->caps, clist->caps + j*ncaps, sizeof(int) * ncaps);
+            return 1;
         }
     }
-    DEBUG("\n");
+    return 0;
 }
 
-struct ReMatch re_match(struct Regex *re, const char *str, char *buf, size_t bufsiz)
+int re_match_captures(struct Regex *re, const char *str, struct ReCapture *caps, int ncaps)
+{
+    /* Find the leftmost longest match like re_match() and where its groups are.
+     * Groups are numbered by their '(' from 1, caps[0] gets the whole match. A group
+     * gets what it matched the last time, picked the way a backtracking matcher would
+     * for the same match. Groups that are not in the match get -1.
+     * The DFA finds the bounds of the match, the NFA only runs over the match itself.
+     * Returns the number of entries filled in, 0 when there is no match, -1 on error */
+    struct ReDfa *dfa = NULL;
+    struct ReCapture m;
+    unsigned int len = strlen(str);
+    int n = re->ngroups + 1;
+    int found = -1;
+
+    if (ncaps < 1) {
+        ERROR("No room for the match, ncaps=%d\n", ncaps);
+        return -1;
+    }
+
+    if (len < (unsigned int)re->info.minlen)
+        return 0;
+
+    if (re->rev != NULL && (dfa = re_plan_dfa(re)) != NULL)
+        found = re_dfa_bounds(re, dfa, str, 0, len, &m);
+
+    // without a DFA, or when its cache thrashes, re_match() finds the bounds
+    if (found < 0) {
+        struct ReMatch rm = re_match(re, str, NULL, 0);
+        found = rm.state > 0;
+        m.istart = rm.istart;
+        m.iend = rm.iend;
+    }
+    else if (re->flags & RE_STATS) {
+        re->stats.nmatch++;
+    }
+    if (!found)
+        return 0;
+
+    if (n > ncaps)
+        n = ncaps;
+    caps[0] = m;
+
+    if (n > 1 && !re_pike_match(re, str, len, &m)) {
+        ERROR("No thread reached the end of the match [%d, %d]\n", m.istart, m.iend);
+        return -1;
+    }
+    for (int i=1 ; i<n ; i++) {
+        caps[i].istart = re->caps[2*(i-1)];
+        caps[i].iend = re->caps[2*(i-1)+1];
+    }
+    return n;
+}
+
+static int re_is_match_at(struct Regex *re, const char *p, const char *end)
 {
-    /* Run NFA state machine on string to check for a match */
-    const char *c = str;
+    /* Check if the input from p up to end has a match with the find engine of regex, in
+     * place. An input with a '\0' in it is searched with the NFA, which doesn't stop
+     * there. Without an NFA, with Glushkov, the input ends at the '\0'.
+     * Returns 1 on match, 0 otherwise */
     struct ReMatch m;
-    memset(&m, 0, sizeof(struct ReMatch));
-    m.state = -1;
+    size_t len = end - p;
 
-    unsigned int i = 0;
+    if (re->start != NULL && (len >= RE_NO_LEN || memchr(p, '\0', len) != NULL))
+        return re_nfa_search_from(re, NULL, 0, (const unsigned char*)p, (const unsigned char*)end, 0);
 
-    // this is where we record the states
-    struct MatchList l0 = re_match_list_init();
-    struct MatchList l1 = re_match_list_init();
+    m.state = -1;
+    re_match_in(re, p, 0, len, &m);
+    return m.state > 0;
+}
 
-    // These pointers are swapped between iterations.
-    // clist holds current states that need to be checked.
-    // nlist (becomes cclist) holds the next states that need to be checked on next iteration
-    struct MatchList *clist = &l0;
-    struct MatchList *nlist = &l1;
-    struct MatchList *bak;
+static int re_match_batch_nfa(struct Regex *re, const unsigned int *offsets, const char *data, size_t n, unsigned char *bitmap)
+{
+    /* Match strings one at a time where they are with the find engine when there is
+     * no DFA */
+    int nmatch = 0;
+
+    for (size_t i=0 ; i<n ; i++) {
+        if (offsets[i+1] - offsets[i] < (unsigned int)re->info.minlen)
+            continue;
+        if (re_is_match_at(re, data + offsets[i], data + offsets[i+1])) {
+            bitmap[i / 8] |= 1 << (i % 8);
+            nmatch++;
+        }
+    }
+    return nmatch;
+}
 
-    int is_anchored = 0;
+static int re_match_batch_lit(struct Regex *re, const unsigned int *offsets, const char *data, size_t n, unsigned char *bitmap)
+{
+    /* Search the strings for the literal where they are, nothing is copied */
+    const unsigned char *d = (const unsigned char*)data;
+    unsigned long nbytes = 0;
+    int nmatch = 0;
+
+    for (size_t i=0 ; i<n ; i++) {
+        const unsigned char *end = d + offsets[i+1];
+        const unsigned char *found = re_lit_find(re->lit, d + offsets[i], end);
+
+        nbytes += (found != NULL ? found + re->lit->len : end) - (d + offsets[i]);
+        if (found != NULL) {
+            bitmap[i / 8] |= 1 << (i % 8);
+            nmatch++;
+        }
+    }
 
-    // add first node, or second if we're anchored at start of string
-    if (re->start->t->type == RE_TOK_TYPE_CARET) {
-        DEBUG("IS ANCHORED AT START\n");
-        is_anchored = 1;
-        re_match_list_append(clist, re->start->out);
+    if (re->flags & RE_STATS)
+        re->stats.bytes += nbytes;
+    return nmatch;
+}
+
+static int re_match_batch_shuf(struct Regex *re, struct ReShuffle *sh, const unsigned int *offsets, const char *data, size_t n, unsigned char *bitmap)
+{
+    /* Walk the strings through the shuffle DFA one after the other, a walk doesn't wait
+     * for table lookups so there is nothing to win by interleaving them */
+    const unsigned char *d = (const unsigned char*)data;
+    int nmatch = 0;
+
+    for (size_t i=0 ; i<n ; i++) {
+        if (offsets[i+1] - offsets[i] < (unsigned int)re->info.minlen)
+            continue;
+        if (re_shuf_is_match(re, sh, d + offsets[i], d + offsets[i+1])) {
+            bitmap[i / 8] |= 1 << (i % 8);
+            nmatch++;
+        }
     }
-    else {
-        re_match_list_append(clist, re->start);
+    return nmatch;
+}
+
+static int re_dfa_lanes_to_nfa(struct Regex *re, struct ReDfa *dfa, struct ReDfaLane *lanes, int nlanes, const unsigned int *offsets, const char *data, unsigned char *bitmap)
+{
+    /* Finish the strings of the lanes with the NFA, from where they are in the DFA.
+     * Returns amount of them with a match */
+    int nmatch = 0;
+
+    for (int k=0 ; k<nlanes ; k++) {
+        struct ReDfaLane *l = &lanes[k];
+        unsigned int pos = l->p - ((const unsigned char*)data + offsets[l->i]);
+
+        if (re_nfa_search_from(re, dfa, l->id, l->p, l->end, pos)) {
+            bitmap[l->i / 8] |= 1 << (l->i % 8);
+            nmatch++;
+        }
     }
+    return nmatch;
+}
+
+int re_match_batch(struct Regex *re, const unsigned int *offsets, const char *data, size_t n, unsigned char *bitmap)
+{
+    /* Check which of n strings have a match. String i is data from offsets[i] up to
+     * offsets[i+1], like an Arrow string column, it doesn't need to end with '\0'.
+     * Bit i of bitmap, LSB first, is set when string i has a match.
+     * Up to RE_DFA_LANES strings are walked through the DFA together, one char of every
+     * string per round, so the table lookups of different strings overlap. Without a
+     * DFA the strings are matched one at a time.
+     * Returns amount of strings with a match, or -1 on error */
+    enum ReEngine engine = re_plan_test(re);
+    struct ReDfaLane lanes[RE_DFA_LANES];
+    struct ReDfa *dfa = re->dfa;
+    unsigned long nbytes = 0;
+    unsigned long misses = 0;
+    size_t next = 0;
+    int nlanes = 0;
+    int nmatch = 0;
+
+    memset(bitmap, 0, (n + 7) / 8);
+
+    if (engine == RE_ENGINE_LITERAL)
+        return re_match_batch_lit(re, offsets, data, n, bitmap);
+    if (engine == RE_ENGINE_SHUFFLE)
+        return re_match_batch_shuf(re, re->shuf, offsets, data, n, bitmap);
+    if (engine != RE_ENGINE_DFA)
+        return re_match_batch_nfa(re, offsets, data, n, bitmap);
+
+    for (;;) {
+        // free lanes take the next strings
+        while (nlanes < RE_DFA_LANES && next < n) {
+            int id = re_dfa_start(re, dfa, RE_DFA_SEARCH, 1);
+
+            if (id == RE_DFA_FULL) {
+                if (!re_dfa_flush(re, dfa, lanes, nlanes, nbytes)) {
+                    nmatch += re_dfa_lanes_to_nfa(re, dfa, lanes, nlanes, offsets, data, bitmap);
+                    nlanes = 0;
+                }
+                id = re_dfa_start(re, dfa, RE_DFA_SEARCH, 1);
+            }
+            struct ReDfaLane *l = &lanes[nlanes];
+            l->p = (const unsigned char*)data + offsets[next];
+            l->end = (const unsigned char*)data + offsets[next+1];
+            l->id = id;
+            l->i = next++;
+
+            // strings shorter than the shortest match never take a lane
+            if (dfa->flags[id] & RE_DFA_MATCH) {
+                bitmap[l->i / 8] |= 1 << (l->i % 8);
+                nmatch++;
+            }
+            else if (!(dfa->flags[id] & RE_DFA_DEAD) && l->end - l->p >= re->info.minlen) {
+                nlanes++;
+            }
+        }
+        if (nlanes == 0)
+            break;
 
+        // Lanes are never in a final state, those are tagged and end the string.
+        // Lanes that are done are replaced by the last one, which already had its turn.
+        for (int k=nlanes-1 ; k>=0 ; k--) {
+            struct ReDfaLane *l = &lanes[k];
+            int v;
 
-    DEBUG("INPUT STRING: %s\n", str);
+            if (l->p == l->end) {
+                if (dfa->flags[l->id] & RE_DFA_EOL_MATCH) {
+                    bitmap[l->i / 8] |= 1 << (l->i % 8);
+                    nmatch++;
+                }
+                *l = lanes[--nlanes];
+                continue;
+            }
 
-    for (; *c ; c++) {
-        DEBUG("MATCHING CHAR: '%c'\n", *c);
-        *nlist = re_match_list_init();
+            v = dfa->trans[l->id*dfa->nclasses + dfa->cls[*l->p]];
+            if (v == RE_DFA_UNKNOWN) {
+                misses++;
+                if ((v = re_dfa_step(re, dfa, l->id, *l->p)) == RE_DFA_FULL) {
+                    // the strings in the lanes are finished by the NFA, the next
+                    // ones start in the emptied cache
+                    if (!re_dfa_flush(re, dfa, lanes, nlanes, nbytes)) {
+                        nmatch += re_dfa_lanes_to_nfa(re, dfa, lanes, nlanes, offsets, data, bitmap);
+                        nlanes = 0;
+                        break;
+                    }
+                    v = re_dfa_step(re, dfa, l->id, *l->p);
+                }
+            }
+            l->p++;
+            nbytes++;
 
-        // Check all paths in clist and check for matches against c.
-        // Add all matches to nlist so we can process them on the next run.
-        if (re_match_list_has_token(clist, nlist, *c) > 0) {
-            if (i>=bufsiz-1) {
-                ERROR("Ouput buffer full: %d, max=%ld\n", i, bufsiz);
-                return m;
+            if (v >= 0) {
+                l->id = v;
+                continue;
             }
 
-            buf[i++] = *c;
-            buf[i] = '\0';
-
-            // switch lists
-            bak = clist;
-            clist = nlist;
-            nlist = bak;
-
-            if (re_match_list_has_match(clist)) {
-                debug_match_list(clist);
-                m.endp = c;
-                m.iend = i-1;
-                m.state = 1;
-                m.result = buf;
-                DEBUG("SUCCESS\n");
-                return m;
+            // a tagged transition, the string matched or can't match any more
+            if (dfa->flags[RE_DFA_TAG(v)] & RE_DFA_MATCH) {
+                bitmap[l->i / 8] |= 1 << (l->i % 8);
+                nmatch++;
             }
+            *l = lanes[--nlanes];
+        }
+    }
+
+    re_dfa_walk_end(dfa, nbytes);
+    if (re->flags & RE_STATS) {
+        re_stats_add(re, nbytes, nbytes, nbytes > 0);
+        re->stats.dfa_hits += nbytes - misses;
+        re->stats.dfa_misses += misses;
+    }
+    return nmatch;
+}
+
+static const char* re_find_line_nfa(struct Regex *re, const char *p, const char *end, const char **eol)
+{
+    /* Match lines one at a time where they are with the find engine when there is no
+     * DFA or Aho-Corasick automaton */
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *e = (nl != NULL) ? nl : end;
+
+        if (e - p >= re->info.minlen && re_is_match_at(re, p, e)) {
+            *eol = e;
+            return p;
+        }
+        p = e + 1;
+    }
+    return NULL;
+}
+
+static const char* re_ac_find_line(struct ReAc *ac, const char *p, const char *end, const char **eol, struct ReStats *st)
+{
+    /* Walk the lines through the automaton, it starts over at every '\n' */
+    const unsigned char *s = (const unsigned char*)p;
+    const unsigned char *e = (const unsigned char*)end;
+    const char *bol = p;
+    int v = 0;
+
+    for (; s < e ; s++) {
+        if (*s == '\n') {
+            bol = (const char*)s + 1;
+            v = 0;
+            continue;
+        }
+        v = ac->delta[v*ac->nclasses + ac->cls[*s]];
+        if (ac->olen[v] != 0)
+            break;
+    }
+
+    if (st != NULL) {
+        st->bytes += s - (const unsigned char*)p;
+        st->states += s - (const unsigned char*)p;
+    }
+    if (s == e)
+        return NULL;
+
+    *eol = memchr(s, '\n', e - s);
+    if (*eol == NULL)
+        *eol = end;
+    return bol;
+}
+
+const char* re_find_line(struct Regex *re, const char *p, const char *end, const char **eol)
+{
+    /* Find the first line from p on with a match. Lines end at '\n' or at end, a match
+     * never spans lines: ^ and $ hold at the start and end of every line.
+     * The DFA walks the whole buffer and starts over at every '\n', without going back
+     * to the caller. When it thrashes the NFA finishes the line. The end of a line with
+     * a match is only looked for when there is one.
+     * Returns the start of the line and sets eol to its end, or NULL when no line has
+     * a match */
+    struct ReDfa *dfa = NULL;
+    struct ReDfaLane l;
+    unsigned long nbytes = 0;
+    unsigned long misses = 0;
+    const char *found = NULL;
+
+    if (re->flags & RE_STATS)
+        re->stats.nmatch++;
+
+    if (re->plan.test == RE_ENGINE_AHO_CORASICK)
+        return re_ac_find_line(re->ac, p, end, eol, (re->flags & RE_STATS) ? &re->stats : NULL);
+    if (re->plan.test == RE_ENGINE_LITERAL && memchr(re->lit->s, '\n', re->lit->len) == NULL)
+        return re_lit_find_line(re->lit, p, end, eol, (re->flags & RE_STATS) ? &re->stats : NULL);
+    if ((dfa = re_plan_dfa(re)) == NULL)
+        return re_find_line_nfa(re, p, end, eol);
+
+    l.p = (const unsigned char*)p;
+    l.end = (const unsigned char*)end;
+
+    while (found == NULL && l.p < l.end) {
+        const unsigned char *bol = l.p;
+        int is_match = 0;
+        int is_dead = 0;
+        int is_slow = 0;
+
+        // ^ holds at the start of every line
+        if (re_dfa_lane_start(re, dfa, &l, RE_DFA_SEARCH, 1, nbytes) == RE_DFA_FULL) {
+            is_slow = 1;
+            l.id = re_dfa_start(re, dfa, RE_DFA_SEARCH, 1);
         }
         else {
+            is_match = (dfa->flags[l.id] & RE_DFA_MATCH) != 0;
+        }
+
+        // a tagged state is final for the line, it matched or can't match any more
+        for (; !is_slow && !is_match && !is_dead && l.p < l.end && *l.p != '\n' ; l.p++) {
+            int v = dfa->trans[l.id*dfa->nclasses + dfa->cls[*l.p]];
+            if (v >= 0) {
+                l.id = v;
+                nbytes++;
+                continue;
+            }
+            if (v != RE_DFA_UNKNOWN)
+                l.id = RE_DFA_TAG(v);
+            else if (re_dfa_next(re, dfa, &l, *l.p, nbytes, &misses) == RE_DFA_FULL)
+                is_slow = 1;
+            if (is_slow)
+                break;
+            nbytes++;
+            is_match = (dfa->flags[l.id] & RE_DFA_MATCH) != 0;
+            is_dead = (dfa->flags[l.id] & RE_DFA_DEAD) != 0;
+        }
+
+        // the rest of the line is needed to go on, or to skip it
+        const unsigned char *nl = (l.p < l.end) ? memchr(l.p, '\n', l.end - l.p) : NULL;
+        if (nl == NULL)
+            nl = l.end;
+
+        if (is_slow)
+            is_match = re_nfa_search_from(re, dfa, l.id, l.p, nl, l.p - bol);
+        else if (!is_match && l.p == nl)
+            is_match = (dfa->flags[l.id] & RE_DFA_EOL_MATCH) != 0;
+
+        if (is_match) {
+            found = (const char*)bol;
+            *eol = (const char*)nl;
+        }
+        l.p = nl + 1;
+    }
+
+    re_dfa_walk_end(dfa, nbytes);
+    if (re->flags & RE_STATS) {
+        re_stats_add(re, nbytes, nbytes, nbytes > 0);
+        re->stats.dfa_hits += nbytes - misses;
+        re->stats.dfa_misses += misses;
+    }
+    return found;
+}
+
+
+///// REPLACE ////////////////////////////////////////////////////
+/* re_replace() hands its result to a writer in pieces that point into the input and the
+ * template, nothing is copied on the way. A reference in the template is a $ followed by
+ * a group number, $n for one digit and ${n} for more. */
+
+// Reference in a template that stands for a '$'
+#define RE_REF_DOLLAR (-2)
+
+static int re_buf_cb_write(const char *s, size_t len, void *ctx)
+{
+    struct ReBuf *b = ctx;
+    if (b->len + len >= b->size) {
+        ERROR("Output buffer full: %ld, max=%ld\n", b->len + len, b->size);
+        return -1;
+    }
+    memcpy(b->buf + b->len, s, len);
+    b->len += len;
+    b->buf[b->len] = '\0';
+    return 0;
+}
+
+void re_buf_init(struct ReBuf *b, char *buf, size_t size)
+{
+    b->buf = buf;
+    b->size = size;
+    b->len = 0;
+    if (size > 0)
+        buf[0] = '\0';
+}
+
+struct ReWriter re_buf_writer(struct ReBuf *b)
+{
+    /* Writer that appends to a caller buffer and fails when it is full */
+    struct ReWriter w = { re_buf_cb_write, b };
+    return w;
+}
+
+static int re_template_ref(const char **t)
+{
+    /* Parse the reference after a '$' and move t past it.
+     * Returns group number, RE_REF_DOLLAR for "$$", or -1 on error */
+    const char *s = *t;
+    int group = 0;
+
+    if (*s == '$') {
+        *t = s+1;
+        return RE_REF_DOLLAR;
+    }
+    if (re_is_digit(*s)) {
+        *t = s+1;
+        return *s - '0';
+    }
+    if (*s != '{' || !re_is_digit(s[1])) {
+        ERROR("Expected a group number after '$' in template: %s\n", s);
+        return -1;
+    }
+    for (s++ ; re_is_digit(*s) && group <= RE_MAX_REPEAT ; s++)
+        group = group * 10 + (*s - '0');
+    if (*s != '}') {
+        ERROR("Missing '}' after group number in template: %s\n", *t);
+        return -1;
+    }
+    *t = s+1;
+    return group;
+}
+
+static int re_template_check(struct Regex *re, const char *tmpl)
+{
+    /* Check that template only takes groups of the expression.
+     * Returns the highest group it takes, or -1 on error */
+    int max = 0;
+
+    for (const char *t=tmpl ; (t = strchr(t, '$')) != NULL ; ) {
+        t++;
+        int group = re_template_ref(&t);
+        if (group == -1)
+            return -1;
+        if (group > re->ngroups) {
+            ERROR("Template takes group %d, expression has %d%s\n", group, re->ngroups,
+                    (re->flags & RE_CAPTURE) ? "" : ", groups need RE_CAPTURE");
+            return -1;
+        }
+        if (group > max)
+            max = group;
+    }
+    return max;
+}
+
+static int re_template_write(struct Regex *re, const char *tmpl, const char *str, struct ReMatch *m, const struct ReWriter *w)
+{
+    /* Write template with its references filled in from the match and re->caps.
+     * Text between references is written from the template itself.
+     * Returns 0, or -1 when the writer fails */
+    const char *text = tmpl;
+    const char *t = tmpl;
+
+    while ((t = strchr(t, '$')) != NULL) {
+        if (t > text && w->write(text, t - text, w->ctx) < 0)
+            return -1;
+
+        t++;
+        int group = re_template_ref(&t);
+
+        // the second '$' is the first char of the next text
+        if (group == RE_REF_DOLLAR) {
+            text = t-1;
+            continue;
+        }
+
+        int start = (group == 0) ? (int)m->istart : re->caps[2*(group-1)];
+        int end = (group == 0) ? (int)m->iend : re->caps[2*(group-1)+1];
+        if (start >= 0 && end > start && w->write(str + start, end - start, w->ctx) < 0)
+            return -1;
+        text = t;
+    }
+    if (*text != '\0' && w->write(text, strlen(text), w->ctx) < 0)
+        return -1;
+    return 0;
+}
+
+int re_replace(struct Regex *re, const char *str, size_t len, const char *tmpl, const struct ReWriter *w)
+{
+    /* Replace every match in the first len bytes of str by template, the result goes to
+     * the writer. Matching stops at a '\0' in str. Matches are found from left to right
+     * like re_match() does, the next one starts where the last one ended, or one char
+     * later when it was empty.
+     * In template $0 is the match, $1 to $9 and ${n} are groups, they need RE_CAPTURE.
+     * A group that took no part in the match is empty. $$ is a '$'.
+     * Returns amount of matches replaced, or -1 on error */
+    unsigned int n;
+    unsigned int from = 0;
+    unsigned int done = 0;
+    int maxref;
+    int count = 0;
+
+    if (len >= RE_NO_LEN) {
+        ERROR("Input too long: %ld\n", len);
+        return -1;
+    }
+    if ((maxref = re_template_check(re, tmpl)) < 0)
+        return -1;
+    n = strnlen(str, len);
+
+    while (from <= n && n - from >= (unsigned int)re->info.minlen) {
+        struct ReMatch m;
+        struct ReCapture bounds;
+
+        m.state = -1;
+        if (re->flags & RE_STATS)
+            re->stats.nmatch++;
+        re_match_in(re, str, from, n, &m);
+        if (m.state <= 0)
             break;
+
+        bounds.istart = m.istart;
+        bounds.iend = m.iend;
+        if (maxref > 0 && !re_pike_match(re, str, n, &bounds)) {
+            ERROR("No thread reached the end of the match [%d, %d]\n", m.istart, m.iend);
+            return -1;
+        }
+
+        if (m.istart > done && w->write(str + done, m.istart - done, w->ctx) < 0)
+            return -1;
+        if (re_template_write(re, tmpl, str, &m, w) < 0)
+            return -1;
+        count++;
+        done = m.iend;
+
+        // an empty match is left behind by one char, with RE_UTF8 a whole one
+        from = m.iend;
+        if (m.iend == m.istart) {
+            from++;
+            while ((re->flags & RE_UTF8) && from < n && ((unsigned char)str[from] & 0xc0) == 0x80)
+                from++;
         }
     }
-    DEBUG("No Match\n");
-    return m;
+
+    if (len > done && w->write(str + done, len - done, w->ctx) < 0)
+        return -1;
+    return count;
+}
+
+
+///// SPLIT //////////////////////////////////////////////////////
+/* re_split_next() returns the fields between the matches of a delimiter expression, as
+ * views into the input. The delimiters are found like re_replace() finds its matches.
+ * A delimiter that is a fixed string or a single byte class is common, it is found
+ * without the engine. */
+
+int re_split_init(struct ReSplit *sp, struct Regex *re, const char *str, size_t len)
+{
+    /* Start splitting the first len bytes of str. Delimiters are only searched up to
+     * a '\0', the last field goes on to len.
+     * Returns 0, or -1 on error */
+    struct ReInfo *in = &re->info;
+    int is_fixed = in->minlen > 0 && in->minlen == in->maxlen && !in->has_anchors;
+
+    if (len >= RE_NO_LEN) {
+        ERROR("Input too long: %ld\n", len);
+        return -1;
+    }
+
+    sp->re = re;
+    sp->str = str;
+    sp->len = len;
+    sp->end = strnlen(str, len);
+    sp->pos = 0;
+    sp->from = 0;
+    sp->is_done = 0;
+
+    // every match is the prefix when the prefix is as long as any match
+    if (is_fixed && in->nprefix == in->minlen)
+        sp->kind = (in->minlen == 1) ? RE_SPLIT_BYTE : RE_SPLIT_LITERAL;
+    else if (is_fixed && in->minlen == 1)
+        sp->kind = RE_SPLIT_CLASS;
+    else
+        sp->kind = RE_SPLIT_SEARCH;
+    return 0;
+}
+
+static int re_split_find(struct ReSplit *sp, unsigned int *start, unsigned int *end)
+{
+    /* Find the next delimiter from sp->from on.
+     * Returns 1 when there is one, 0 otherwise */
+    struct Regex *re = sp->re;
+    const char *s = sp->str;
+    const char *p;
+    unsigned int i;
+
+    if (sp->from > sp->end)
+        return 0;
+    if (re->flags & RE_STATS)
+        re->stats.nmatch++;
+
+    switch (sp->kind) {
+        case RE_SPLIT_BYTE:
+            if ((p = memchr(s + sp->from, re->info.prefix[0], sp->end - sp->from)) == NULL)
+                return 0;
+            *start = p - s;
+            *end = *start + 1;
+            return 1;
+        case RE_SPLIT_LITERAL:
+            if (re->lit != NULL) {
+                const unsigned char *u = (const unsigned char*)s;
+                const unsigned char *found = re_lit_find(re->lit, u + sp->from, u + sp->end);
+                if (found == NULL)
+                    return 0;
+                *start = found - u;
+                *end = *start + re->lit->len;
+                return 1;
+            }
+            for (i=sp->from ; i + re->info.minlen <= sp->end ; i=*start+1) {
+                if ((p = memchr(s + i, re->info.prefix[0], sp->end - i)) == NULL)
+                    return 0;
+                *start = p - s;
+                *end = *start + re->info.minlen;
+                if (*end <= sp->end && memcmp(p, re->info.prefix, re->info.minlen) == 0)
+                    return 1;
+            }
+            return 0;
+        case RE_SPLIT_CLASS:
+            for (i=sp->from ; i<sp->end ; i++) {
+                if (RE_SET_TEST(re->info.first, (unsigned char)s[i])) {
+                    *start = i;
+                    *end = i+1;
+                    return 1;
+                }
+            }
+            return 0;
+        default: {
+            struct ReMatch m;
+            m.state = -1;
+            if (sp->end - sp->from < (unsigned int)re->info.minlen)
+                return 0;
+            re_match_in(re, s, sp->from, sp->end, &m);
+            *start = m.istart;
+            *end = m.iend;
+            return m.state > 0;
+        }
+    }
+}
+
+int re_split_next(struct ReSplit *sp, const char **field, size_t *len)
+{
+    /* Get the next field, the text up to the next delimiter or the end of the input.
+     * There is one field more than there are delimiters, fields can be empty.
+     * Returns 1 when there is a field, 0 when all fields were returned */
+    unsigned int start, end;
+
+    if (sp->is_done)
+        return 0;
+
+    *field = sp->str + sp->pos;
+    if (!re_split_find(sp, &start, &end)) {
+        *len = sp->len - sp->pos;
+        sp->is_done = 1;
+        return 1;
+    }
+    *len = start - sp->pos;
+    sp->pos = end;
+
+    // an empty delimiter is left behind by one char, with RE_UTF8 a whole one
+    sp->from = end;
+    if (end == start) {
+        sp->from++;
+        while ((sp->re->flags & RE_UTF8) && sp->from < sp->end && ((unsigned char)sp->str[sp->from] & 0xc0) == 0x80)
+            sp->from++;
+    }
+    return 1;
 }
@@ -18,46 +18,71 @@
  * https://www.youtube.com/watch?v=QzVVjboyb0s
  */
 
-// TODO: Greediness should be concidered when using * or +
-// TODO: Add ^ and $ for beginning/end of input string
-// TODO: Infix tokens should not be global but stored within Regex
 // TODO: match literal [] chars when escaped
-// TODO: if we're not anchored at start of inp string, we shoud iter over the string to find a result
 // TODO: most functions should return a state enum indicating error/success
 
-#define DO_DEBUG
-#define DO_INFO
+// Build with -DDO_DEBUG (make DEBUG=1) to trace compiling and matching on stdout.
+// It prints every state for every char, only use it on small inputs.
 #define DO_ERROR
 
 #ifdef DO_DEBUG
     #define DEBUG(M, ...) fprintf(stdout, "[DEBUG] " M, ##__VA_ARGS__)
 #else
-    #define DEBUG(M, ...) ()
+    #define DEBUG(M, ...) do {} while (0)
 #endif
 
 #ifdef DO_INFO
     #define INFO(M, ...) fprintf(stdout, "[INFO]  " M, ##__VA_ARGS__)
 #else
-    #define INFO(M, ...) ()
+    #define INFO(M, ...) do {} while (0)
 #endif
 
 #ifdef DO_ERROR
     #define ERROR(M, ...) fprintf(stderr, "[ERROR] (%s:%d) " M, __FILE__, __LINE__, ##__VA_ARGS__)
 #else
-    #define ERROR(M, ...) ()
+    #define ERROR(M, ...) do {} while (0)
 #endif
 
-#define RE_MAX_TOKEN_POOL           256
 #define RE_MAX_STR_RESULT           128
-#define RE_MAX_STATE_POOL          1024
-#define RE_MAX_OUT_LIST_POOL       1024
-#define RE_MAX_GROUP_STACK          256
-#define RE_MAX_STATE_OUT           1024
 #define RE_MAX_CCLASS                32
 #define RE_MAX_TOKEN_STR_REPR        64
 #define RE_MAX_TOKEN_TYPE_STR_REPR   64
-#define RE_MAX_MATCH_LIST           256
-#define RE_MAX_REGEX                256
+
+// Largest bound in a counted repetition: x{n,m}
+#define RE_MAX_REPEAT              1000
+// Most states a counted repetition of a char or class is unrolled into, copies x states.
+// With RE_UTF8 a char is its byte sequences. Larger ones get a counting state, which the
+// DFAs and the backtracker can't run
+#define RE_MAX_UNROLL            64
+// Most UTF-8 byte sequences of a class, a code point range takes up to 12
+#define RE_MAX_UTF8_SEQ          (16 * (RE_MAX_CCLASS + 1))
+// Largest expression after repetitions that can't use a counter are expanded
+#define RE_MAX_EXPANDED       (1 << 20)
+// Most bytes a compiled expression and its compiler may need, see re_compile_size() and
+// re_scratch_size(). Unrolled repetitions and the position sets of RE_GLUSHKOV grow much
+// faster than the expression
+#define RE_MAX_COMPILE_SIZE   (8 * 1024 * 1024)
+
+// Memory taken from the allocator of a Regex for its lazy DFA, states are dropped
+// when it is full. Default, it can be set per Regex with re_set_dfa_budget()
+#define RE_DFA_CACHE_SIZE  (64 * 1024)
+// A full cache that was walked for fewer bytes than this per state is thrashing, the
+// rest of the input goes to the NFA
+#define RE_DFA_MIN_YIELD     10
+// Strings walked through the DFA at once by re_match_batch()
+#define RE_DFA_LANES          8
+// Most states of a DFA that is walked with byte shuffles, and DFA states looked at to
+// find out if it fits, before states that can't be told apart are merged
+#define RE_SHUF_STATES       16
+#define RE_SHUF_EXPLORE      64
+// Largest states x (input length + 1) the backtracker takes, it is used for inputs that
+// fit. Default, it can be set per Regex with re_set_backtrack_limit()
+#define RE_BACKTRACK_MAX   (8 * 1024)
+// Longest literal prefix and suffix kept in ReInfo
+#define RE_MAX_LITERAL       16
+
+// All allocations from an arena are aligned to this
+#define RE_ARENA_ALIGN   sizeof(void*)
 
 #define PRRESET   "\x1B[0m"
 #define PRRED     "\x1B[31m"
@@ -69,6 +94,9 @@
 #define PRWHITE   "\x1B[37m"
 
 
+// Bits in a word of a Glushkov position set
+#define RE_SET_BITS (sizeof(unsigned int) * 8)
+
 #define RE_CONCAT_SYM '&'
 #define RE_RE_SPACE_CHARS      " \t"
 #define RE_RE_LINE_BREAK_CHARS "\n\r"
@@ -120,39 +148,8 @@ enum ReTokenType {
     RE_TOK_TYPE_HYPHEN,           // -   (divides a range: [a-z]
 
     RE_TOK_TYPE_RANGE,              // not a meta char, but represents a range
-};
 
-// String representations for types. Only used for debugging messages
-static const char *token_type_table[] = {
-    "RE_TOK_TYPE_UNDEFINED",
-    "RE_TOK_TYPE_PLUS",       //  +   GREEDY     match preceding 1 or more times
-    "RE_TOK_TYPE_STAR",       //  *   GREEDY     match preceding 0 or more times
-    "RE_TOK_TYPE_QUESTION",   //  ?   NON GREEDY match preceding 1 time            when combined with another quantifier it makes it non greedy
-    "RE_TOK_TYPE_CONCAT",          // explicit concat symbol
-    "RE_TOK_TYPE_PIPE",       //  |   OR
-    "RE_TOK_TYPE_CCLASS",
-    "RE_TOK_TYPE_CCLASS_NEGATED",
-    "RE_TOK_TYPE_RANGE_START",  // {n}  NON GREEDY match preceding n times
-    "RE_TOK_TYPE_RANGE_END",    // {n}  NON GREEDY match preceding n times
-    "RE_TOK_TYPE_GROUP_START",  // (
-    "RE_TOK_TYPE_GROUP_END",    // )
-    "RE_TOK_TYPE_CCLASS_START", // [
-    "RE_TOK_TYPE_CCLASS_END",   // ]
-    "RE_TOK_TYPE_CARET",        // ^  can be NEGATE|BEGIN
-    "RE_TOK_TYPE_NEGATE",       // ^
-    "RE_TOK_TYPE_BEGIN",        // ^
-    "RE_TOK_TYPE_END",          // $
-    "RE_TOK_TYPE_BACKSLASH",    // \ backreference, not going to implement
-    "RE_TOK_TYPE_DOT",          // .    any char except ' '
-    "RE_TOK_TYPE_CHAR",             // literal char
-    "RE_TOK_TYPE_DIGIT",            // \d   [0-9]
-    "RE_TOK_TYPE_NON_DIGIT",        // \D   [^0-9]
-    "RE_TOK_TYPE_ALPHA_NUM",        // \w   [a-bA-B0-9]
-    "RE_TOK_TYPE_NON_ALPHA_NUM",    // \W   [^a-bA-B0-9]
-    "RE_TOK_TYPE_SPACE",            // \s   ' ', \n, \t, \r
-    "RE_TOK_TYPE_NON_SPACE",        // \S   ^' '
-    "RE_TOK_TYPE_HYPHEN",           // -   (divides a range: [a-z]
-    "RE_TOK_TYPE_RANGE"              // not a meta char, but represents a range
+    RE_TOK_TYPE_REPEAT,             // {n} {n,} {n,m} counted repetition of preceding
 };
 
 /* Regex expression is broken up into tokens.
@@ -164,25 +161,157 @@ struct ReToken {
     char c0;
     char c1;
 
+    // Bounds of a repetition, max is -1 when there is no upper bound
+    int min;
+    int max;
+
+    // Code points of a char or range. Same as the bytes unless compiled with RE_UTF8
+    int cp0;
+    int cp1;
+
+    // Number of the group a ')' closes, groups are counted by their '(' from 1
+    int group;
+
     // Is used in case of a character class. All the chars are stored here
     struct ReToken *next;
 };
 
+/* Set of chars, one bit for every byte value */
+struct ReClass {
+    unsigned int bits[256 / RE_SET_BITS];
+};
+
+/* Sorted code point ranges >= 0x80 of a class, used with RE_UTF8.
+ * A negated class has one range more than it has items */
+struct ReUtf8Set {
+    int lo[RE_MAX_CCLASS + 1];
+    int hi[RE_MAX_CCLASS + 1];
+    int n;
+};
+
+/* Byte sequence of a code point range, every byte is a range: \xe0[\xa0-\xbf][\x80-\xbf] */
+struct ReUtf8Seq {
+    unsigned char len;
+    unsigned char lo[4];
+    unsigned char hi[4];
+};
+
+enum ReAstType {
+    RE_AST_CHAR,        // literal char
+    RE_AST_CLASS,       // any char in class: [abc] \d .
+    RE_AST_RANGE,       // any byte from c to c+span, part of a UTF-8 sequence
+    RE_AST_STRING,      // adjacent literal chars merged together
+    RE_AST_BOL,         // ^
+    RE_AST_EOL,         // $
+    RE_AST_CAT,         // children in sequence
+    RE_AST_ALT,         // one of the children
+    RE_AST_STAR,        // child 0 or more times
+    RE_AST_PLUS,        // child 1 or more times
+    RE_AST_QUESTION,    // child 0 or 1 time
+    RE_AST_REPEAT,      // char, class or UTF-8 byte sequences child min to max times, max -1 is unbounded
+    RE_AST_GROUP,       // child is a capture group, only with RE_CAPTURE
+};
+
+/* Node in the syntax tree that is built from the postfix tokens.
+ * CAT and ALT can have any amount of children, quantifiers have one. */
+struct ReAst {
+    enum ReAstType type;
+    char c;                     // CHAR RANGE
+    unsigned char span;         // RANGE
+    struct ReClass *cls;        // CLASS
+    const char *str;            // STRING
+    int len;
+    int min;                    // REPEAT
+    int max;
+    int group;                  // GROUP
+
+    struct ReAst *child;        // first child
+    struct ReAst *last;         // last child, for appending
+    struct ReAst *next;         // next sibling
+};
+
+/* Nodes, classes and strings used while building and rewriting the syntax tree */
+struct ReAstPool {
+    struct ReAst *nodes;
+    int n;
+    int max;
+
+    struct ReClass *classes;
+    int ncls;
+    int maxcls;
+
+    char *str;
+    int nstr;
+    int maxstr;
+
+    // alternatives are tried in order, they can't be factored or merged (RE_CAPTURE)
+    int is_ordered;
+};
+
 enum ReStateType {
-    STATE_TYPE_NONE,   // this is a state that is a char or an operator
+    STATE_TYPE_NONE,   // this is a state that is a char or a class
     STATE_TYPE_MATCH,   // no output
     STATE_TYPE_SPLIT,   // two outputs to next states
+    STATE_TYPE_BOL,     // ^ begin of input
+    STATE_TYPE_EOL,     // $ end of input
+    STATE_TYPE_COUNT,   // char or class repeated min to max times, see ReCounter
+    STATE_TYPE_UTF8_COUNT, // UTF-8 char repeated min to max times, its byte sequences start at out1
+    STATE_TYPE_UTF8_NEXT,  // a char of the UTF8_COUNT state in out1 ended, takes no char
+    STATE_TYPE_SAVE,    // start or end of a capture group, takes no char
 };
 
-struct ReState {
-    struct ReToken *t;
+/* Entry in a counter: a thread that entered the counting state at pos.
+ * A UTF-8 counter can't tell the repetitions from pos, chars take 1 to 4 bytes. Its entries
+ * keep them in reps, and pos is where the last char they counted ended */
+struct ReCount {
+    unsigned int pos;
+    unsigned int start;
+    unsigned int reps;
+};
 
+/* Counter of a counting state. Instead of a copy of the state for every repetition
+ * the state keeps the positions where threads entered it, ordered from old to new.
+ * All entries are still matching the repeated char, so the amount of repetitions of
+ * an entry is the current position - pos. Entries past max are dropped, without a max
+ * the ones past min are merged. The ring buffer is bound by the repetition count. */
+struct ReCounter {
+    int min;
+    int max;
+    struct ReCount *ring;
+    int cap;
+    int head;
+    int n;
+    unsigned int last;      // UTF-8: index where the last char that was counted ended
+};
+
+struct ReState {
     enum ReStateType type;          // indicate split or match state
 
-    // struct Token *token;
+    // state matches char c to c+span, or any char in cls when not NULL
+    char c;
+    unsigned char span;
+    struct ReClass *cls;
+
     struct ReState *out;
     struct ReState *out1;
-    unsigned char is_alloc;         // check if state is allocated
+
+    // COUNT
+    struct ReCounter *cnt;
+
+    // SAVE: index in the capture slots, 2 per group for its start and end
+    int slot;
+
+#ifdef DO_DEBUG
+    // times the state took a char, or was passed for states that don't take one.
+    // Every edge out of the state is taken as often, see re_dot()
+    unsigned long hits;
+#endif
+
+    // id of the last MatchList this state was added to, prevents duplicates
+    int lastlist;
+    // start of the thread that owns the state in that list, and index in the list
+    unsigned int laststart;
+    int lastidx;
 };
 
 /* Holds links to endpoints of NFA state chains that are part of a Group */
@@ -198,42 +327,405 @@ struct Group {
     char is_alloc;
 };
 
-/* Internal struct used when simulating the NFA state machine */
+/* Compile flags */
+enum ReFlag {
+    RE_FLAG_NONE = 0,
+    RE_GLUSHKOV  = 1 << 0,   // compile to epsilon free position automaton instead of Thompson NFA
+    RE_ICASE     = 1 << 1,   // ignore case of ASCII letters
+    RE_UTF8      = 1 << 2,   // . and classes match UTF-8 encoded chars instead of bytes
+    RE_STATS     = 1 << 3,   // count the work done by re_match(), see re_stats()
+    RE_CAPTURE   = 1 << 4,   // track groups, see re_match_captures()
+    RE_LINES     = 1 << 5,   // classes never match '\n', so a match never spans lines
+};
+
+/* Counters of a Regex compiled with RE_STATS. They add up over all calls to re_match()
+ * until re_stats_reset(). Engines count in locals and add them once per call */
+struct ReStats {
+    unsigned long nmatch;           // calls to re_match() and re_is_match()
+    unsigned long bytes;            // bytes stepped through, bytes that are scanned again count again
+    unsigned long states;           // states or positions that were checked against a byte
+    unsigned long peak;             // most states or positions active at once
+    unsigned long dfa_hits;         // lazy DFA transitions found in its cache
+    unsigned long dfa_misses;       // lazy DFA transitions that had to be computed
+    unsigned long dfa_flushes;      // times the lazy DFA cache was full and emptied
+    unsigned long dfa_fallbacks;    // flushes that came too fast, the NFA took over the rest
+    unsigned long prefilter_skips;  // start positions skipped without running the automaton
+};
+
+/* Facts that hold for every match of an expression, see re_info().
+ * Lengths are in bytes, also with RE_UTF8 */
+struct ReInfo {
+    int minlen;                 // shortest match
+    int maxlen;                 // longest match, -1 when there is no bound
+    int can_be_empty;           // the empty string matches, minlen is 0
+    int is_bol;                 // every match starts with ^
+    int is_eol;                 // every match ends with $
+    int has_anchors;            // there is a ^ or $, where a match is changes what matches
+    unsigned int first[256 / RE_SET_BITS];  // bytes a match that isn't empty can start with
+    char prefix[RE_MAX_LITERAL];    // bytes every match starts with
+    int nprefix;
+    char suffix[RE_MAX_LITERAL];    // bytes every match ends with
+    int nsuffix;
+};
+
+/* Facts of a subexpression while they are gathered from the syntax tree */
+struct ReAstInfo {
+    struct ReInfo info;
+    int is_exact;               // the prefix is the only string the subexpression matches
+};
+
+/* Glushkov position automaton.
+ * Every char/class in the expression is a position. There are no split states,
+ * a set of active positions is moved to the next set in one step without computing
+ * epsilon closures. Sets are bitsets of nwords words. */
+struct ReGlushkov {
+    struct ReState *pos;        // char/class/anchor of every position, outputs are unused
+    int npos;
+    int nwords;
+
+    unsigned int *first;        // positions that can start a match
+    unsigned int *last;         // positions that can end a match
+    unsigned int *follow;       // npos sets, positions that can follow a position
+    unsigned int *chr;          // 256 sets, positions that accept a char
+    unsigned int *anchors;      // ^ and $ positions, they don't accept a char
+    unsigned char nullable;     // expression matches empty string
+    unsigned char is_anchored;  // every match starts with ^, only match at start of input
+    unsigned char has_anchors;
+
+    // Scratch sets used by re_match()
+    unsigned int *reach;
+    unsigned int *next;
+};
+
+/* Holds first/last sets of a subexpression while building the Glushkov automaton */
+struct ReGlushkovSet {
+    unsigned int *first;
+    unsigned int *last;
+    unsigned char nullable;
+};
+
+/* Internal struct used when simulating the NFA state machine.
+ * A state is only added once per list so the size is bound by the amount of states.
+ * Every state carries the index in the input where its thread started, when two threads
+ * reach the same state the one that started leftmost wins. */
 struct MatchList {
-    struct ReState *states[RE_MAX_MATCH_LIST];
+    struct ReState **states;
+    unsigned int *starts;
     int n;
+    unsigned int pos;       // index in the input of the char the states will get
+
+    // RE_CAPTURE: capture slots of the thread of every state, see re_match_captures()
+    int *caps;
+};
+
+/* Aho-Corasick automaton, used instead of the NFA when the expression is an alternation
+ * of plain strings: GET|POST|PUT. Transitions are a dense table over byte classes, bytes
+ * that are not in any of the strings share class 0. Failure links are resolved into the
+ * table at compile time so matching is one lookup per byte. */
+struct ReAc {
+    unsigned char cls[256];     // byte class for every byte
+    int nclasses;
+    int nnodes;
+    unsigned short *delta;      // nnodes * nclasses transitions
+    unsigned short *olen;       // length of longest string that ends in node, 0 if none
+    int maxlen;                 // length of longest string
+};
+
+/* Expression that is one plain string, it is found with a substring search instead of
+ * an automaton. ms and period are the Two-Way factorization of the string: it is split
+ * after ms, the right half is compared first. */
+struct ReLiteral {
+    const unsigned char *s;
+    int len;
+    // String is between a .* before and after it, its matches grow over the chars around
+    // it that '.' takes
+    unsigned char has_head;
+    unsigned char has_tail;
+    int ms;                     // last index of the left half, -1 when it is empty
+    int period;                 // shift after the right half matched
+    int mem0;                   // bytes known to match after that shift, 0 if not periodic
+};
+
+/* Lazy DFA built from the NFA while matching.
+ * A DFA state is a set of NFA states, it is only made when a transition into it is first
+ * taken. Everything lives in one block of dfa_budget bytes from the allocator of the
+ * Regex. When the block is full all states are dropped and made again when needed. */
+struct ReDfa {
+    unsigned char cls[256];     // byte class for every byte
+    int nclasses;
+    int nnfa;                   // NFA states, no set is larger
+
+    int *trans;                 // maxstates * nclasses transitions, see RE_DFA_UNKNOWN
+    unsigned char *flags;       // ReDfaFlag bits of every state
+    int *setoff;                // start of set of every state in sets
+    int *setlen;
+    int nstates;
+    int maxstates;
+
+    int *sets;                  // NFA state indexes of all sets, sorted per set
+    int nsets;
+    int maxsets;
+
+    int *table;                 // hash table of state ids, -1 when empty
+    int tablesiz;
+
+    int start[6];               // start state of every ReDfaMode, at the start of input
+                                // and after it. -1 until it is made
+    int *scratch;               // nnfa entries, set that is being built
+    int *save;                  // RE_DFA_LANES sets that are kept when the cache is emptied
+
+    // bytes walked since the cache was emptied by walks that are done, and the bytes of
+    // the current walk at that time. Tells if the cache earns its keep, see re_dfa_flush()
+    unsigned long nbytes;
+    unsigned long mark;
+};
+
+/* Complete search DFA of at most RE_SHUF_STATES states, made from the lazy DFA when
+ * all of it fits. The row of a byte holds the next state of every state, a step is one
+ * byte shuffle and the rows of several bytes can be combined into one before the state
+ * takes them. Match and dead states loop on every byte. */
+struct ReShuffle {
+    unsigned char trans[256][RE_SHUF_STATES];
+    int nstates;
+    int start;
+    unsigned short final;       // bit of every match or dead state, a walk stops there
+    unsigned short match;       // bit of every match state
+    unsigned short eol_match;   // bit of every state that matches at the end of input
+    unsigned char has_ssse3;    // CPU has the shuffle instruction, checked when made
+};
+
+/* Bounded backtracker, used instead of the NFA lists for short inputs.
+ * It walks the NFA depth first and marks every (state, position) pair it visited in a
+ * bitmap, a pair is never walked twice. Work and memory are bound by states x positions,
+ * which is at most limit. Lives in one block from the allocator of the Regex. */
+struct ReBacktrack {
+    unsigned int *visited;      // limit bits, bit state * width + position
+    unsigned int *stack;        // pairs that wait for a walk, and capture slots to put back
+    size_t limit;
+};
+
+/* Engines a Regex can be matched with, see re_explain() and re_set_engine() */
+enum ReEngine {
+    RE_ENGINE_AUTO = 0,         // picked by the planner
+    RE_ENGINE_NFA,              // Thompson NFA lists
+    RE_ENGINE_NFA_REVERSE,      // NFA of the reversed expression, run from the end of the input
+    RE_ENGINE_BACKTRACK,        // bounded backtracker, inputs that don't fit go to the NFA
+    RE_ENGINE_DFA,              // lazy DFA, the NFA finds where a match of any length is
+    RE_ENGINE_SHUFFLE,          // shuffle DFA, only tells if there is a match
+    RE_ENGINE_GLUSHKOV,         // position automaton, compiled with RE_GLUSHKOV
+    RE_ENGINE_AHO_CORASICK,     // alternation of strings
+    RE_ENGINE_LITERAL,          // substring search for one string
+};
+
+/* Engines of a Regex, picked from the facts of the expression when it is compiled and
+ * again when a setting changes. A call takes the find engines when it needs where the
+ * match is, the test engine when it only needs to know if there is one. The DFAs are
+ * made on first use, a test engine that can't be made is replaced by the next one:
+ * shuffle, DFA, then the find engine. A DFA find engine is replaced by the NFA */
+struct RePlan {
+    enum ReEngine find;
+    enum ReEngine find_short;   // instead of find for inputs up to short_len bytes, AUTO when there is none
+    unsigned int short_len;
+    enum ReEngine test;
+    enum ReEngine force;        // set with re_set_engine(), AUTO when the planner picks
 };
 
 struct TokenList {
-    struct ReToken *tokens[RE_MAX_REGEX];
+    struct ReToken **tokens;
     int n;
-    struct ReToken pool[RE_MAX_TOKEN_POOL];
+    int max;
+
+    struct ReToken *pool;
     int pooln;
+    int poolmax;
+};
+
+/* Bump allocator, all memory used by a compiled Regex lives in one of these.
+ * Memory is never freed individually, only the full buffer at once. */
+struct ReArena {
+    char *buf;
+    size_t size;
+    size_t used;
+};
+
+/* Allocator callbacks. Used for the arena buffer in re_init_alloc() and by engines
+ * that grow at match time. When both callbacks are NULL nothing is allocated after
+ * compile and engines that need memory are not used. */
+struct ReAllocator {
+    void* (*alloc)(size_t size, void *ctx);
+    void  (*free)(void *ptr, void *ctx);
+    void *ctx;
 };
 
 /* PUBLIC */
 struct Regex {
-    struct ReState spool[RE_MAX_STATE_POOL];
+    // Holds the pools below, sized from the expression
+    struct ReArena arena;
 
-    // Expression parsed into ReToken enums
-    struct TokenList tokens;
+    // Arena buffer was allocated by re_init() and is freed by re_free()
+    unsigned char is_owner;
+
+    // ReFlag bits given at compile time
+    int flags;
+
+    // Used for the arena buffer when owned and for dynamic engines
+    struct ReAllocator alloc;
+
+    struct ReState *spool;
+    int spooln;
+    int spoolmax;
+
+    // Counters of the counting states and the ring buffers they take their entries from
+    struct ReCounter *counters;
+    int ncounters;
+    int maxcounters;
+    struct ReCount *rings;
+    int nrings;
+    int maxrings;
+
+    // Scratch lists used by re_match()
+    struct MatchList l0;
+    struct MatchList l1;
+    int listid;
 
     // The first node in the NFA
     struct ReState *start;
+
+    // First node of the NFA of the reversed expression. Only for expressions that end
+    // with $, they are matched backwards from the end of the input
+    struct ReState *rstart;
+
+    // Reversed NFA used to find where a match starts. Same as rstart when that is there,
+    // only made with RE_CAPTURE otherwise
+    struct ReState *rev;
+
+    // RE_CAPTURE: groups in the expression, and the capture slots of the thread that is
+    // being added, they end up holding the slots of the match
+    int ngroups;
+    int *caps;
+
+    // Position automaton, only used when compiled with RE_GLUSHKOV
+    struct ReGlushkov *glushkov;
+
+    // Used instead of the automatons above when expression is an alternation of strings
+    struct ReAc *ac;
+
+    // Used instead of any automaton when the expression is one string
+    struct ReLiteral *lit;
+
+    // Made on first use when there is an allocator, no_dfa is set when that failed or
+    // the NFA can't be turned into a DFA
+    struct ReDfa *dfa;
+    unsigned char no_dfa;
+    size_t dfa_budget;          // bytes the DFA may take, 0 when there is none
+
+    // Made from the DFA on first use, no_shuf is set when it has too many states
+    struct ReShuffle *shuf;
+    unsigned char no_shuf;
+
+    // Made on first use like the DFA, no_bt is set when that failed
+    struct ReBacktrack *bt;
+    unsigned char no_bt;
+    size_t bt_limit;            // largest states x positions it takes, 0 when there is none
+
+    // Engines that are used, see re_explain()
+    struct RePlan plan;
+
+    // Facts about the matches, used to skip input that can't match
+    struct ReInfo info;
+
+    // Only counted with RE_STATS
+    struct ReStats stats;
+};
+
+/* Output of re_replace(), write gets the result in pieces.
+ * It returns 0, or -1 to stop re_replace() */
+struct ReWriter {
+    int  (*write)(const char *s, size_t len, void *ctx);
+    void *ctx;
+};
+
+/* Caller buffer for re_buf_writer(), the result in it is kept '\0' terminated */
+struct ReBuf {
+    char *buf;
+    size_t size;
+    size_t len;
+};
+
+/* How re_split_next() finds a delimiter, picked from the facts of the expression */
+enum ReSplitKind {
+    RE_SPLIT_SEARCH,    // run the engine
+    RE_SPLIT_BYTE,      // one fixed byte, memchr()
+    RE_SPLIT_LITERAL,   // a fixed string, memchr() for its first byte
+    RE_SPLIT_CLASS,     // one byte of a class, a bit test per byte
+};
+
+/* Iterator of re_split_next(), fields are views into the input */
+struct ReSplit {
+    struct Regex *re;
+    const char *str;
+    unsigned int len;           // bytes in str
+    unsigned int end;           // delimiters are searched up to here, the first '\0'
+    unsigned int pos;           // start of the next field
+    unsigned int from;          // where the search for the next delimiter starts
+    enum ReSplitKind kind;
+    int is_done;
+};
+
+/* Bounds of the match or a group in re_match_captures(), -1 when a group took no part */
+struct ReCapture {
+    int istart;
+    int iend;
 };
 
-/* Return struct from re_match() that holds information about the match */
+/* Return struct from re_match() that holds information about the match.
+ * The leftmost match is returned, and the longest one of the matches that start there. */
 struct ReMatch {
     char *result;       // the resulting string, data is owned by the caller of re_match
     unsigned int istart;         // index of start of match
-    unsigned int iend;           // index of end of match
-    const char *endp;         // pointer to last character of match in input string;
+    unsigned int iend;           // index of end of match, one past the last char
+    const char *endp;         // pointer to one past the last char of match in input string
     char state;         // success/fail state of match
 };
 
 
+void  re_arena_init(struct ReArena *a, void *buf, size_t size);
+void* re_arena_alloc(struct ReArena *a, size_t size);
+struct ReAllocator re_arena_allocator(struct ReArena *a);
+
+size_t re_compile_size(const char *expr);
+size_t re_compile_size_flags(const char *expr, int flags);
+size_t re_scratch_size(const char *expr);
+size_t re_scratch_size_flags(const char *expr, int flags);
 struct Regex* re_init(struct Regex *re, const char *expr);
+struct Regex* re_init_flags(struct Regex *re, const char *expr, int flags);
+struct Regex* re_init_alloc(struct Regex *re, const char *expr, int flags, const struct ReAllocator *alloc);
+struct Regex* re_init_arena(struct Regex *re, struct ReArena *a, const char *expr, int flags);
+struct Regex* re_init_in(void *buf, size_t size, const char *expr);
+struct Regex* re_init_in_flags(void *buf, size_t size, const char *expr, int flags);
+void re_set_allocator(struct Regex *re, const struct ReAllocator *alloc);
+void re_set_dfa_budget(struct Regex *re, size_t size);
+void re_set_backtrack_limit(struct Regex *re, size_t max);
+int re_set_engine(struct Regex *re, enum ReEngine engine);
+const char* re_engine_name(enum ReEngine engine);
+void re_explain(struct Regex *re, FILE *f);
+void re_free(struct Regex *re);
 struct ReMatch re_match(struct Regex *re, const char *str, char *buf, size_t bufsiz);
+int re_is_match(struct Regex *re, const char *str);
+int re_match_captures(struct Regex *re, const char *str, struct ReCapture *caps, int ncaps);
+int re_match_batch(struct Regex *re, const unsigned int *offsets, const char *data, size_t n, unsigned char *bitmap);
+const char* re_find_line(struct Regex *re, const char *p, const char *end, const char **eol);
+int re_replace(struct Regex *re, const char *str, size_t len, const char *tmpl, const struct ReWriter *w);
+void re_buf_init(struct ReBuf *b, char *buf, size_t size);
+struct ReWriter re_buf_writer(struct ReBuf *b);
+int re_split_init(struct ReSplit *sp, struct Regex *re, const char *str, size_t len);
+int re_split_next(struct ReSplit *sp, const char **field, size_t *len);
 void re_match_debug(struct ReMatch *m);
+struct ReStats re_stats(struct Regex *re);
+struct ReInfo re_info(struct Regex *re);
+void re_stats_reset(struct Regex *re);
+#ifdef DO_DEBUG
+void re_dot(struct Regex *re, FILE *f);
+#endif
 
 #endif
@@ -0,0 +1,738 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <regex.h>
+
+#include "potato_regex.h"
+
+/* Differential test of the engines, the Thompson NFA is the oracle.
+ *
+ *   make test
+ *   obj/diff [-n random expressions] [-s seed] [-v]
+ *
+ * Every expression of the catalogue and a run of random ones are compiled with every
+ * set of flags. The NFA, forced with re_set_engine(), matches a set of inputs and every
+ * other engine that can run the expression has to give the same results for:
+ *   re_match()           the bounds of the leftmost longest match
+ *   re_is_match()
+ *   re_match_captures()  the groups, with RE_CAPTURE
+ *   re_match_batch()     the bitmap of all inputs
+ *   re_find_line()       the lines of all inputs joined by '\n'
+ *   re_replace()         the output for the same buffer, with a group with RE_CAPTURE
+ *   re_split()           the fields of the same buffer
+ * The planner, RE_ENGINE_AUTO, is checked the same way. The position automaton needs
+ * its own flag, it is compiled with RE_GLUSHKOV and checked against the NFA without it.
+ * Besides the engines every expression is checked for:
+ *   regexec()            the bounds of the match, when ERE can write the expression,
+ *                        without flags and with RE_ICASE
+ *   re_info()            the facts hold for every match the NFA finds
+ *   re_init_in_flags()   it compiles in re_compile_size() + re_scratch_size() bytes and
+ *                        not in one less, and matches the same with the scratch part
+ *                        overwritten
+ *   re_set_dfa_budget()  the smallest cache the DFA fits in flushes and thrashes, it has
+ *                        to match the same
+ * Exits with 1 when an engine differs. Messages of the library go to /dev/null unless
+ * -v is given. */
+
+#define DIFF_MAX_EXPR   256
+#define DIFF_MAX_INPUT  40
+#define DIFF_NINPUTS    32
+#define DIFF_LONG_INPUT 800
+#define DIFF_MAX_CAPS   8
+#define DIFF_JOINED     (DIFF_NINPUTS * (DIFF_LONG_INPUT + 1))
+
+static const char *catalogue[] = {
+    // literals, with the .* that only grows the match
+    "a", "abc", "b1c", ".*abc", "abc.*", ".*ab.*", "x\\.y", "é",
+
+    // alternations of strings
+    "ab|ac", "(abc|b|ca)", "a|ab|abc", "foo|foobar|fox", "é|a",
+
+    // classes and anchors
+    "[ab]+c", "[^a]*b", "\\d+", "\\w+1", "^ab", "ab$", "^a*$", "^$", "a.c", "[a-c]{2}b",
+
+    // counters, unrolled repetitions and captures
+    "a{3}", "a{2,4}b", "[ab]{3,}c", ".{2,5}$", "(ab){2,3}", "(a{2}){2}", "a{0,2}b",
+    "a{70}", "[^c]{65,80}c", "\\w{100,}$", ".{3,70}1", "é{40}", "(.){80,}$",
+    "(a)(b)?c", "(a|ab)(c|bcd)", "(a*)+b", "(a?)+", "((a)|b)+c", "(\\w+)1(\\d*)",
+
+    // blow up for the backtracker
+    "(a*)*b", "(a|aa)*c", "a?a?a?a?a?aaaaa",
+};
+
+#define NCATALOGUE (sizeof(catalogue) / sizeof(*catalogue))
+
+static const int flag_sets[] = {
+    RE_FLAG_NONE, RE_ICASE, RE_CAPTURE, RE_UTF8, RE_LINES, RE_CAPTURE | RE_ICASE | RE_UTF8,
+};
+
+#define NFLAGS (sizeof(flag_sets) / sizeof(*flag_sets))
+
+static FILE *out;
+static long nchecks;
+static long nfails;
+static unsigned long nflushes;
+static unsigned long nfallbacks;
+
+
+///// RANDOM /////////////////////////////////////////////////////
+/* Expressions and inputs are generated from a seed, a failure can be run again */
+
+static unsigned int rng = 0x2545f491;
+
+static unsigned int diff_rand(void)
+{
+    /* xorshift32 */
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+#define PICK(A) (A)[diff_rand() % (sizeof(A) / sizeof(*(A)))]
+
+static const char *atoms[] = {
+    "a", "a", "b", "b", "c", "1", "é", ".", "\\d", "\\w", "[ab]", "[^a]", "[a-cé]", "A",
+};
+
+static const char *quantifiers[] = {
+    "*", "+", "?", "{2}", "{0,2}", "{1,3}", "{2,}", "{3,5}", "*?",
+};
+
+static const char *letters[] = { "a", "b", "c", "1", "é", "A" };
+
+static const char *pieces[] = { "a", "a", "b", "b", "c", "1", "é", "€", "\xa9", "A", " ", "\n" };
+
+static void gen_alt(char *buf, size_t *n, int depth);
+
+static void gen_put(char *buf, size_t *n, const char *s)
+{
+    size_t len = strlen(s);
+    if (*n + len < DIFF_MAX_EXPR) {
+        memcpy(buf + *n, s, len);
+        *n += len;
+    }
+    buf[*n] = '\0';
+}
+
+static void gen_repeat(char *buf, size_t *n, int depth)
+{
+    /* Atom and maybe a quantifier. A group doesn't take one when the expression is
+     * almost full, so it is never cut off in the middle */
+    unsigned int r = diff_rand() % 100;
+
+    if (r < 15 && depth < 3 && *n + 32 < DIFF_MAX_EXPR) {
+        gen_put(buf, n, "(");
+        gen_alt(buf, n, depth + 1);
+        gen_put(buf, n, ")");
+    }
+    else if (r < 18) {
+        gen_put(buf, n, (diff_rand() % 2) ? "^" : "$");
+        return;
+    }
+    else {
+        gen_put(buf, n, PICK(atoms));
+    }
+
+    // "*?" is '*' and then '?'
+    if (diff_rand() % 100 < 35)
+        gen_put(buf, n, PICK(quantifiers));
+}
+
+static void gen_alt(char *buf, size_t *n, int depth)
+{
+    int nalt = (diff_rand() % 100 < 25) ? 2 + diff_rand() % 2 : 1;
+
+    for (int i=0 ; i<nalt ; i++) {
+        if (i > 0)
+            gen_put(buf, n, "|");
+        int ncat = 1 + diff_rand() % 4;
+        for (int j=0 ; j<ncat ; j++)
+            gen_repeat(buf, n, depth);
+    }
+}
+
+static void gen_expr(char *buf)
+{
+    /* Random expression, one in five an alternation of strings or a literal */
+    size_t n = 0;
+    unsigned int r = diff_rand() % 100;
+
+    buf[0] = '\0';
+    if (r < 10) {
+        int nstr = 2 + diff_rand() % 4;
+        for (int i=0 ; i<nstr ; i++) {
+            if (i > 0)
+                gen_put(buf, &n, "|");
+            int len = 1 + diff_rand() % 4;
+            for (int j=0 ; j<len ; j++)
+                gen_put(buf, &n, PICK(letters));
+        }
+    }
+    else if (r < 20) {
+        if (diff_rand() % 2)
+            gen_put(buf, &n, ".*");
+        int len = 1 + diff_rand() % 5;
+        for (int j=0 ; j<len ; j++)
+            gen_put(buf, &n, (diff_rand() % 2) ? "a" : "b");
+        if (diff_rand() % 2)
+            gen_put(buf, &n, ".*");
+    }
+    else {
+        gen_alt(buf, &n, 0);
+    }
+}
+
+static void gen_input(char *buf, size_t max)
+{
+    size_t n = 0;
+    size_t len = diff_rand() % (max + 1);
+
+    while (n < len) {
+        const char *p = PICK(pieces);
+        size_t plen = strlen(p);
+        if (n + plen > len)
+            break;
+        memcpy(buf + n, p, plen);
+        n += plen;
+    }
+    buf[n] = '\0';
+}
+
+
+///// CHECK //////////////////////////////////////////////////////
+
+/* What one engine gives for the inputs */
+struct Result {
+    struct ReMatch m[DIFF_NINPUTS];
+    int is_match[DIFF_NINPUTS];
+    int ncaps[DIFF_NINPUTS];
+    struct ReCapture caps[DIFF_NINPUTS][DIFF_MAX_CAPS + 2];
+    int nbatch;
+    unsigned char bitmap[(DIFF_NINPUTS + 7) / 8];
+    int nlines;
+    int nreplaced;
+    size_t replaced_len;
+    int nfields;
+    // only the first nlines, replaced_len and nfields entries are set
+    long lines[DIFF_NINPUTS * DIFF_LONG_INPUT];
+    char replaced[4 * DIFF_JOINED];     // "<$0>" around every match, empty ones too
+    long fields[2 * (DIFF_JOINED + 1)];  // offset and length
+};
+
+static char inputs[DIFF_NINPUTS][DIFF_LONG_INPUT + 1];
+static unsigned int offsets[DIFF_NINPUTS + 1];
+static char data[DIFF_JOINED];
+static struct Result expect, got;
+
+static void inputs_init(void)
+{
+    /* Short inputs and two long ones, a random one and a run of 'a' for the blow ups.
+     * The batch gets them back to back, re_find_line() one per line */
+    for (int i=0 ; i<DIFF_NINPUTS-2 ; i++)
+        gen_input(inputs[i], DIFF_MAX_INPUT);
+    gen_input(inputs[DIFF_NINPUTS-2], DIFF_LONG_INPUT);
+    memset(inputs[DIFF_NINPUTS-1], 'a', DIFF_LONG_INPUT);
+    inputs[DIFF_NINPUTS-1][DIFF_LONG_INPUT] = '\0';
+
+    offsets[0] = 0;
+    for (int i=0 ; i<DIFF_NINPUTS ; i++) {
+        size_t len = strlen(inputs[i]);
+        memcpy(data + offsets[i], inputs[i], len);
+        offsets[i+1] = offsets[i] + len;
+    }
+}
+
+static void run(struct Regex *re, int flags, int ncaps, const char *tmpl, struct Result *r)
+{
+    static char buf[DIFF_JOINED];
+    size_t n = 0;
+
+    memset(r, 0, offsetof(struct Result, lines));
+    for (int i=0 ; i<DIFF_NINPUTS ; i++) {
+        r->m[i] = re_match(re, inputs[i], NULL, 0);
+        r->is_match[i] = re_is_match(re, inputs[i]);
+        if (flags & RE_CAPTURE)
+            r->ncaps[i] = re_match_captures(re, inputs[i], r->caps[i], ncaps);
+    }
+    r->nbatch = re_match_batch(re, offsets, data, DIFF_NINPUTS, r->bitmap);
+
+    for (int i=0 ; i<DIFF_NINPUTS ; i++) {
+        size_t len = strlen(inputs[i]);
+        memcpy(buf + n, inputs[i], len);
+        n += len;
+        buf[n++] = '\n';
+    }
+    const char *p = buf, *end = buf + n, *eol, *bol;
+    while (p < end && (bol = re_find_line(re, p, end, &eol)) != NULL) {
+        r->lines[r->nlines++] = bol - buf;
+        p = eol + 1;
+    }
+
+    struct ReBuf b = { r->replaced, sizeof(r->replaced), 0 };
+    struct ReWriter w = re_buf_writer(&b);
+    r->nreplaced = re_replace(re, buf, n, tmpl, &w);
+    r->replaced_len = b.len;
+
+    struct ReSplit sp;
+    const char *field;
+    size_t len;
+    if (re_split_init(&sp, re, buf, n) == 0) {
+        while (r->nfields < 2 * (DIFF_JOINED + 1) && re_split_next(&sp, &field, &len)) {
+            r->fields[r->nfields++] = field - buf;
+            r->fields[r->nfields++] = len;
+        }
+    }
+}
+
+static void fail(const char *what, const char *expr, int flags, const char *engine, int input)
+{
+    nfails++;
+    fprintf(out, "FAIL %-9s %-13s flags=%-2d %s", what, engine, flags, expr);
+    if (input >= 0)
+        fprintf(out, "  input %d: \"%.40s\"%s", input, inputs[input], strlen(inputs[input]) > 40 ? "..." : "");
+    fprintf(out, "\n");
+}
+
+static void compare(const char *expr, int flags, const char *engine, int shift)
+{
+    /* Compare got to expect, the groups of expect are shift further on.
+     * Only the first input that differs is told for every call */
+    int is_same;
+
+    for (int i=0 ; i<DIFF_NINPUTS ; i++) {
+        struct ReMatch *a = &expect.m[i], *b = &got.m[i];
+        nchecks++;
+        if ((a->state > 0) != (b->state > 0) || (a->state > 0 && (a->istart != b->istart || a->iend != b->iend))) {
+            fail("match", expr, flags, engine, i);
+            break;
+        }
+    }
+
+    for (int i=0 ; i<DIFF_NINPUTS ; i++) {
+        nchecks++;
+        if (expect.is_match[i] != got.is_match[i]) {
+            fail("is_match", expr, flags, engine, i);
+            break;
+        }
+    }
+
+    for (int i=0 ; (flags & RE_CAPTURE) && i<DIFF_NINPUTS ; i++) {
+        int n = got.ncaps[i];
+        nchecks++;
+        is_same = (n <= 0) ? expect.ncaps[i] == n : expect.ncaps[i] == n + shift;
+        for (int k=0 ; is_same && k<n ; k++) {
+            struct ReCapture *a = &expect.caps[i][k == 0 ? 0 : k + shift], *b = &got.caps[i][k];
+            is_same = a->istart == b->istart && a->iend == b->iend;
+        }
+        if (!is_same) {
+            fail("captures", expr, flags, engine, i);
+            break;
+        }
+    }
+
+    nchecks++;
+    if (expect.nbatch != got.nbatch || memcmp(expect.bitmap, got.bitmap, sizeof(expect.bitmap)) != 0)
+        fail("batch", expr, flags, engine, -1);
+
+    nchecks++;
+    if (expect.nlines != got.nlines || memcmp(expect.lines, got.lines, sizeof(long) * got.nlines) != 0)
+        fail("find_line", expr, flags, engine, -1);
+
+    nchecks++;
+    if (expect.nreplaced != got.nreplaced || expect.replaced_len != got.replaced_len ||
+        memcmp(expect.replaced, got.replaced, got.replaced_len) != 0)
+        fail("replace", expr, flags, engine, -1);
+
+    nchecks++;
+    if (expect.nfields != got.nfields || memcmp(expect.fields, got.fields, sizeof(long) * got.nfields) != 0)
+        fail("split", expr, flags, engine, -1);
+}
+
+static int posix_from_expr(const char *expr, char *buf, size_t size)
+{
+    /* Write expr in ERE, \d and \w are spelled out as classes and '.' doesn't take
+     * '\n', like it does here. Anchors are only taken at the ends, glibc lets one in a
+     * repeated group hold in the middle of the input.
+     * Returns 0, or -1 when ERE can't write it */
+    size_t n = 0;
+    int in_class = 0;
+
+    for (const char *p=expr ; *p ; p++) {
+        const char *s = NULL;
+        char c[2] = { *p, '\0' };
+
+        if (in_class) {
+            in_class = *p != ']';
+            s = c;
+        }
+        else if (*p == '[') {
+            in_class = 1;
+            s = c;
+        }
+        else if (*p == '.') {
+            s = "[^\n]";
+        }
+        else if ((*p == '^' && p != expr) || (*p == '$' && p[1] != '\0')) {
+            return -1;
+        }
+        else if (*p == '\\') {
+            p++;
+            if (*p == 'd')
+                s = "[0-9]";
+            else if (*p == 'w')
+                s = "[0-9A-Za-z_]";
+            else if (*p == '.')
+                s = "\\.";
+            else
+                return -1;
+        }
+        else {
+            s = c;
+        }
+        size_t len = strlen(s);
+        if (n + len >= size)
+            return -1;
+        memcpy(buf + n, s, len);
+        n += len;
+    }
+    buf[n] = '\0';
+    return 0;
+}
+
+static void check_posix(const char *expr, int flags)
+{
+    /* POSIX finds the leftmost longest match as well, its bounds have to be the ones
+     * the NFA found. Expressions regcomp() doesn't take are left out */
+    char pexpr[4 * DIFF_MAX_EXPR];
+    regex_t preg;
+    regmatch_t pm[1];
+
+    if ((flags & ~RE_ICASE) != 0 || posix_from_expr(expr, pexpr, sizeof(pexpr)) < 0)
+        return;
+    if (regcomp(&preg, pexpr, REG_EXTENDED | ((flags & RE_ICASE) ? REG_ICASE : 0)) != 0)
+        return;
+    for (int i=0 ; i<DIFF_NINPUTS ; i++) {
+        struct ReMatch *m = &expect.m[i];
+        int is_match = regexec(&preg, inputs[i], 1, pm, 0) == 0;
+        nchecks++;
+        if (is_match != (m->state > 0) ||
+            (is_match && (pm[0].rm_so != (regoff_t)m->istart || pm[0].rm_eo != (regoff_t)m->iend))) {
+            fail("posix", expr, flags, "posix", i);
+            break;
+        }
+    }
+    regfree(&preg);
+}
+
+static void check_info(struct Regex *re, const char *expr, int flags)
+{
+    /* Every match the NFA found has the length, anchors, first byte, prefix and suffix
+     * re_info() tells */
+    struct ReInfo info = re_info(re);
+
+    for (int i=0 ; i<DIFF_NINPUTS ; i++) {
+        struct ReMatch *m = &expect.m[i];
+        if (m->state <= 0)
+            continue;
+        const char *s = inputs[i] + m->istart;
+        unsigned char c = s[0];
+        int len = m->iend - m->istart;
+        nchecks++;
+        if (len < info.minlen || (info.maxlen >= 0 && len > info.maxlen) ||
+            (len == 0 && !info.can_be_empty) ||
+            (info.is_bol && m->istart != 0) || (info.is_eol && m->iend != strlen(inputs[i])) ||
+            (len > 0 && !((info.first[c / RE_SET_BITS] >> (c % RE_SET_BITS)) & 1)) ||
+            len < info.nprefix || memcmp(s, info.prefix, info.nprefix) != 0 ||
+            len < info.nsuffix || memcmp(s + len - info.nsuffix, info.suffix, info.nsuffix) != 0) {
+            fail("info", expr, flags, "-", i);
+            break;
+        }
+    }
+}
+
+static void check_init_in(const char *expr, int flags, const char *tmpl)
+{
+    /* Compile into a buffer of exactly the size the expression needs. Only the first
+     * re_compile_size() bytes are kept, the rest is overwritten before matching */
+    size_t keep = re_compile_size_flags(expr, flags);
+    size_t size = keep + re_scratch_size_flags(expr, flags);
+    char *buf = aligned_alloc(RE_ARENA_ALIGN, (size + RE_ARENA_ALIGN - 1) / RE_ARENA_ALIGN * RE_ARENA_ALIGN);
+    struct Regex *re;
+
+    nchecks++;
+    if (buf == NULL || keep == 0)
+        return;
+    if (re_init_in_flags(buf, size - 1, expr, flags) != NULL) {
+        fail("init_in", expr, flags, "size - 1", -1);
+    }
+    else if ((re = re_init_in_flags(buf, size, expr, flags)) == NULL) {
+        fail("init_in", expr, flags, "size", -1);
+    }
+    else if ((char*)re->arena.buf + re->arena.size > buf + keep) {
+        fail("init_in", expr, flags, "kept", -1);
+    }
+    else {
+        memset(buf + keep, 0xa5, size - keep);
+        run(re, flags, DIFF_MAX_CAPS, tmpl, &got);
+        compare(expr, flags, "init_in", 2);
+    }
+    free(buf);
+}
+
+static void check_dfa_budget(const char *expr, int flags, const char *tmpl)
+{
+    /* Give the DFA the smallest cache it can be made in, so it is emptied and thrashes
+     * on the inputs. It finds and tests alone, and in the plan */
+    struct Regex re;
+    size_t budget;
+
+    if (re_init_flags(&re, expr, flags | RE_STATS) == NULL)
+        return;
+    for (budget=512 ; budget<RE_DFA_CACHE_SIZE ; budget+=budget/4) {
+        re_set_dfa_budget(&re, budget);
+        if (re_set_engine(&re, RE_ENGINE_DFA) == 0)
+            break;
+    }
+    if (budget < RE_DFA_CACHE_SIZE) {
+        run(&re, flags, DIFF_MAX_CAPS, tmpl, &got);
+        compare(expr, flags, "dfa budget", 2);
+        re_set_engine(&re, RE_ENGINE_AUTO);
+        run(&re, flags, DIFF_MAX_CAPS, tmpl, &got);
+        compare(expr, flags, "auto budget", 2);
+
+        struct ReStats st = re_stats(&re);
+        nflushes += st.dfa_flushes;
+        nfallbacks += st.dfa_fallbacks;
+    }
+    re_free(&re);
+}
+
+static void check(const char *expr, int flags)
+{
+    /* Check every engine that can run expr against the NFA. The oracle is compiled from
+     * ((expr)), so it has an NFA also when expr is a string or an alternation of them.
+     * With RE_CAPTURE its groups are 2 further on */
+    char oexpr[DIFF_MAX_EXPR + 8];
+    struct Regex oracle, re;
+
+    // the first group of expr is the third one of the oracle
+    const char *tmpl = (flags & RE_CAPTURE) ? "<$0|$1>" : "<$0>";
+    const char *otmpl = (flags & RE_CAPTURE) ? "<$0|$3>" : "<$0>";
+
+    snprintf(oexpr, sizeof(oexpr), "((%s))", expr);
+    if (re_init_flags(&oracle, oexpr, flags) == NULL)
+        return;
+    if (re_set_engine(&oracle, RE_ENGINE_NFA) < 0) {
+        fail("no nfa", oexpr, flags, "nfa", -1);
+        re_free(&oracle);
+        return;
+    }
+    run(&oracle, flags, DIFF_MAX_CAPS + 2, otmpl, &expect);
+    re_free(&oracle);
+
+    if (re_init_flags(&re, expr, flags) == NULL) {
+        fail("compile", expr, flags, "-", -1);
+        return;
+    }
+    for (int e=RE_ENGINE_AUTO ; e<=RE_ENGINE_LITERAL ; e++) {
+        if (e == RE_ENGINE_GLUSHKOV || re_set_engine(&re, e) < 0)
+            continue;
+        run(&re, flags, DIFF_MAX_CAPS, tmpl, &got);
+        compare(expr, flags, re_engine_name(e), 2);
+    }
+    check_info(&re, expr, flags);
+    re_free(&re);
+
+    // the position automaton can't capture
+    if (!(flags & RE_CAPTURE) && re_init_flags(&re, expr, flags | RE_GLUSHKOV) != NULL) {
+        if (re_set_engine(&re, RE_ENGINE_GLUSHKOV) == 0) {
+            run(&re, flags, DIFF_MAX_CAPS, tmpl, &got);
+            compare(expr, flags, "glushkov", 2);
+        }
+        re_free(&re);
+    }
+
+    check_posix(expr, flags);
+    check_init_in(expr, flags, tmpl);
+    check_dfa_budget(expr, flags, tmpl);
+}
+
+///// CASES //////////////////////////////////////////////////////
+/* Calls whose results are known, for what the engines can't be checked against */
+
+static const struct {
+    const char *expr;
+    int flags;
+    int minlen, maxlen, is_bol, is_eol;
+    const char *prefix, *suffix;
+} info_cases[] = {
+    { "abc",            0,       3,  3, 0, 0, "abc", "abc" },
+    { "a{2,4}b",        0,       3,  5, 0, 0, "aa",  "b"   },
+    { "[ab]{3,}c",      0,       4, -1, 0, 0, "",    "c"   },
+    { "(foo|bar)baz",   0,       6,  6, 0, 0, "",    "baz" },
+    { "foo|foobar|fox", 0,       3,  6, 0, 0, "fo",  ""    },
+    { "^ab",            0,       2,  2, 1, 0, "ab",  "ab"  },
+    { "ab$",            0,       2,  2, 0, 1, "ab",  "ab"  },
+    { "a*",             0,       0, -1, 0, 0, "",    ""    },
+    { ".",              RE_UTF8, 1,  4, 0, 0, "",    ""    },
+};
+
+static const struct {
+    const char *expr;
+    int flags;
+    const char *str, *tmpl, *result;
+    int n;
+} replace_cases[] = {
+    { "a+",           0,          "caaab",              "<$0>",       "c<aaa>b",                  1 },
+    { "x*",           0,          "ab",                 "-",          "-a-b-",                    3 },
+    { "(\\w+)@(\\w+)", RE_CAPTURE, "me@host, you@there", "$2 at ${1}", "host at me, there at you", 2 },
+    { "b",            0,          "abc",                "$$",         "a$c",                      1 },
+    { "[0-9]{3}",     0,          "a1234567b",          "#",          "a##7b",                    2 },
+    { "A",            RE_ICASE,   "aAa",                "_",          "___",                      3 },
+    { "(a)|b",        RE_CAPTURE, "ab",                 "[$1]",       "[a][]",                    2 },
+};
+
+static const struct {
+    const char *expr;
+    const char *str, *fields;   // fields joined by '|'
+} split_cases[] = {
+    { ",",          "a,b,,c",  "a|b||c"    },
+    { "\\s*;\\s*",  "x ; y;z", "x|y|z"     },
+    { "[0-9]+",     "a12b3c",  "a|b|c"     },
+    { "-",          "",        ""          },
+    { "x*",         "abc",     "|a|b|c|"   },
+    { "ab",         "abab",    "||"        },
+};
+
+#define NCASES(A) (sizeof(A) / sizeof(*(A)))
+
+static void check_cases(void)
+{
+    struct Regex re;
+    char buf[256];
+
+    for (unsigned int i=0 ; i<NCASES(info_cases) ; i++) {
+        nchecks++;
+        if (re_init_flags(&re, info_cases[i].expr, info_cases[i].flags) == NULL) {
+            fail("compile", info_cases[i].expr, info_cases[i].flags, "-", -1);
+            continue;
+        }
+        struct ReInfo in = re_info(&re);
+        if (in.minlen != info_cases[i].minlen || in.maxlen != info_cases[i].maxlen ||
+            in.is_bol != info_cases[i].is_bol || in.is_eol != info_cases[i].is_eol ||
+            in.can_be_empty != (info_cases[i].minlen == 0) ||
+            in.nprefix != (int)strlen(info_cases[i].prefix) || memcmp(in.prefix, info_cases[i].prefix, in.nprefix) != 0 ||
+            in.nsuffix != (int)strlen(info_cases[i].suffix) || memcmp(in.suffix, info_cases[i].suffix, in.nsuffix) != 0)
+            fail("info", info_cases[i].expr, info_cases[i].flags, "re_info", -1);
+        re_free(&re);
+    }
+
+    for (unsigned int i=0 ; i<NCASES(replace_cases) ; i++) {
+        nchecks++;
+        if (re_init_flags(&re, replace_cases[i].expr, replace_cases[i].flags) == NULL) {
+            fail("compile", replace_cases[i].expr, replace_cases[i].flags, "-", -1);
+            continue;
+        }
+        struct ReBuf b = { buf, sizeof(buf), 0 };
+        struct ReWriter w = re_buf_writer(&b);
+        const char *str = replace_cases[i].str;
+        int n = re_replace(&re, str, strlen(str), replace_cases[i].tmpl, &w);
+        if (n != replace_cases[i].n || strcmp(buf, replace_cases[i].result) != 0)
+            fail("replace", replace_cases[i].expr, replace_cases[i].flags, "re_replace", -1);
+        re_free(&re);
+    }
+
+    for (unsigned int i=0 ; i<NCASES(split_cases) ; i++) {
+        struct ReSplit sp;
+        const char *field;
+        size_t len, n = 0;
+        int nfield = 0;
+
+        nchecks++;
+        if (re_init(&re, split_cases[i].expr) == NULL) {
+            fail("compile", split_cases[i].expr, 0, "-", -1);
+            continue;
+        }
+        const char *str = split_cases[i].str;
+        if (re_split_init(&sp, &re, str, strlen(str)) == 0) {
+            while (re_split_next(&sp, &field, &len) && n + len + 1 < sizeof(buf)) {
+                if (nfield++ > 0)
+                    buf[n++] = '|';
+                memcpy(buf + n, field, len);
+                n += len;
+            }
+        }
+        buf[n] = '\0';
+        if (strcmp(buf, split_cases[i].fields) != 0)
+            fail("split", split_cases[i].expr, 0, "re_split", -1);
+        re_free(&re);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-n random expressions] [-s seed] [-v]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    int n = 200;
+    int is_verbose = 0;
+    char expr[DIFF_MAX_EXPR];
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:vh")) != -1) {
+        switch (opt) {
+            case 'n':
+                n = atoi(optarg);
+                break;
+            case 's':
+                rng = strtoul(optarg, NULL, 0);
+                break;
+            case 'v':
+                is_verbose = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (rng == 0) {
+        fprintf(stderr, "seed must not be 0\n");
+        return 1;
+    }
+
+    // the report goes to the real stdout, the chatter of the library doesn't
+    if ((out = fdopen(dup(STDOUT_FILENO), "w")) == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        perror("stdout");
+        return 1;
+    }
+    if (!is_verbose && freopen("/dev/null", "w", stderr) == NULL)
+        return 1;
+
+    check_cases();
+    for (unsigned int i=0 ; i<NCATALOGUE ; i++) {
+        inputs_init();
+        for (unsigned int f=0 ; f<NFLAGS ; f++)
+            check(catalogue[i], flag_sets[f]);
+    }
+    for (int i=0 ; i<n ; i++) {
+        gen_expr(expr);
+        inputs_init();
+        for (unsigned int f=0 ; f<NFLAGS ; f++)
+            check(expr, flag_sets[f]);
+    }
+
+    // the small caches have to get to the paths they are there for
+    nchecks++;
+    if (nflushes == 0 || nfallbacks == 0)
+        fail("dfa budget", "-", 0, "no flush or fallback", -1);
+
+    fprintf(out, "%u + %d expressions, %zu flag sets, %ld checks, %ld failed, %lu dfa flushes, %lu fallbacks\n",
+            (unsigned int)NCATALOGUE, n, NFLAGS, nchecks, nfails, nflushes, nfallbacks);
+    fclose(out);
+    return nfails > 0;
+}